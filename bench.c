@@ -0,0 +1,1335 @@
+/* 
+   bench.c -- time the parts of overhead.c that handle messages.
+
+   We build this by including all of overhead.c (with its main()
+   renamed), so we can call anything in it, linked with the dummy
+   Moxa functions.  "make bench" builds it and runs it on the sample
+   requests in corpus/, and on 1 to 4 made-up detectors with long
+   config strings and a few events each.  It also times requests and
+   responses over a loopback TCP connection to a stand-in for CVM,
+   with and without the socket options.  And it checks that the
+   events one client asks for are still there for the others (CVM),
+   also with 50 idle clients connected, and that push mode connects
+   to a stand-in for CVM, sends it the updates and heartbeats, and
+   dials again, waiting longer each time, when it goes away; if a
+   check fails, it says so on stderr and exits with 1.
+
+   Each line of output is one measurement, tab separated:
+
+       <benchmark>  <input>  <ns/op>  <allocs/op>  <bytes/op>  <iterations>
+
+   so the output can be compared from one build to the next.  A
+   line that starts with arena_peak instead gives the most of the
+   XML arena a parse used, and the size reserved, in bytes.  A line
+   that starts with poll_jitter gives how late the polling ticks
+   were -- half of them, 9 in 10, 99 in 100, and the worst -- in
+   microseconds, and how many ticks.  The
+   allocations are the malloc() and realloc() calls made by
+   overhead.c (and this file); those made inside the C library, by
+   fopen() for example, are not counted.
+*/
+
+#define _GNU_SOURCE               /* as overhead.c */
+#include <stdlib.h>       /* malloc, realloc */
+#include <pthread.h>      /* pthread_create, pthread_join */
+
+long long bench_allocs = 0;
+long long bench_bytes = 0;
+
+void *bench_malloc(size_t n)
+{
+    bench_allocs += 1;
+    bench_bytes += n;
+    return(malloc(n));
+}
+
+void *bench_realloc(void *p, size_t n)
+{
+    bench_allocs += 1;
+    bench_bytes += n;
+    return(realloc(p, n));
+}
+
+#define malloc(n) bench_malloc(n)
+#define realloc(p,n) bench_realloc(p,n)
+
+#define main overhead_main
+#include "overhead.c"
+#undef main
+
+#define DEFAULT_ITERATIONS 100000
+
+/* results go here, so the compiler cannot throw the work away */
+volatile int bench_sink = 0;
+
+/* ***************************************************************** */
+/*                                                                   */
+/*                                                                   */
+/* ***************************************************************** */
+
+/* The original recursive parser, which copied each tag and value
+   into its own malloc()ed string and wrote NULs into the message
+   buffer.  We keep it here to compare against. */
+
+struct legacy_xml_element
+{
+    struct legacy_xml_element *next /* peer nodes */;
+    STRING key;
+
+    /* the "value" is either a string, or another XML element */
+    struct legacy_xml_element *xml_list /* child node */;
+    STRING value;
+};
+
+
+STRING legacy_search_xml_value(struct legacy_xml_element *list, STRING key)
+{
+    struct legacy_xml_element *p;
+    p = list;
+    while (p != NULL)
+        {
+            if (mystrcasecmp(key, p->key))
+                return(p->value);
+            p = p->next;
+        }
+    return(NULL);
+}
+
+void legacy_free_xml_element(struct legacy_xml_element *root)
+{
+    struct legacy_xml_element *element;
+
+    element = root;
+    while (element != NULL)
+        {
+            free(element->key);
+            if (element->value != NULL) free(element->value);
+            if (element->xml_list != NULL)
+                legacy_free_xml_element(element->xml_list);
+
+            struct legacy_xml_element *next = element->next;
+            free(element);
+            element = next;
+        }
+}
+
+
+Boolean legacy_is_XML_comment(STRING buffer)
+{
+    /* XML comment looks like <!--...--> */    
+    if ((buffer[0] == '<')
+        && (buffer[1] == '!')
+        && (buffer[2] == '-')
+        && (buffer[3] == '-')) return(TRUE);
+    return(FALSE);
+}
+
+Boolean legacy_is_XML_comment_end(STRING buffer)
+{
+    if ((buffer[0] == '-')
+        && (buffer[1] == '-')
+        && (buffer[2] == '>')) return(TRUE);
+    return(FALSE);
+}
+
+STRING legacy_find_end_of_comment(STRING buffer)
+{
+    /* buffer points at a comment; skip it */
+    /* XML comment looks like <!--...--> */
+
+    /* skip opening part; we know it matches exactly */
+    buffer = buffer+4;
+    while (!legacy_is_XML_comment_end(buffer))
+        {
+            if (*buffer == '\0') return(NULL);
+            buffer++;
+        }
+    buffer += 3;
+    return(buffer);
+}
+
+Boolean legacy_is_XML_declaration(STRING buffer)
+{
+    /* XML declaration looks like  <?xml...?> */
+    if ((buffer[0] == '<')
+        && (buffer[1] == '?')
+        && (buffer[2] == 'x')
+        && (buffer[3] == 'm')
+        && (buffer[4] == 'l')) return(TRUE);
+    return(FALSE);
+}
+
+Boolean legacy_is_XML_declaration_end(STRING buffer)
+{
+    if ((buffer[0] == '?')
+        && (buffer[1] == '>')) return(TRUE);
+    return(FALSE);
+}
+
+STRING legacy_find_end_of_declaration(STRING buffer)
+{
+    /* buffer points at a declaration; skip it */
+    /* XML declaration looks like  <?xml...?> */
+    buffer = buffer+5;
+    while (!legacy_is_XML_declaration_end(buffer))
+        {
+            if (*buffer == '\0') return(NULL);
+            buffer++;
+        }
+    buffer += 2;
+    return(buffer);
+}
+
+
+STRING legacy_find_end_of_tag(STRING buffer)
+{
+    /* find end of tag */
+    while (istagchar(*buffer)) buffer++;
+    /* if we found the end of the input */
+    if (*buffer == '\0') return(NULL);
+    
+    /* terminate the tag as a string */
+    if (*buffer == '>')
+        {
+            *buffer = '\0';
+        }
+    else
+        {
+            *buffer = '\0';
+            buffer++;            
+            /* it appears we have attributes.  In this application of
+               XML, so far, we have no need for attributes -- skip them */
+            while ((*buffer != '>') && (*buffer != '\0')) buffer++;
+            if (*buffer == '\0') return(NULL);
+        }
+    
+    /* advance past the '>' to the next significant character */
+    buffer++;                        
+    while ((*buffer != '\0') && isspace(*buffer)) buffer++;
+    return(buffer);
+}
+
+
+STRING legacy_get_value(STRING buffer, STRING *value)
+{
+    /* We have found something other than a tag,
+       capture that value (until the next '<') 
+       and advance the buffer pointer */
+    /* skip any leading blanks */
+    while ((*buffer != '\0') && isspace(*buffer))
+        buffer++;
+
+    STRING begin = buffer;
+
+    /* find next tag  (or end of string) */
+    while ((*buffer != '<') && (*buffer != '\0'))
+        buffer++;
+
+    if (*buffer == '\0')
+        {
+            *value = remember_string(begin);
+        }
+    else
+        {
+            /* if we found the start of a tag */
+            /* temporarily change the < to \0, so
+               that we terminate the value part,
+               save the string, then put the < back */
+            *buffer = '\0';
+            *value = remember_string(begin);
+            *buffer = '<';            
+
+            /* trim leading and trailng spaces */
+            STRING v = *value;
+            int n = strlen(v);
+            while ((n > 0) && isspace(v[n-1]))
+                {
+                    n -= 1;
+                    v[n] = '\0';
+                }
+        }
+
+    return(buffer);
+}
+
+
+STRING legacy_parse_xml_element(STRING buffer, struct legacy_xml_element *tag_tree)
+{
+    /* skip any leading blanks */
+    while ((*buffer != '\0') && isspace(*buffer)) buffer++;
+    if (*buffer == '\0') return(NULL);
+
+    if (*buffer != '<')	       /* string value */
+        {
+            buffer = legacy_get_value(buffer, &(tag_tree->value));
+            return(buffer);
+        }
+    
+    /* XML comments are skipped; start over as if not here */
+    if (legacy_is_XML_comment(buffer))
+        {
+            buffer = legacy_find_end_of_comment(buffer);
+            return(legacy_parse_xml_element(buffer, tag_tree));
+        }
+
+    /* XML declarations are treated as comments for this application. */
+    if (legacy_is_XML_declaration(buffer))
+        {
+            buffer = legacy_find_end_of_declaration(buffer);
+            return(legacy_parse_xml_element(buffer, tag_tree));
+        }
+
+    /* another tag.  parse <tag> ... </tag> */
+    /* Advance past the < */
+    buffer++;
+
+    /* Now we have something that we need to pay attention to */
+    /* not a comment or a declaration, but a real tag. */
+    
+    STRING tag = buffer;
+    buffer = legacy_find_end_of_tag(buffer);
+    if (*buffer == '\0') return(NULL);
+    tag_tree->key = remember_string(tag);
+
+    /* new tag */
+    if (*buffer != '<')
+        {
+            /* value of this item is a string */
+            buffer = legacy_get_value(buffer, &(tag_tree->value));
+        }
+    else
+        {
+            /* value of this item is a list of new elements */
+            /* accumulate a sequence of tags, until we finally get /tag */
+            while ((*buffer == '<') && (buffer[1] != '/'))
+                {
+                    struct legacy_xml_element *tree = TYPED_MALLOC(struct legacy_xml_element);
+                    tree->xml_list = NULL;            
+                    tree->value = NULL;
+
+                    tree->next = tag_tree->xml_list;
+                    tag_tree->xml_list = tree;
+                    /* recursively parse the rest of the message */
+                    buffer = legacy_parse_xml_element(buffer, tree);
+                    if ((buffer == NULL) || (*buffer == '\0')) return(NULL);                    
+                }
+       }
+
+    /* now we have (should have) an end tag.  See if it matches. */
+    if (*buffer == '<') buffer++; /* skip < */
+    if (*buffer == '/') buffer++; /* skip / */    
+    if (*buffer == '\0') return(NULL);
+
+    STRING end_tag = buffer;
+    buffer = legacy_find_end_of_tag(buffer);
+    if (!mystrcasecmp(end_tag, tag))
+        fprintf(stderr, "tags do not match: <%s> ... </%s>\n", tag, end_tag);
+
+    return(buffer);
+}
+
+/* ***************************************************************** */
+/*                                                                   */
+/*                                                                   */
+/* ***************************************************************** */
+
+double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(ts.tv_sec * 1e9 + ts.tv_nsec);
+}
+
+/* where we were when the benchmark started */
+double bench_start;
+long long bench_start_allocs;
+long long bench_start_bytes;
+
+void begin(void)
+{
+    bench_start_allocs = bench_allocs;
+    bench_start_bytes = bench_bytes;
+    bench_start = now_ns();
+}
+
+void report(STRING benchmark, STRING input, int iterations)
+{
+    double ns = now_ns() - bench_start;
+    printf("%s\t%s\t%.1f\t%.2f\t%.1f\t%d\n", benchmark, input,
+           ns / iterations,
+           CAST(double, bench_allocs - bench_start_allocs) / iterations,
+           CAST(double, bench_bytes - bench_start_bytes) / iterations,
+           iterations);
+}
+
+STRING read_corpus_file(STRING name, int *length)
+{
+    FILE *f = fopen(name, "r");
+    if (f == NULL)
+        {
+            perror(name);
+            return(NULL);
+        }
+    fseek(f, 0, SEEK_END);
+    int n = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    STRING buffer = CAST(STRING, malloc(n + 1));
+    n = fread(buffer, 1, n, f);
+    buffer[n] = '\0';
+    fclose(f);
+    *length = n;
+    return(buffer);
+}
+
+
+void bench_legacy_parser(STRING name, STRING message, int n, int iterations)
+{
+    /* the old parser writes into its buffer, so it needs a fresh copy each time */
+    STRING scratch = CAST(STRING, malloc(n + 1));
+    begin();
+    int i;
+    for (i = 0; i < iterations; i++)
+        {
+            memcpy(scratch, message, n + 1);
+            struct legacy_xml_element *root = TYPED_MALLOC(struct legacy_xml_element);
+            root->next = NULL;
+            root->key = NULL;
+            root->xml_list = NULL;
+            root->value = NULL;
+            legacy_parse_xml_element(scratch, root);
+            if ((root->key != NULL) && mystrcasecmp(root->key, "retrieveDataReq"))
+                {
+                    bench_sink += (legacy_search_xml_value(root->xml_list, "overheightData") != NULL);
+                    bench_sink += (legacy_search_xml_value(root->xml_list, "refId") != NULL);
+                    bench_sink += (legacy_search_xml_value(root->xml_list, "icdVersion") != NULL);
+                }
+            legacy_free_xml_element(root);
+        }
+    report("parse_legacy", name, iterations);
+    free(scratch);
+}
+
+/* the elements the validator counts in a message, which the live
+   path sizes the arena from */
+int bench_elements(STRING message, int n)
+{
+    struct XML_PULL x;
+    struct XML_TOKEN t;
+    struct VALIDATOR v;
+
+    xml_pull_init(&x, message, n);
+    validator_init(&v);
+    while ((v.state != VS_VALID) && (v.state != VS_INVALID))
+        {
+            xml_pull_next(&x, &t);
+            validate_token(&v, &x, &t);
+        }
+    return(v.elements);
+}
+
+void bench_tree_parser(STRING name, STRING message, int n, int iterations)
+{
+    int elements = bench_elements(message, n);
+    begin();
+    int i;
+    for (i = 0; i < iterations; i++)
+        {
+            Arena_Reserve(&xml_arena, xml_arena_size(elements));
+            struct xml_element *root = parse_xml_message(&xml_arena, message, n);
+            /* the same lookups Handle_Retrieve_Data_Req() does */
+            if ((root != NULL) && (root->tag == TAG_RETRIEVEDATAREQ))
+                {
+                    struct xml_element *field[TAG_COUNT];
+                    index_xml_children(root->xml_list, field);
+                    bench_sink += (field[TAG_OVERHEIGHTDATA] != NULL);
+                    bench_sink += (field[TAG_REFID] != NULL);
+                    bench_sink += (field[TAG_ICDVERSION] != NULL);
+                }
+            Arena_Release(&xml_arena);
+        }
+    report("parse_tree", name, iterations);
+    printf("arena_peak\t%s\t%d\t%d\n", name, xml_arena.peak, xml_arena_size(elements));
+}
+
+void bench_tokenizer(STRING name, STRING message, int n, int iterations)
+{
+    begin();
+    int i;
+    int tokens = 0;
+    for (i = 0; i < iterations; i++)
+        {
+            struct XML_PULL x;
+            struct XML_TOKEN t;
+            xml_pull_init(&x, message, n);
+            while (xml_pull_next(&x, &t) < XT_EOF) tokens += 1;
+        }
+    bench_sink += tokens;
+    report("parse_tokens", name, iterations);
+}
+
+
+/* ***************************************************************** */
+/*                                                                   */
+/*                                                                   */
+/* ***************************************************************** */
+
+/* Made-up detectors for the response and event messages.  The
+   config strings are about as long as any site uses. */
+
+STRING Bench_Device_Names[MAX_DETECTORS] = { "north", "south", "east", "west" };
+
+char bench_directory[] = "/tmp/benchXXXXXX";
+
+void bench_free_devices(void)
+{
+    int i;
+    for (i = 0; i < MAX_DETECTORS; i++)
+        {
+            if (DDD[i] == NULL) continue;
+            unlink(DDD[i]->eventFileName);
+            free_DDD(DDD[i]);
+            DDD[i] = NULL;
+        }
+}
+
+void bench_devices(int devices, int events)
+{
+    int i, j;
+
+    bench_free_devices();
+    for (i = 0; i < devices; i++)
+        {
+            DEVICE d = search_device_array(Bench_Device_Names[i]);
+            d->providerName = remember_string("Texas Department of Transportation, Austin District");
+            d->resourceType = remember_string("overheight-vehicle-detector");
+            d->centerId = remember_string("AUSDIST-TRAFFIC-MANAGEMENT-CENTER");
+            d->id = remember_string("IH35-northbound-mile-marker-234-cabinet-17-detector");
+            d->triggerHeight = remember_string("204");
+            d->event_channel = 2*i;
+            d->fault_channel = 2*i + 1;
+            d->status = ST_ACTIVE;
+
+            char name[MAX_FILENAME_LENGTH];
+            snprintf(name, sizeof(name), "%s/%s.txt", bench_directory, d->name);
+            d->eventFileName = remember_string(name);
+
+            struct Timestamp timedate = { 0, 0, 0, 8, 18, 10, 2026 };
+            for (j = 0; j < events; j++)
+                {
+                    timedate.min = j % 60;
+                    timedate.sec = (7 * j) % 60;
+                    WriteEventToFile(d, &timedate);
+                }
+        }
+}
+
+
+/* The whole of a message as the program handles it: the reader
+   runs each token thru the validator and the fast path together
+   (reader_tokens()), and then the message is answered from the fast
+   path, or from the tree if the fast path did not match; and the
+   response is set up.  live_tree is the same with the fast path
+   turned off, so every message goes to the tree. */
+void bench_live_path(STRING name, STRING message, int n, int iterations, Boolean fastpath)
+{
+    int hits = 0;
+    begin();
+    int i;
+    for (i = 0; i < iterations; i++)
+        {
+            /* as if the reader had just read it all */
+            struct CVM_READER r;
+            r.body = message;
+            r.n = n;
+            r.have = n;
+            xml_pull_init(&r.pull, r.body, 0);
+            fastpath_init(&r.fp);
+            if (!fastpath) r.fp.state = FP_FAIL;
+            validator_init(&r.v);
+            reader_tokens(&r);
+            if (r.fp.state == FP_MATCH) hits += 1;
+
+            struct RESPONSE_CURSOR response;
+            response.reader = NULL;
+            if (Parse_CVM_Message(&r, &response))
+                {
+                    bench_sink += 1;
+                    Finish_XML_Response(&response, FALSE);
+                }
+        }
+    if (!fastpath)
+        report("live_tree", name, iterations);
+    else
+        report((hits > 0) ? "live_fastpath" : "live_fastpath_miss", name, iterations);
+}
+
+/* the response, both passes: counting it, then generating it (here
+   into memory rather than onto a socket) */
+void bench_format_response(STRING name, int iterations)
+{
+    struct RESPONSE_CURSOR response;
+    response.reader = NULL;
+    Start_XML_Response(&response, "42", 2, NULL, 0);
+
+    begin();
+    int i;
+    for (i = 0; i < iterations; i++)
+        {
+            struct BUFFER sizing = { 0, 0, NULL, BM_SIZE, 0 };
+            Rewind_XML_Response(&response);
+            while (Next_XML_Response_Piece(&response, &sizing)) continue;
+
+            struct BUFFER *buffer = ClearBuffer();
+            Rewind_XML_Response(&response);
+            while (Next_XML_Response_Piece(&response, buffer)) continue;
+            bench_sink += sizing.total + buffer->n;
+        }
+    report("format_response", name, iterations);
+
+    Finish_XML_Response(&response, FALSE);
+}
+
+/* read all of n bytes from a blocking socket */
+Boolean bench_recv_all(FileDesc fd, UINT8 *buffer, int n)
+{
+    while (n > 0)
+        {
+            int rc = recv(fd, buffer, n, 0);
+            if (rc <= 0) return(FALSE);
+            buffer += rc;
+            n -= rc;
+        }
+    return(TRUE);
+}
+
+/* A request and its response over a loopback TCP connection, with a
+   stand-in for CVM on the other end: from CVM sending the request to
+   CVM having all of the response.  This is the whole path -- read,
+   parse, respond, send -- with the socket options as they would be
+   set from the config file. */
+void bench_round_trip(STRING name, STRING message, int n, int iterations)
+{
+    struct sockaddr_in address;
+    socklen_t length = sizeof(address);
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = 0;
+
+    FileDesc listener = socket(AF_INET, SOCK_STREAM, 0);
+    if ((listener < 0)
+        || (bind(listener, (struct sockaddr *)&address, sizeof(address)) < 0)
+        || (listen(listener, 1) < 0)
+        || (getsockname(listener, (struct sockaddr *)&address, &length) < 0))
+        {
+            perror("round trip listener");
+            return;
+        }
+    FileDesc cvm = socket(AF_INET, SOCK_STREAM, 0);
+    if ((cvm < 0) || (connect(cvm, (struct sockaddr *)&address, sizeof(address)) < 0))
+        {
+            perror("round trip connect");
+            close(listener);
+            return;
+        }
+    int on = 1;
+    setsockopt(cvm, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    FileDesc fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK);
+    close(listener);
+    struct CONNECTION *c = new_Client_Connection(fd);
+    Set_Client_Socket_Options(fd);
+
+    STRING frame = CAST(STRING, malloc(n + 8));
+    Format_Message_Header(CAST(UINT8 *, frame), n);
+    memcpy(frame + 8, message, n);
+    int size = 8;
+    UINT8 *response = CAST(UINT8 *, malloc(size));
+
+    char input[128];
+    snprintf(input, sizeof(input), "%s,nodelay=%s,cork=%s", name,
+             (tcpNoDelay ? "on" : "off"), (tcpCork ? "on" : "off"));
+
+    begin();
+    int i;
+    for (i = 0; i < iterations; i++)
+        {
+            if (send(cvm, frame, n + 8, 0) != n + 8) break;
+            COUNTER received = Messages_Received;
+            COUNTER queued = Bytes_Queued;
+            while ((Messages_Received == received) && (c->fd != INVALID_SOCKET))
+                Read_and_Reply_to_CVM(c);
+            if (Bytes_Queued == queued) break;  /* no response */
+
+            UINT8 header[8];
+            if (!bench_recv_all(cvm, header, 8)) break;
+            int m = (header[0] << 24) | (header[1] << 16) | (header[2] << 8) | header[3];
+            if (m > size)
+                {
+                    size = m;
+                    response = CAST(UINT8 *, realloc(response, size));
+                }
+            if (!bench_recv_all(cvm, response, m)) break;
+            bench_sink += m;
+        }
+    report("round_trip", input, i);
+
+    free(response);
+    free(frame);
+    close(cvm);
+    close_Client_Connection(c);
+    Free_Closed_Connections();
+}
+
+
+void bench_format_event(STRING name, int iterations)
+{
+    struct Timestamp timedate = { 0, 3, 17, 11, 18, 10, 2026 };
+
+    begin();
+    int i;
+    for (i = 0; i < iterations; i++)
+        {
+            STRING message = Format_One_Event_Message(DDD[0], &timedate, TRUE);
+            bench_sink += message[0];
+            free(message);
+        }
+    report("format_event", name, iterations);
+}
+
+/* one AppendBuffer() of a config string; the buffer is cleared
+   every so often, as it is for each message */
+void bench_append_buffer(STRING name, int iterations)
+{
+    DEVICE d = DDD[0];
+    STRING pieces[] = { "<overheightStatus>", d->providerName, d->resourceType,
+                        d->centerId, d->id, "</overheightStatus>", d->triggerHeight };
+    int npieces = sizeof(pieces) / sizeof(pieces[0]);
+    struct BUFFER *buffer = ClearBuffer();
+
+    begin();
+    int i;
+    for (i = 0; i < iterations; i++)
+        {
+            if ((i % 64) == 0) buffer = ClearBuffer();
+            AppendBuffer(buffer, pieces[i % npieces]);
+        }
+    bench_sink += buffer->n;
+    report("append_buffer", name, iterations);
+}
+
+/* one line in the log; the log goes to /dev/null */
+void bench_important(STRING name, int iterations)
+{
+    begin();
+    int i;
+    for (i = 0; i < iterations; i++)
+        important("Event for %s at: %s", DDD[0]->name, "2026/10/18 11:17:03\n");
+    report("important", name, iterations);
+}
+
+
+/* An update to some number of clients: formatting it, queueing
+   it for each, and sending it, over UNIX-domain socket pairs.  The
+   far ends are drained after each update, outside the timing. */
+void bench_update_fanout(int subscribers, int iterations)
+{
+    struct Timestamp timedate = { 0, 3, 17, 11, 18, 10, 2026 };
+    FileDesc peers[MAX_CLIENTS];
+    int i, j;
+
+    for (j = 0; j < subscribers; j++)
+        {
+            FileDesc pair[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0)
+                {
+                    perror("socketpair");
+                    subscribers = j;
+                    break;
+                }
+            (void)new_Client_Connection(pair[0]);
+            peers[j] = pair[1];
+        }
+
+    double elapsed = 0;
+    long long allocs = 0;
+    long long bytes = 0;
+    for (i = 0; i < iterations; i++)
+        {
+            begin();
+            WriteXMLMessageToServer(DDD[0], &timedate, TRUE, TRUE);
+            elapsed += now_ns() - bench_start;
+            allocs += bench_allocs - bench_start_allocs;
+            bytes += bench_bytes - bench_start_bytes;
+
+            char drain[4096];
+            for (j = 0; j < subscribers; j++)
+                while (recv(peers[j], drain, sizeof(drain), MSG_DONTWAIT) > 0) continue;
+        }
+    printf("update_fanout\tsubscribers=%d\t%.1f\t%.2f\t%.1f\t%d\n", subscribers,
+           elapsed / iterations, CAST(double, allocs) / iterations,
+           CAST(double, bytes) / iterations, iterations);
+
+    for (j = 0; j < MAX_CLIENTS; j++)
+        if (Connections[j] != NULL) close_Client_Connection(Connections[j]);
+    Free_Closed_Connections();
+    for (j = 0; j < subscribers; j++)
+        close(peers[j]);
+}
+
+
+/* the round trip for a small response and a larger one, with the
+   default socket options and then without them */
+void bench_round_trips(int iterations)
+{
+    STRING request = "<retrieveDataReq><refId>42</refId><icdVersion>1.0</icdVersion>"
+        "<overheightData>true</overheightData></retrieveDataReq>";
+    int n = strlen(request);
+    int devices;
+
+    for (devices = 1; devices <= MAX_DETECTORS; devices += MAX_DETECTORS - 1)
+        {
+            char name[64];
+            snprintf(name, sizeof(name), "devices=%d,events=1", devices);
+            bench_devices(devices, 1);
+
+            tcpNoDelay = TRUE;
+            tcpCork = TRUE;
+            bench_round_trip(name, request, n, iterations);
+            tcpNoDelay = FALSE;
+            tcpCork = FALSE;
+            bench_round_trip(name, request, n, iterations);
+        }
+    tcpNoDelay = TRUE;
+    tcpCork = TRUE;
+}
+
+
+/* ***************************************************************** */
+/*                                                                   */
+/*                                                                   */
+/* ***************************************************************** */
+
+/* Checks, rather than timings, of the responses when more than one
+   client is connected.  The clients are on UNIX-domain socket pairs. */
+
+int bench_failures = 0;
+
+void bench_check(Boolean ok, STRING what)
+{
+    if (ok) return;
+    fprintf(stderr, "check failed: %s\n", what);
+    bench_failures += 1;
+}
+
+/* a new client; the far end is *peer */
+struct CONNECTION *bench_client(FileDesc *peer)
+{
+    FileDesc pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0)
+        {
+            perror("socketpair");
+            exit(1);
+        }
+    fcntl(pair[0], F_SETFL, fcntl(pair[0], F_GETFL) | O_NONBLOCK);
+    *peer = pair[1];
+    return(new_Client_Connection(pair[0]));
+}
+
+void bench_close_clients(FileDesc *peers, int n)
+{
+    int j;
+    for (j = 0; j < MAX_CLIENTS; j++)
+        if (Connections[j] != NULL) close_Client_Connection(Connections[j]);
+    Free_Closed_Connections();
+    for (j = 0; j < n; j++)
+        close(peers[j]);
+}
+
+/* ask for the events from the far end of c, and count the events in
+   the response; -1 if there is no good response */
+int bench_poll(struct CONNECTION *c, FileDesc peer)
+{
+    STRING request = "<retrieveDataReq><refId>42</refId><icdVersion>1.0</icdVersion>"
+        "<overheightData>true</overheightData></retrieveDataReq>";
+    int n = strlen(request);
+    UINT8 header[8];
+    Format_Message_Header(header, n);
+    if ((send(peer, header, 8, 0) != 8) || (send(peer, request, n, 0) != n)) return(-1);
+
+    COUNTER received = Messages_Received;
+    while ((Messages_Received == received) && (c->fd != INVALID_SOCKET))
+        Read_and_Reply_to_CVM(c);
+
+    if (!bench_recv_all(peer, header, 8)) return(-1);
+    int m = (header[0] << 24) | (header[1] << 16) | (header[2] << 8) | header[3];
+    STRING response = CAST(STRING, malloc(m + 1));
+    int events = -1;
+    STRING trailer = "</retrieveDataResp>";
+    int t = strlen(trailer);
+    if (bench_recv_all(peer, CAST(UINT8 *, response), m)
+        && (m >= t) && (memcmp(response + m - t, trailer, t) == 0))
+        {
+            response[m] = '\0';
+            STRING p = response;
+            events = 0;
+            while ((p = strstr(p, "<overheightReadingData>")) != NULL)
+                {
+                    events += 1;
+                    p += 1;
+                }
+        }
+    free(response);
+    return(events);
+}
+
+/* CVM and a laptop.  Each gets every event since it last asked (and
+   the last event again, if there are no new ones), whatever the
+   other has asked for; once the laptop is gone, the file is cut. */
+void bench_two_clients(void)
+{
+    FileDesc peers[2];
+    bench_devices(1, 3);
+    struct CONNECTION *cvm = bench_client(&peers[0]);
+    struct CONNECTION *laptop = bench_client(&peers[1]);
+
+    bench_check(bench_poll(cvm, peers[0]) == 3, "CVM gets the events in the file");
+
+    struct Timestamp timedate = { 0, 0, 0, 9, 18, 10, 2026 };
+    WriteEventToFile(DDD[0], &timedate);
+    timedate.min = 1;
+    WriteEventToFile(DDD[0], &timedate);
+
+    bench_check(bench_poll(laptop, peers[1]) == 5, "a new client gets all the events in the file");
+    bench_check(bench_poll(laptop, peers[1]) == 1, "a client gets just the last event again");
+    bench_check(bench_poll(cvm, peers[0]) == 3, "CVM gets the events since it asked, after another client asked");
+    bench_check(bench_poll(cvm, peers[0]) == 1, "CVM gets just the last event again");
+
+    close_Client_Connection(laptop);
+    bench_check(bench_poll(cvm, peers[0]) == 1, "CVM gets the last event, with the laptop gone");
+    bench_check(DDD[0]->event_base > 0, "the event file is cut when only CVM is left");
+
+    bench_close_clients(peers, 2);
+}
+
+/* A response is as long as its counting pass said, even if the
+   status of a detector, or the icdVersion, changes before it is
+   sent. */
+void bench_response_length(void)
+{
+    struct RESPONSE_CURSOR response;
+    bench_devices(2, 3);
+    response.reader = NULL;
+    Start_XML_Response(&response, "42", 2, "1.0", 3);
+
+    struct BUFFER sizing = { 0, 0, NULL, BM_SIZE, 0 };
+    while (Next_XML_Response_Piece(&response, &sizing)) continue;
+
+    DDD[1]->status = ST_OUTOFSERVICE;
+    free(icdVersion);
+    icdVersion = remember_string("1.0.2-draft");
+
+    struct BUFFER *buffer = ClearBuffer();
+    Rewind_XML_Response(&response);
+    while (Next_XML_Response_Piece(&response, buffer)) continue;
+    bench_check(buffer->n == sizing.total, "a response is as long as its counting pass");
+
+    Finish_XML_Response(&response, FALSE);
+}
+
+/* one client asking for the events, with others connected that
+   never ask; its responses should be the same as with no others */
+void bench_idle_clients(int idle, int iterations)
+{
+    FileDesc peers[MAX_CLIENTS];
+    int i, j;
+
+    bench_devices(1, 3);
+    for (j = 0; j < idle; j++)
+        bench_client(&peers[j]);
+    struct CONNECTION *c = bench_client(&peers[idle]);
+
+    char input[64];
+    snprintf(input, sizeof(input), "idle=%d", idle);
+    int wrong = 0;
+    begin();
+    for (i = 0; i < iterations; i++)
+        if (bench_poll(c, peers[idle]) != ((i == 0) ? 3 : 1)) wrong += 1;
+    report("idle_clients", input, iterations);
+    bench_check(wrong == 0, "responses with idle clients connected");
+
+    /* the files are kept for the idle ones while they might still
+       ask, and cut once they have not asked for EVENT_HOLD_TIME */
+    bench_check((idle == 0) || (DDD[0]->event_base == 0), "the event file is kept for new clients");
+    for (j = 0; j < MAX_CLIENTS; j++)
+        if ((Connections[j] != NULL) && (Connections[j] != c))
+            Connections[j]->events.asked -= EVENT_HOLD_TIME + 1;
+    bench_check(bench_poll(c, peers[idle]) == 1, "a response after the idle clients time out");
+    bench_check(DDD[0]->event_base > 0, "the event file is cut with idle clients connected");
+
+    bench_close_clients(peers, idle + 1);
+}
+
+
+/* Poll jitter.  The reactor runs as it does in the program, with
+   the polling timer every JITTER_DELAY microseconds, while a thread
+   acts as a busy CVM, asking for the events every JITTER_REQUEST
+   microseconds (far more often than CVM does; as fast as it could
+   would just take the CPU from the reactor on a one-CPU box), and
+   some number of idle clients are connected.  We time each tick,
+   and see how long after the timer went off it came.  With 50 idle
+   clients, the ticks should be no later than with none. */
+
+#define JITTER_DELAY  1000   /* microseconds */
+#define JITTER_TICKS  1000
+#define JITTER_REQUEST  200  /* microseconds */
+
+COUNTER jitter_start;                /* when the timer was set */
+COUNTER jitter_times[JITTER_TICKS];
+int jitter_ticks;
+
+void bench_poll_ready(struct SOURCE *s, UINT32 events)
+{
+    if (jitter_ticks < JITTER_TICKS) jitter_times[jitter_ticks++] = Microseconds();
+    Poll_Ready(s, events);
+}
+
+void *bench_busy_cvm(void *arg)
+{
+    FileDesc peer = *CAST(FileDesc *, arg);
+    STRING request = "<retrieveDataReq><refId>42</refId><icdVersion>1.0</icdVersion>"
+        "<overheightData>true</overheightData></retrieveDataReq>";
+    int n = strlen(request);
+    UINT8 frame[256];
+    UINT8 response[65536];
+    Format_Message_Header(frame, n);
+    memcpy(frame + 8, request, n);
+
+    while (send(peer, frame, n + 8, MSG_NOSIGNAL) == n + 8)
+        {
+            if (!bench_recv_all(peer, response, 8)) break;
+            int m = (response[0] << 24) | (response[1] << 16) | (response[2] << 8) | response[3];
+            if ((m > sizeof(response)) || !bench_recv_all(peer, response, m)) break;
+            usleep(JITTER_REQUEST);
+        }
+    return(NULL);
+}
+
+int bench_compare_counters(const void *a, const void *b)
+{
+    COUNTER x = *CAST(const COUNTER *, a);
+    COUNTER y = *CAST(const COUNTER *, b);
+    return((x < y) ? -1 : (x > y) ? 1 : 0);
+}
+
+/* how late 9 ticks in 10 were, at most, in microseconds */
+COUNTER bench_poll_jitter(int idle)
+{
+    FileDesc peers[MAX_CLIENTS];
+    int i, j;
+
+    bench_devices(1, 1);
+    for (j = 0; j <= idle; j++)
+        Start_Client_IO(bench_client(&peers[j]));
+
+    int saved_delay = pollingDelay;
+    pollingDelay = JITTER_DELAY;
+    jitter_ticks = 0;
+    jitter_start = Microseconds();
+    Setup_Poll_Timer();
+    Poll_Source.ready = bench_poll_ready;
+
+    pthread_t cvm;
+    pthread_create(&cvm, NULL, bench_busy_cvm, &peers[idle]);
+    while (jitter_ticks < JITTER_TICKS)
+        {
+            if (!Reactor_Dispatch()) break;
+            Free_Closed_Connections();
+        }
+    shutdown(peers[idle], SHUT_RDWR);
+    pthread_join(cvm, NULL);
+
+    Unwatch(&Poll_Source);
+    Finish_Poll_Timer();
+    Poll_Source.fd = INVALID_SOCKET;
+    pollingDelay = saved_delay;
+    bench_close_clients(peers, idle + 1);
+
+    /* how late each tick was: after the first expiry of the timer
+       that had not been handled yet (so a missed tick counts) */
+    COUNTER late[JITTER_TICKS];
+    COUNTER due = jitter_start + JITTER_DELAY;
+    int n = 0;
+    for (i = 0; i < jitter_ticks; i++)
+        {
+            COUNTER t = jitter_times[i];
+            late[n++] = (t > due) ? t - due : 0;
+            due = jitter_start + ((t - jitter_start) / JITTER_DELAY + 1) * JITTER_DELAY;
+        }
+    if (n == 0) return(0);
+    qsort(late, n, sizeof(late[0]), bench_compare_counters);
+    COUNTER p90 = late[n * 9 / 10];
+    printf("poll_jitter\tidle=%d\t%llu\t%llu\t%llu\t%llu\t%d\n", idle,
+           CAST(unsigned long long, late[n / 2]), CAST(unsigned long long, p90),
+           CAST(unsigned long long, late[n * 99 / 100]),
+           CAST(unsigned long long, late[n - 1]), n);
+    return(p90);
+}
+
+/* Whatever else the box is doing shows up in the ticks too, so we
+   take turns, three times, and compare the best of each. */
+void bench_poll_jitters(void)
+{
+    COUNTER alone = 0;
+    COUNTER crowded = 0;
+    int i;
+    for (i = 0; i < 3; i++)
+        {
+            COUNTER a = bench_poll_jitter(0);
+            COUNTER c = bench_poll_jitter(50);
+            if ((i == 0) || (a < alone)) alone = a;
+            if ((i == 0) || (c < crowded)) crowded = c;
+        }
+    bench_check(crowded <= 2 * alone + 100, "poll jitter with 50 idle clients connected");
+}
+
+
+/* Push mode, against a stand-in for CVM listening on a loopback
+   port.  We connect to it, and it gets the updates and, when we
+   have sent nothing for a second, a heartbeat.  When it hangs up we
+   dial again, soon; while it is not listening, each wait is longer
+   than the one before; and when it listens again, we connect. */
+
+/* run the reactor until done() or ms milliseconds have gone by */
+Boolean bench_reactor_until(Boolean (*done)(void), int ms)
+{
+    COUNTER end = Microseconds() + ms * 1000LL;
+    while (!done() && (Microseconds() < end))
+        {
+            struct pollfd p;
+            p.fd = Reactor;
+            p.events = POLLIN;
+            if ((poll(&p, 1, 10) > 0) && !Reactor_Dispatch()) break;
+            Free_Closed_Connections();
+        }
+    return(done());
+}
+
+Boolean bench_outbound_connected(void)
+{
+    return(Outbound.state == OB_CONNECTED);
+}
+
+Boolean bench_outbound_waiting(void)
+{
+    return(Outbound.state == OB_WAITING);
+}
+
+COUNTER bench_heartbeats;
+Boolean bench_heartbeat_sent(void)
+{
+    return(Heartbeats_Sent > bench_heartbeats);
+}
+
+COUNTER bench_failures_wanted;
+Boolean bench_dial_failed(void)
+{
+    return(Outbound_Failures >= bench_failures_wanted);
+}
+
+FileDesc bench_listen(struct sockaddr_in *address)
+{
+    FileDesc fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if ((bind(fd, CAST(struct sockaddr *, address), sizeof(*address)) < 0) || (listen(fd, 4) < 0))
+        {
+            perror("stand-in for CVM");
+            exit(1);
+        }
+    socklen_t length = sizeof(*address);
+    getsockname(fd, CAST(struct sockaddr *, address), &length);
+    return(fd);
+}
+
+/* the next message the stand-in gets; its length, or -1 if none
+   comes within a couple of seconds */
+int bench_stand_in_read(FileDesc fd, STRING body, int size)
+{
+    struct timeval wait = { 2, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &wait, sizeof(wait));
+    UINT8 header[8];
+    if (!bench_recv_all(fd, header, 8)) return(-1);
+    int m = (header[0] << 24) | (header[1] << 16) | (header[2] << 8) | header[3];
+    if ((m >= size) || !bench_recv_all(fd, CAST(UINT8 *, body), m)) return(-1);
+    body[m] = '\0';
+    return(m);
+}
+
+void bench_push_mode(void)
+{
+    char body[4096];
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = 0;
+    FileDesc listener = bench_listen(&address);
+
+    bench_devices(1, 1);
+    char where[64];
+    snprintf(where, sizeof(where), "127.0.0.1:%d", ntohs(address.sin_port));
+    CVMAddress = remember_string(where);
+    int saved_heartbeat = heartbeatInterval;
+    heartbeatInterval = 1;
+    COUNTER connects = Outbound_Connects;
+
+    Setup_Outbound();
+    bench_check(bench_reactor_until(bench_outbound_connected, 5000), "push mode connects to CVM");
+    FileDesc cvm = accept(listener, NULL, NULL);
+    bench_check((cvm >= 0) && (Outbound_Connects == connects + 1), "CVM takes our connection");
+
+    struct Timestamp timedate = { 0, 0, 0, 9, 18, 10, 2026 };
+    WriteXMLMessageToServer(DDD[0], &timedate, TRUE, TRUE);
+    bench_check((bench_stand_in_read(cvm, body, sizeof(body)) > 0)
+                && (strstr(body, "<overheightUpdateMsg>") != NULL),
+                "CVM gets an update on our connection");
+
+    bench_heartbeats = Heartbeats_Sent;
+    bench_check(bench_reactor_until(bench_heartbeat_sent, 3000)
+                && (bench_stand_in_read(cvm, body, sizeof(body)) == 0),
+                "CVM gets a heartbeat when we are quiet");
+
+    /* CVM hangs up; we dial again after the shortest wait */
+    COUNTER hung_up = Microseconds();
+    close(cvm);
+    bench_check(bench_reactor_until(bench_outbound_waiting, 1000), "we see CVM hang up");
+    bench_check(bench_reactor_until(bench_outbound_connected, 5000), "we connect again after CVM hangs up");
+    COUNTER waited = Microseconds() - hung_up;
+    bench_check(waited >= RECONNECT_MIN_DELAY / 2 * 1000LL, "we wait before dialing again");
+    cvm = accept(listener, NULL, NULL);
+    bench_check((cvm >= 0) && (Outbound_Connects == connects + 2), "CVM takes our new connection");
+
+    /* CVM goes away altogether; the waits between dials grow */
+    close(listener);
+    close(cvm);
+    COUNTER dialed[4];
+    int i;
+    for (i = 0; i < 4; i++)
+        {
+            bench_failures_wanted = Outbound_Failures + 1;
+            if (!bench_reactor_until(bench_dial_failed, 10000)) break;
+            dialed[i] = Microseconds();
+        }
+    bench_check(i == 4, "we go on dialing while CVM is away");
+    if (i == 4)
+        {
+            /* the wait after the n-th failure in a row is from half
+               of RECONNECT_MIN_DELAY * 2^(n-1) up to all of it */
+            COUNTER second = dialed[2] - dialed[1];
+            COUNTER third = dialed[3] - dialed[2];
+            bench_check(second >= RECONNECT_MIN_DELAY * 1000LL
+                        && third >= 2 * RECONNECT_MIN_DELAY * 1000LL,
+                        "the waits between dials grow while CVM is away");
+        }
+
+    /* and once it is back, we connect */
+    listener = bench_listen(&address);
+    bench_check(bench_reactor_until(bench_outbound_connected, 10000), "we connect when CVM is back");
+    cvm = accept(listener, NULL, NULL);
+    bench_check(cvm >= 0, "CVM takes our connection when it is back");
+
+    Finish_Outbound();
+    Free_Closed_Connections();
+    close(cvm);
+    close(listener);
+    free(CVMAddress);
+    CVMAddress = NULL;
+    heartbeatInterval = saved_heartbeat;
+}
+
+
+void bench_devices_and_events(int iterations)
+{
+    int devices;
+    int e;
+    int events[] = { 1, 20 };
+
+    for (devices = 1; devices <= MAX_DETECTORS; devices++)
+        for (e = 0; e < 2; e++)
+            {
+                char name[64];
+                snprintf(name, sizeof(name), "devices=%d,events=%d", devices, events[e]);
+                bench_devices(devices, events[e]);
+                /* each response reads the event files, so fewer of these */
+                bench_format_response(name, iterations / 10);
+            }
+
+    bench_devices(1, 1);
+    bench_format_event("long-config", iterations);
+    bench_update_fanout(1, iterations / 10);
+    bench_update_fanout(16, iterations / 10);
+    bench_update_fanout(64, iterations / 100);
+    bench_append_buffer("long-config", iterations);
+    bench_important("log-line", iterations);
+}
+
+
+int main(int argc, char **argv)
+{
+    int iterations = DEFAULT_ITERATIONS;
+    int i = 1;
+
+    if ((argc > 2) && STRING_EQUAL(argv[1], "-n"))
+        {
+            iterations = atoi(argv[2]);
+            i = 3;
+        }
+
+    /* keep the parsers quiet, and log to nowhere, all on one day */
+    debug = FALSE;
+    verbose = FALSE;
+    log_fd = open("/dev/null", O_WRONLY);
+    Start_Log_Writer();
+    Setup_Reactor();
+    today = remember_string(Current_Time()->date);
+    today_ends = Current_Time()->midnight;
+    Compile_Validator();
+    bench_check(Tag_Hash_OK(), "every tag is in its slot of the tag hash");
+    if (bench_failures > 0) return(1);
+
+    if (mkdtemp(bench_directory) == NULL)
+        {
+            perror(bench_directory);
+            return(1);
+        }
+    bench_devices_and_events(iterations);
+    /* each round trip is a few system calls, so fewer of these */
+    bench_round_trips(iterations / 10);
+    bench_response_length();
+    bench_two_clients();
+    bench_idle_clients(0, iterations / 10);
+    bench_idle_clients(50, iterations / 10);
+    bench_poll_jitters();
+    bench_push_mode();
+
+    /* the requests are answered for one detector */
+    bench_devices(1, 1);
+
+    for (; i < argc; i++)
+        {
+            int n;
+            STRING message = read_corpus_file(argv[i], &n);
+            if (message == NULL) continue;
+
+            bench_legacy_parser(argv[i], message, n, iterations);
+            bench_tree_parser(argv[i], message, n, iterations);
+            bench_tokenizer(argv[i], message, n, iterations);
+            bench_live_path(argv[i], message, n, iterations, TRUE);
+            bench_live_path(argv[i], message, n, iterations, FALSE);
+            free(message);
+        }
+
+    bench_free_devices();
+    rmdir(bench_directory);
+    return((bench_failures > 0) ? 1 : 0);
+}
@@ -0,0 +1,491 @@
+/*
+   cvmload.c -- load the overhead program the way CVM would, and
+   see how fast it answers.
+
+       cvmload [-h host] [-p port] [-c clients] [-d seconds]
+               [-r rate] [-w window] [-f request.xml]
+
+   opens the given number of client connections to the CVM port and
+   sends retrieveDataReq messages, with the real framing (a 4-byte
+   length, a 4-byte reserved word, then the XML), for the given
+   number of seconds.  With a rate (requests per second, over all
+   the clients), the requests go out on a fixed schedule whether
+   or not the answers keep up ("open loop"); without one, each
+   client keeps window requests outstanding, and sends the next as
+   soon as an answer comes back ("closed loop").
+
+   Each request has its own refId, and each answer must echo the
+   refId of the request it answers -- the answers on a connection
+   come back in order.  Update messages that the program sends to
+   the clients along the way are counted, and otherwise ignored.
+
+   At the end we print the throughput and the latency percentiles.
+   In open loop, a request's latency is counted from when it was to
+   go out, not from when it did, so a program that falls behind is
+   charged for the wait.
+
+   -f gives a file with the request to send instead of the usual
+   one; its <refId> is replaced in each request.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>        /* printf, fprintf */
+#include <stdlib.h>       /* malloc, atoi, qsort */
+#include <string.h>       /* memcpy, strstr */
+#include <unistd.h>       /* read, close */
+#include <errno.h>        /* errno */
+#include <fcntl.h>        /* fcntl */
+#include <time.h>         /* clock_gettime */
+#include <netdb.h>        /* getaddrinfo */
+#include <netinet/in.h>   /* IPPROTO_TCP */
+#include <netinet/tcp.h>  /* TCP_NODELAY */
+#include <sys/socket.h>   /* socket, connect, send, recv */
+#include <sys/epoll.h>    /* epoll_create1, epoll_wait */
+
+typedef char *STRING;
+typedef int Boolean;
+#define TRUE 1
+#define FALSE 0
+
+#define CAST(t,e) ((t)(e))
+#define TYPED_MALLOC(t) CAST(t*, malloc(sizeof(t)))
+
+#define MAX_CLIENTS  1024
+#define MAX_MESSAGE_LENGTH  (16 * 1024 * 1024)
+#define MAX_OUTSTANDING  4096
+
+STRING default_request =
+    "<retrieveDataReq><refId>0</refId><icdVersion>1.0</icdVersion>"
+    "<overheightData>TRUE</overheightData></retrieveDataReq>";
+
+
+/* ***************************************************************** */
+/*                                                                   */
+/*                                                                   */
+/* ***************************************************************** */
+
+/* the request, cut in two around its refId */
+STRING request_front;
+STRING request_back;
+
+/* what each client has sent, and is waiting for */
+struct CLIENT
+{
+    int fd;
+
+    /* to send */
+    STRING out;
+    int out_n;
+    int out_length;
+
+    /* sent, and not answered yet, oldest first */
+    long refId[MAX_OUTSTANDING];
+    long long sent[MAX_OUTSTANDING];     /* microseconds */
+    int first;
+    int count;
+
+    /* what has come in */
+    unsigned char header[8];
+    int header_have;
+    STRING body;
+    int n;
+    int have;
+};
+
+struct CLIENT *Clients[MAX_CLIENTS];
+int client_count = 1;
+
+long next_refId = 1;
+
+/* results */
+long long *Latencies = NULL;            /* microseconds */
+long latency_count = 0;
+long latency_length = 0;
+long requests_sent = 0;
+long requests_skipped = 0;            /* too many outstanding */
+long wrong_refIds = 0;
+long updates = 0;
+long other_messages = 0;
+
+
+long long now_us(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return(CAST(long long, now.tv_sec) * 1000000 + now.tv_nsec / 1000);
+}
+
+void fail(STRING what)
+{
+    perror(what);
+    exit(2);
+}
+
+
+/* ***************************************************************** */
+/*                                                                   */
+/*                                                                   */
+/* ***************************************************************** */
+
+STRING read_file(STRING name)
+{
+    FILE *f = fopen(name, "r");
+    if (f == NULL) fail(name);
+    fseek(f, 0, SEEK_END);
+    long n = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    STRING s = CAST(STRING, malloc(n + 1));
+    if (fread(s, 1, n, f) != n) fail(name);
+    s[n] = '\0';
+    fclose(f);
+
+    /* no newline at the end of the message */
+    while ((n > 0) && ((s[n-1] == '\n') || (s[n-1] == '\r'))) s[--n] = '\0';
+    return(s);
+}
+
+/* split the request around the number in <refId>...</refId> */
+void split_request(STRING request)
+{
+    STRING start = strstr(request, "<refId>");
+    STRING end = (start != NULL) ? strstr(start, "</refId>") : NULL;
+    if (end == NULL)
+        {
+            fprintf(stderr, "cvmload: the request has no <refId>\n");
+            exit(2);
+        }
+    start += strlen("<refId>");
+    int n = start - request;
+    request_front = CAST(STRING, malloc(n + 1));
+    memcpy(request_front, request, n);
+    request_front[n] = '\0';
+    request_back = end;
+}
+
+
+/* ***************************************************************** */
+/*                                                                   */
+/*                                                                   */
+/* ***************************************************************** */
+
+int connect_to(STRING host, STRING port)
+{
+    struct addrinfo hints;
+    struct addrinfo *ai;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &ai) != 0)
+        {
+            fprintf(stderr, "cvmload: cannot find %s\n", host);
+            exit(2);
+        }
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) fail("socket");
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) fail("connect");
+    freeaddrinfo(ai);
+
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return(fd);
+}
+
+/* send what we can of what the client has to send */
+void flush_client(struct CLIENT *c)
+{
+    while (c->out_n > 0)
+        {
+            int rc = send(c->fd, c->out, c->out_n, MSG_NOSIGNAL);
+            if (rc < 0)
+                {
+                    if (errno == EINTR) continue;
+                    if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return;
+                    fail("send");
+                }
+            c->out_n -= rc;
+            memmove(c->out, c->out + rc, c->out_n);
+        }
+}
+
+/* queue a request, and remember when it was meant to go */
+Boolean send_request(struct CLIENT *c, long long when)
+{
+    if (c->count == MAX_OUTSTANDING)
+        {
+            requests_skipped += 1;
+            return(FALSE);
+        }
+
+    char refId[24];
+    int r = snprintf(refId, sizeof(refId), "%ld", next_refId);
+    int n = strlen(request_front) + r + strlen(request_back);
+
+    while (c->out_n + 8 + n + 1 > c->out_length)
+        {
+            c->out_length = 2 * c->out_length;
+            c->out = CAST(STRING, realloc(c->out, c->out_length));
+        }
+    unsigned char *h = CAST(unsigned char *, c->out + c->out_n);
+    h[0] = (n >> 24) & 0xFF;
+    h[1] = (n >> 16) & 0xFF;
+    h[2] = (n >> 8) & 0xFF;
+    h[3] = n & 0xFF;
+    h[4] = h[5] = h[6] = h[7] = 0;
+    c->out_n += 8;
+    c->out_n += sprintf(c->out + c->out_n, "%s%s%s", request_front, refId, request_back);
+
+    int i = (c->first + c->count) % MAX_OUTSTANDING;
+    c->refId[i] = next_refId;
+    c->sent[i] = when;
+    c->count += 1;
+    next_refId += 1;
+    requests_sent += 1;
+
+    flush_client(c);
+    return(TRUE);
+}
+
+
+/* ***************************************************************** */
+/*                                                                   */
+/*                                                                   */
+/* ***************************************************************** */
+
+void record_latency(long long us)
+{
+    if (latency_count == latency_length)
+        {
+            latency_length = (latency_length == 0) ? 65536 : 2 * latency_length;
+            Latencies = CAST(long long *, realloc(Latencies, latency_length * sizeof(long long)));
+        }
+    Latencies[latency_count++] = us;
+}
+
+/* a whole message has come in */
+void got_message(struct CLIENT *c)
+{
+    if (strstr(c->body, "<retrieveDataResp") == NULL)
+        {
+            if (strstr(c->body, "<overheightUpdateMsg") != NULL)
+                updates += 1;
+            else
+                other_messages += 1;
+            return;
+        }
+    if (c->count == 0)
+        {
+            other_messages += 1;
+            return;
+        }
+
+    long refId = -1;
+    STRING r = strstr(c->body, "<refId>");
+    if (r != NULL) refId = atol(r + strlen("<refId>"));
+
+    int i = c->first;
+    if (refId != c->refId[i]) wrong_refIds += 1;
+    record_latency(now_us() - c->sent[i]);
+    c->first = (c->first + 1) % MAX_OUTSTANDING;
+    c->count -= 1;
+}
+
+/* take what the program has sent us; the number of answers */
+int read_client(struct CLIENT *c)
+{
+    int answered = 0;
+    while (TRUE)
+        {
+            int before = c->count;
+            if (c->header_have < 8)
+                {
+                    int rc = recv(c->fd, c->header + c->header_have, 8 - c->header_have, 0);
+                    if (rc < 0)
+                        {
+                            if (errno == EINTR) continue;
+                            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return(answered);
+                            fail("recv");
+                        }
+                    if (rc == 0)
+                        {
+                            fprintf(stderr, "cvmload: the program closed a connection\n");
+                            exit(2);
+                        }
+                    c->header_have += rc;
+                    if (c->header_have < 8) continue;
+
+                    c->n = (c->header[0] << 24) | (c->header[1] << 16) | (c->header[2] << 8) | c->header[3];
+                    if ((c->n < 0) || (c->n > MAX_MESSAGE_LENGTH))
+                        {
+                            fprintf(stderr, "cvmload: a message of %d bytes?\n", c->n);
+                            exit(2);
+                        }
+                    c->body = CAST(STRING, realloc(c->body, c->n + 1));
+                    c->have = 0;
+                }
+
+            if (c->have < c->n)
+                {
+                    int rc = recv(c->fd, c->body + c->have, c->n - c->have, 0);
+                    if (rc < 0)
+                        {
+                            if (errno == EINTR) continue;
+                            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return(answered);
+                            fail("recv");
+                        }
+                    if (rc == 0)
+                        {
+                            fprintf(stderr, "cvmload: the program closed a connection\n");
+                            exit(2);
+                        }
+                    c->have += rc;
+                    if (c->have < c->n) continue;
+                }
+
+            /* a heartbeat (n == 0) is nothing */
+            c->body[c->n] = '\0';
+            if (c->n > 0) got_message(c);
+            c->header_have = 0;
+            answered += before - c->count;
+        }
+}
+
+
+/* ***************************************************************** */
+/*                                                                   */
+/*                                                                   */
+/* ***************************************************************** */
+
+int compare_latency(const void *a, const void *b)
+{
+    long long x = *CAST(const long long *, a);
+    long long y = *CAST(const long long *, b);
+    return((x > y) - (x < y));
+}
+
+long long percentile(double p)
+{
+    if (latency_count == 0) return(0);
+    long i = CAST(long, p * latency_count);
+    if (i >= latency_count) i = latency_count - 1;
+    return(Latencies[i]);
+}
+
+void report(long long elapsed)
+{
+    qsort(Latencies, latency_count, sizeof(long long), compare_latency);
+    double seconds = elapsed / 1e6;
+
+    printf("clients\t%d\n", client_count);
+    printf("requests\t%ld\n", requests_sent);
+    if (requests_skipped > 0) printf("skipped\t%ld\n", requests_skipped);
+    printf("responses\t%ld\n", latency_count);
+    printf("wrong_refIds\t%ld\n", wrong_refIds);
+    printf("updates\t%ld\n", updates);
+    if (other_messages > 0) printf("other_messages\t%ld\n", other_messages);
+    printf("seconds\t%.3f\n", seconds);
+    printf("responses_per_second\t%.1f\n", latency_count / seconds);
+    printf("p50_us\t%lld\n", percentile(0.50));
+    printf("p99_us\t%lld\n", percentile(0.99));
+    printf("p999_us\t%lld\n", percentile(0.999));
+    printf("max_us\t%lld\n", percentile(1.0));
+}
+
+
+void usage(void)
+{
+    fprintf(stderr, "usage: cvmload [-h host] [-p port] [-c clients] [-d seconds] "
+            "[-r rate] [-w window] [-f request.xml]\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    STRING host = "127.0.0.1";
+    STRING port = "3080";
+    double seconds = 10;
+    double rate = 0;
+    int window = 1;
+    STRING request = default_request;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:c:d:r:w:f:")) != -1)
+        {
+            switch (opt)
+                {
+                case 'h': host = optarg; break;
+                case 'p': port = optarg; break;
+                case 'c': client_count = atoi(optarg); break;
+                case 'd': seconds = atof(optarg); break;
+                case 'r': rate = atof(optarg); break;
+                case 'w': window = atoi(optarg); break;
+                case 'f': request = read_file(optarg); break;
+                default: usage();
+                }
+        }
+    if ((client_count < 1) || (client_count > MAX_CLIENTS)) usage();
+    if ((window < 1) || (window > MAX_OUTSTANDING)) usage();
+    if ((seconds <= 0) || (rate < 0)) usage();
+    split_request(request);
+
+    int reactor = epoll_create1(0);
+    if (reactor < 0) fail("epoll_create1");
+    int i;
+    for (i = 0; i < client_count; i++)
+        {
+            struct CLIENT *c = Clients[i] = TYPED_MALLOC(struct CLIENT);
+            memset(c, 0, sizeof(*c));
+            c->fd = connect_to(host, port);
+            c->out_length = 4096;
+            c->out = CAST(STRING, malloc(c->out_length));
+
+            struct epoll_event e;
+            e.events = EPOLLIN | EPOLLOUT | EPOLLET;
+            e.data.ptr = c;
+            if (epoll_ctl(reactor, EPOLL_CTL_ADD, c->fd, &e) < 0) fail("epoll_ctl");
+        }
+
+    long long start = now_us();
+    long long end = start + CAST(long long, seconds * 1e6);
+    long long interval = (rate > 0) ? CAST(long long, 1e6 / rate) : 0;
+    long long next_send = start;
+    int next_client = 0;
+
+    /* closed loop: fill each window to start with */
+    if (rate == 0)
+        for (i = 0; i < client_count; i++)
+            {
+                int k;
+                for (k = 0; k < window; k++) send_request(Clients[i], now_us());
+            }
+
+    long long now;
+    while ((now = now_us()) < end)
+        {
+            /* open loop: send what is due, on schedule */
+            if (rate > 0)
+                while (next_send <= now)
+                    {
+                        send_request(Clients[next_client], next_send);
+                        next_client = (next_client + 1) % client_count;
+                        next_send += (interval > 0) ? interval : 1;
+                    }
+
+            int timeout = 100;
+            if (rate > 0) timeout = (next_send - now) / 1000;
+            struct epoll_event events[64];
+            int n = epoll_wait(reactor, events, 64, timeout);
+            if ((n < 0) && (errno != EINTR)) fail("epoll_wait");
+            for (i = 0; i < n; i++)
+                {
+                    struct CLIENT *c = CAST(struct CLIENT *, events[i].data.ptr);
+                    if (events[i].events & EPOLLOUT) flush_client(c);
+                    int answered = read_client(c);
+                    if ((rate == 0) && (now_us() < end))
+                        while (answered-- > 0) send_request(c, now_us());
+                }
+        }
+
+    report(now_us() - start);
+    return((wrong_refIds == 0) ? 0 : 1);
+}
@@ -0,0 +1,623 @@
+/*
+   cvmreplay.c -- play the requests that CVM sent in the field back
+   to an overhead program on the desk, and compare the answers.
+
+       cvmreplay [-h host] [-p port] [-s speed] [-t seconds] [-v] file
+
+   The file is either a day's log file from the program, which has
+   each "incoming message" and "outgoing message" with its length,
+   or a capture file that the program wrote (captureFileName in its
+   config file, or "overheadctl capture NAME").  A log file has the
+   time only to the second, and does not say which connection a
+   message came on, so all its requests are played on one connection
+   (how several clients' requests were interleaved is lost); a
+   capture file has the time to the microsecond, and
+   has each client's connection, so they are opened and closed as
+   they were.
+
+   Each request goes out at the time it came in, relative to the
+   first one, divided by the speed: -s 1 (the default) plays them
+   back as they came, -s 10 ten times as fast, and -s 0 as fast as
+   the program answers.  Each answer is found by its refId and
+   compared with the answer given in the field; where they differ
+   we show where (with -v, all of both).  Update messages and
+   heartbeats are passed over.  The exit status is 0 if every
+   answer was the same, 1 if not, and 2 if we could not play them.
+
+   For the answers to match, the program on the desk needs the same
+   config file and event files as the one in the field had.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>        /* printf, fprintf */
+#include <stdlib.h>       /* malloc, atol */
+#include <string.h>       /* memcmp, strstr */
+#include <unistd.h>       /* read, close, usleep */
+#include <errno.h>        /* errno */
+#include <time.h>         /* mktime, clock_gettime */
+#include <netdb.h>        /* getaddrinfo */
+#include <poll.h>         /* poll */
+#include <sys/socket.h>   /* socket, connect, send, recv */
+
+typedef char *STRING;
+typedef int Boolean;
+#define TRUE 1
+#define FALSE 0
+
+#define CAST(t,e) ((t)(e))
+#define TYPED_MALLOC(t) CAST(t*, malloc(sizeof(t)))
+
+/* as in overhead.c */
+#define CAPTURE_MAGIC  "overhead capture 1\n"
+
+#define MAX_CONNECTIONS  256
+
+/* "YYYY-MM-DD HH:MM:SS" at the start of a log line */
+#define STAMP_LENGTH  19
+
+
+/* ***************************************************************** */
+/*                                                                   */
+/*                                                                   */
+/* ***************************************************************** */
+
+/* What is to be played back, in order: a request (a whole frame,
+   header and all) on a connection, or the close of one. */
+
+struct EVENT
+{
+    long long time;                   /* microseconds */
+    int conn;
+    Boolean close;
+
+    STRING frame;                     /* the request */
+    int n;
+    long refId;                       /* -1 if it has none */
+
+    STRING answer;                    /* given in the field; NULL if none */
+    int answer_n;
+
+    struct EVENT *next;
+    struct EVENT *next_pending;       /* waiting for its answer */
+};
+
+struct EVENT *Events = NULL;
+struct EVENT *Last_Event = NULL;
+long event_count = 0;
+
+/* the requests we have not found answers for yet, oldest first */
+struct EVENT *Pending = NULL;
+struct EVENT *Last_Pending = NULL;
+
+STRING host = "127.0.0.1";
+STRING port = "3080";
+double speed = 1;
+int timeout_seconds = 5;
+Boolean verbose = FALSE;
+
+
+void fail(STRING what)
+{
+    perror(what);
+    exit(2);
+}
+
+long find_refId(STRING body, int n)
+{
+    STRING r = memmem(body, n, "<refId>", 7);
+    if (r == NULL) return(-1);
+    return(atol(r + 7));
+}
+
+Boolean is_answer(STRING body, int n)
+{
+    return(memmem(body, n, "<retrieveDataResp", 17) != NULL);
+}
+
+void add_event(long long time, int conn, Boolean close, STRING body, int n, int m)
+{
+    struct EVENT *e = TYPED_MALLOC(struct EVENT);
+    memset(e, 0, sizeof(*e));
+    e->time = time;
+    e->conn = conn;
+    e->close = close;
+    e->refId = -1;
+    if (!close)
+        {
+            e->frame = CAST(STRING, malloc(n + 8));
+            unsigned char *h = CAST(unsigned char *, e->frame);
+            h[0] = (n >> 24) & 0xFF;  h[1] = (n >> 16) & 0xFF;
+            h[2] = (n >> 8) & 0xFF;   h[3] = n & 0xFF;
+            h[4] = (m >> 24) & 0xFF;  h[5] = (m >> 16) & 0xFF;
+            h[6] = (m >> 8) & 0xFF;   h[7] = m & 0xFF;
+            memcpy(e->frame + 8, body, n);
+            e->n = n + 8;
+            e->refId = find_refId(body, n);
+        }
+    if (Last_Event == NULL)
+        Events = e;
+    else
+        Last_Event->next = e;
+    Last_Event = e;
+    if (close) return;
+
+    event_count += 1;
+    if (Last_Pending == NULL)
+        Pending = e;
+    else
+        Last_Pending->next_pending = e;
+    Last_Pending = e;
+}
+
+/* An answer given in the field goes with the oldest request on its
+   connection, with its refId, that has no answer yet.  The program
+   answers in order, so any requests on that connection before that
+   one will not get an answer. */
+void add_answer(int conn, STRING body, int n)
+{
+    if (!is_answer(body, n)) return;
+    long refId = find_refId(body, n);
+
+    struct EVENT *e;
+    for (e = Pending; e != NULL; e = e->next_pending)
+        if ((e->conn == conn) && (e->refId == refId)) break;
+    if (e == NULL) return;
+    e->answer = CAST(STRING, malloc(n));
+    memcpy(e->answer, body, n);
+    e->answer_n = n;
+
+    /* take it, and those before it on its connection, off the list */
+    struct EVENT *answered = e;
+    struct EVENT *prev = NULL;
+    e = Pending;
+    while (e != NULL)
+        {
+            struct EVENT *next = e->next_pending;
+            Boolean done = (e == answered);
+            if (e->conn == conn)
+                {
+                    if (prev == NULL)
+                        Pending = next;
+                    else
+                        prev->next_pending = next;
+                    if (Last_Pending == e) Last_Pending = prev;
+                }
+            else
+                prev = e;
+            if (done) break;
+            e = next;
+        }
+}
+
+
+/* ***************************************************************** */
+/*                                                                   */
+/*                                                                   */
+/* ***************************************************************** */
+
+STRING read_file(STRING name, long *length)
+{
+    FILE *f = fopen(name, "r");
+    if (f == NULL) fail(name);
+    fseek(f, 0, SEEK_END);
+    long n = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    STRING s = CAST(STRING, malloc(n + 1));
+    if (fread(s, 1, n, f) != n) fail(name);
+    s[n] = '\0';
+    fclose(f);
+    *length = n;
+    return(s);
+}
+
+/* copy what is from s up to end (at most size - 1 bytes) into to,
+   as a string */
+void bounded_copy(STRING to, int size, STRING s, STRING end)
+{
+    long n = end - s;
+    if (n > size - 1) n = size - 1;
+    memcpy(to, s, n);
+    to[n] = '\0';
+}
+
+/* A log file.  Each message is logged as
+
+       YYYY-MM-DD HH:MM:SS: incoming message:
+       (n)(m)<n bytes of body>
+
+   and the same for "outgoing message".  A message is followed by a
+   newline, so we can tell one that lost lines in the log broke. */
+
+void read_log(STRING s, long length)
+{
+    STRING end = s + length;
+    STRING p = s;
+    int damaged = 0;
+    char stamp[STAMP_LENGTH + 1] = "";
+    long long time = 0;
+    while (TRUE)
+        {
+            STRING in = memmem(p, end - p, " message:\n(", 11);
+            if (in == NULL) break;
+            p = in + 11;
+
+            /* the kind and the time stamp are before it, on its line */
+            STRING line = in;
+            while ((line > s) && (line[-1] != '\n')) line -= 1;
+            Boolean incoming = (in - line >= 8) && (memcmp(in - 8, "incoming", 8) == 0);
+            Boolean outgoing = (in - line >= 8) && (memcmp(in - 8, "outgoing", 8) == 0);
+            if (!incoming && !outgoing) continue;
+
+            /* sscanf() takes the strlen() of what it is given, which
+               here would be the rest of the log; so give it a copy of
+               just the part it needs */
+            char field[STAMP_LENGTH + 1];
+            bounded_copy(field, sizeof(field), line, in);
+            if (strcmp(field, stamp) != 0)
+                {
+                    /* a new second; most messages are in the same one */
+                    struct tm tm;
+                    memset(&tm, 0, sizeof(tm));
+                    if (sscanf(field, "%d-%d-%d %d:%d:%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+                               &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6)
+                        continue;
+                    tm.tm_year -= 1900;
+                    tm.tm_mon -= 1;
+                    tm.tm_isdst = -1;
+                    time = CAST(long long, mktime(&tm)) * 1000000;
+                    strcpy(stamp, field);
+                }
+
+            int n, m, used;
+            char counts[32];
+            bounded_copy(counts, sizeof(counts), p, end);
+            if (sscanf(counts, "%d)(%d)%n", &n, &m, &used) != 2) continue;
+            p += used;
+            if ((n < 0) || (n > end - p))
+                {
+                    fprintf(stderr, "cvmreplay: a message of %d bytes is cut short\n", n);
+                    break;
+                }
+
+            /* each message ends with a newline; if not, the program
+               had to drop part of it ("log lines lost") */
+            if ((n < end - p) && (p[n] != '\n'))
+                {
+                    damaged += 1;
+                    continue;
+                }
+            if (incoming)
+                add_event(time, 0, FALSE, p, n, m);
+            else
+                add_answer(0, p, n);
+            p += n;
+        }
+
+    if (damaged > 0)
+        fprintf(stderr, "cvmreplay: %d messages in the log are not whole; skipped them\n", damaged);
+}
+
+
+/* A capture file: the bytes each way on each connection.  Put them
+   back together into messages, as they were. */
+
+struct STREAM
+{
+    int conn;
+    STRING in;                        /* from the client */
+    long in_n;
+    STRING out;                       /* to the client */
+    long out_n;
+};
+
+struct STREAM *Streams[MAX_CONNECTIONS];
+int stream_count = 0;
+
+struct STREAM *find_stream(int conn)
+{
+    int i;
+    for (i = 0; i < stream_count; i++)
+        if (Streams[i]->conn == conn) return(Streams[i]);
+    if (stream_count == MAX_CONNECTIONS)
+        {
+            /* reuse the oldest */
+            free(Streams[0]->in);
+            free(Streams[0]->out);
+            free(Streams[0]);
+            memmove(Streams, Streams + 1, (MAX_CONNECTIONS - 1) * sizeof(Streams[0]));
+            stream_count -= 1;
+        }
+    struct STREAM *t = Streams[stream_count++] = TYPED_MALLOC(struct STREAM);
+    memset(t, 0, sizeof(*t));
+    t->conn = conn;
+    return(t);
+}
+
+unsigned long long get_word(unsigned char *p, int n)
+{
+    unsigned long long v = 0;
+    int i;
+    for (i = 0; i < n; i++) v = (v << 8) | p[i];
+    return(v);
+}
+
+/* take the whole messages off the front of a stream */
+void take_messages(STRING *buffer, long *have, long long time, int conn, Boolean incoming)
+{
+    while (*have >= 8)
+        {
+            unsigned char *h = CAST(unsigned char *, *buffer);
+            long n = get_word(h, 4);
+            int m = get_word(h + 4, 4);
+            if (*have < 8 + n) return;
+            if (n > 0)
+                {
+                    if (incoming)
+                        add_event(time, conn, FALSE, *buffer + 8, n, m);
+                    else
+                        add_answer(conn, *buffer + 8, n);
+                }
+            *have -= 8 + n;
+            memmove(*buffer, *buffer + 8 + n, *have);
+        }
+}
+
+void add_bytes(STRING *buffer, long *have, STRING data, long n)
+{
+    *buffer = CAST(STRING, realloc(*buffer, *have + n + 1));
+    memcpy(*buffer + *have, data, n);
+    *have += n;
+}
+
+void read_capture(STRING s, long length)
+{
+    unsigned char *p = CAST(unsigned char *, s + strlen(CAPTURE_MAGIC));
+    unsigned char *end = CAST(unsigned char *, s + length);
+    while (end - p >= 17)
+        {
+            long long time = get_word(p, 8);
+            int conn = get_word(p + 8, 4);
+            char what = p[12];
+            long n = get_word(p + 13, 4);
+            p += 17;
+            if (n > end - p)
+                {
+                    fprintf(stderr, "cvmreplay: the capture file is cut short\n");
+                    return;
+                }
+
+            struct STREAM *t = find_stream(conn);
+            switch (what)
+                {
+                case 'I':
+                    add_bytes(&t->in, &t->in_n, CAST(STRING, p), n);
+                    take_messages(&t->in, &t->in_n, time, conn, TRUE);
+                    break;
+                case 'S':
+                    add_bytes(&t->out, &t->out_n, CAST(STRING, p), n);
+                    take_messages(&t->out, &t->out_n, time, conn, FALSE);
+                    break;
+                case 'C':
+                    add_event(time, conn, TRUE, NULL, 0, 0);
+                    t->in_n = 0;
+                    t->out_n = 0;
+                    break;
+                }
+            p += n;
+        }
+}
+
+
+/* ***************************************************************** */
+/*                                                                   */
+/*                                                                   */
+/* ***************************************************************** */
+
+/* our connections to the program, for each of the field's */
+struct REPLAY
+{
+    int conn;
+    int fd;
+    unsigned char header[8];
+    STRING body;
+};
+
+struct REPLAY Replays[MAX_CONNECTIONS];
+int replay_count = 0;
+
+long same = 0;
+long different = 0;
+long missing = 0;
+long unanswered = 0;                  /* no answer in the field either */
+
+long long now_us(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return(CAST(long long, now.tv_sec) * 1000000 + now.tv_nsec / 1000);
+}
+
+int connect_to_program(void)
+{
+    struct addrinfo hints;
+    struct addrinfo *ai;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &ai) != 0)
+        {
+            fprintf(stderr, "cvmreplay: cannot find %s\n", host);
+            exit(2);
+        }
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) fail("socket");
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) fail("connect");
+    freeaddrinfo(ai);
+    return(fd);
+}
+
+struct REPLAY *find_replay(int conn, Boolean open)
+{
+    int i;
+    for (i = 0; i < replay_count; i++)
+        if (Replays[i].conn == conn) return(&Replays[i]);
+    if (!open) return(NULL);
+    if (replay_count == MAX_CONNECTIONS)
+        {
+            fprintf(stderr, "cvmreplay: more than %d connections at once\n", MAX_CONNECTIONS);
+            exit(2);
+        }
+    struct REPLAY *r = &Replays[replay_count++];
+    r->conn = conn;
+    r->fd = connect_to_program();
+    r->body = NULL;
+    return(r);
+}
+
+void close_replay(int conn)
+{
+    struct REPLAY *r = find_replay(conn, FALSE);
+    if (r == NULL) return;
+    close(r->fd);
+    free(r->body);
+    *r = Replays[--replay_count];
+}
+
+/* read n bytes by the deadline; FALSE if they do not come */
+Boolean read_by(int fd, STRING where, long n, long long deadline)
+{
+    while (n > 0)
+        {
+            long long left = deadline - now_us();
+            if (left <= 0) return(FALSE);
+            struct pollfd p = { fd, POLLIN, 0 };
+            if (poll(&p, 1, CAST(int, left / 1000) + 1) <= 0) continue;
+            int rc = recv(fd, where, n, 0);
+            if (rc < 0 && errno == EINTR) continue;
+            if (rc <= 0) return(FALSE);
+            where += rc;
+            n -= rc;
+        }
+    return(TRUE);
+}
+
+/* the answer to the request with this refId; its length, or -1 */
+long read_answer(struct REPLAY *r, long refId)
+{
+    long long deadline = now_us() + CAST(long long, timeout_seconds) * 1000000;
+    while (TRUE)
+        {
+            if (!read_by(r->fd, CAST(STRING, r->header), 8, deadline)) return(-1);
+            long n = get_word(r->header, 4);
+            r->body = CAST(STRING, realloc(r->body, n + 1));
+            if (!read_by(r->fd, r->body, n, deadline)) return(-1);
+            r->body[n] = '\0';
+            if (is_answer(r->body, n) && (find_refId(r->body, n) == refId)) return(n);
+        }
+}
+
+void show_difference(struct EVENT *e, STRING got, long n)
+{
+    long i = 0;
+    while ((i < n) && (i < e->answer_n) && (got[i] == e->answer[i])) i += 1;
+
+    printf("request %ld on connection %d: answers differ at byte %ld\n", e->refId, e->conn, i);
+    long from = (i > 40) ? i - 40 : 0;
+    if (verbose) from = 0;
+    long to_field = verbose ? e->answer_n : ((i + 40 < e->answer_n) ? i + 40 : e->answer_n);
+    long to_here = verbose ? n : ((i + 40 < n) ? i + 40 : n);
+    printf("  field:  %.*s\n", CAST(int, to_field - from), e->answer + from);
+    printf("  replay: %.*s\n", CAST(int, to_here - from), got + from);
+}
+
+void replay(void)
+{
+    if (Events == NULL) return;
+    long long first = Events->time;
+    long long start = now_us();
+
+    struct EVENT *e;
+    for (e = Events; e != NULL; e = e->next)
+        {
+            if (speed > 0)
+                {
+                    long long when = start + CAST(long long, (e->time - first) / speed);
+                    long long wait = when - now_us();
+                    if (wait > 0) usleep(wait);
+                }
+
+            if (e->close)
+                {
+                    close_replay(e->conn);
+                    continue;
+                }
+
+            struct REPLAY *r = find_replay(e->conn, TRUE);
+            if (send(r->fd, e->frame, e->n, MSG_NOSIGNAL) != e->n) fail("send");
+
+            if (e->answer == NULL)
+                {
+                    unanswered += 1;
+                    continue;
+                }
+            long n = read_answer(r, e->refId);
+            if (n < 0)
+                {
+                    printf("request %ld on connection %d: no answer\n", e->refId, e->conn);
+                    missing += 1;
+                    continue;
+                }
+            if ((n == e->answer_n) && (memcmp(r->body, e->answer, n) == 0))
+                same += 1;
+            else
+                {
+                    different += 1;
+                    show_difference(e, r->body, n);
+                }
+        }
+}
+
+
+void usage(void)
+{
+    fprintf(stderr, "usage: cvmreplay [-h host] [-p port] [-s speed] [-t seconds] [-v] file\n");
+    fprintf(stderr, "  file is a capture file, or a log file (played on one connection)\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:s:t:v")) != -1)
+        {
+            switch (opt)
+                {
+                case 'h': host = optarg; break;
+                case 'p': port = optarg; break;
+                case 's': speed = atof(optarg); break;
+                case 't': timeout_seconds = atoi(optarg); break;
+                case 'v': verbose = TRUE; break;
+                default: usage();
+                }
+        }
+    if ((optind != argc - 1) || (speed < 0)) usage();
+
+    long length;
+    STRING s = read_file(argv[optind], &length);
+    if ((length >= strlen(CAPTURE_MAGIC)) && (memcmp(s, CAPTURE_MAGIC, strlen(CAPTURE_MAGIC)) == 0))
+        read_capture(s, length);
+    else
+        read_log(s, length);
+
+    long long start = now_us();
+    replay();
+    double seconds = (now_us() - start) / 1e6;
+
+    printf("requests\t%ld\n", event_count);
+    printf("same\t%ld\n", same);
+    printf("different\t%ld\n", different);
+    printf("no_answer\t%ld\n", missing);
+    printf("not_answered_in_field\t%ld\n", unanswered);
+    printf("seconds\t%.3f\n", seconds);
+    return(((different == 0) && (missing == 0)) ? 0 : 1);
+}
@@ -47,15 +47,17 @@
 
    Communication is done over TCP/IP.  We assume that the IP
    addresses are being statically assigned by TxDOT.  Our code
-   will create a socket and wait for CVM to connect to us.  We do
-   not create a connection; only CVM does that.  They will send
-   us a retrieveDataReq request message and we will respond to
-   that with a retrieveDataResp response message.  The request
-   message asks for our status, and we respond with the last
-   overheight event data that we have.  If an overheight event
-   happens, we remember it and (if the connection is still up)
-   send an overheightUpdateMsg message to CVM.  At the moment,
-   that's all there is to it.
+   will create a socket and wait for CVM to connect to us.  If
+   CVMAddress is set in the config file, we also connect to CVM
+   ourselves, and keep that connection up (see "Push mode" below).
+   On either connection, CVM will send us a retrieveDataReq
+   request message and we will respond to that with a
+   retrieveDataResp response message.  The request message asks
+   for our status, and we respond with the overheight events that
+   have happened since CVM last asked (or, if there are none, the
+   last one we have).  If an overheight event happens, we remember
+   it and send an overheightUpdateMsg message on every connection
+   that is up.  At the moment, that's all there is to it.
 
    All these messages are in XML.  There are XML description
    documents available from TxDOT, but they seem to be
@@ -106,6 +108,10 @@
     data from the last overheight event, and one field is the
     status, which is pretty well always "Active" (we hope).
 
+    There is one <overheightReadingData> for each event since
+    CVM last asked; if there have been none, we repeat the last
+    event we have.
+
     An overheightUpdateMsg message is pretty well the same
     as a retrieveDataResp response message, but slightly different:
 
@@ -149,10 +155,9 @@
     don't do that, so we had to write our own.
 
     As near as I can tell, the code from Moxa polls for an event;
-    while our code to wait for network events is interrupt based
-    (using the select() system call).  So we have two parts to
-    our code: one part polls for events, the other waits for
-    network activity.
+    while our code to wait for network events is event driven.  So
+    we have two parts to our code: one part polls for events, the
+    other waits for network activity.
 
     The connection between the two parts is the event data: the
     time and date of the last event.  We put this into a file in
@@ -163,15 +168,17 @@
     Initially, we thought these two parts would need to be
     separate processes.  However, it looks like we need to poll
     the Moxa input lines at a frequent rate (at least every .05
-    seconds), and the easiest way to do that is with a time-out
-    for a select() system call.  You can sleep() for as little as
-    a second, but to get sub-second waits, I can use select().
-    The time-out value for a select allows the time to be
-    in seconds and nanoseconds.  Since we need a select() to
-    wait for the network part, we can combine the two into one
-    select() which waits for either network activity or a
-    time-out.  If network activity, process it.  If a time-out,
-    go poll the MOXA input lines.
+    seconds), so both parts run in one loop, a reactor built on
+    epoll (or io_uring; see Reactor_Dispatch()).  Everything the program waits
+    for is a file descriptor registered with it, along with the
+    function to call when it is ready: the listening sockets and
+    each client, and the control socket.  The polling interval is a
+    timerfd (Poll_Source), so a poll of the MOXA input lines is just
+    another thing that becomes ready, and a housekeeping timerfd
+    does the once-a-second work.  Signals come in thru a signalfd, so they are handled in
+    the loop like everything else and never interrupt the work in
+    the middle.  The loop waits until one of these is ready, calls
+    its function, and waits again.
 
     The constant parts of the messages that can vary from
     detector to detector are set in a configuration file.  When
@@ -209,6 +216,8 @@
 /*                                                                   */
 /* ***************************************************************** */
 
+#define _GNU_SOURCE               /* accept4, ... */
+
 #include <stdio.h>        /* fopen, fprint, fclose, ... */
 #include <stdlib.h>       /* malloc, free */
 #include <unistd.h>       /* getpid, open, close, ... */
@@ -296,6 +305,69 @@ Boolean mystrcasecmp(STRING s, STRING t)
     return(FALSE);
 }
 
+/* ***************************************************************** */
+/*                                                                   */
+/*                                                                   */
+/* ***************************************************************** */
+
+/* An arena is one block of memory, handed out from the front.  The
+   tree for a message is allocated from an arena big enough for the
+   largest tree the message could have.  When we are done with the
+   message, the whole tree is released at once by resetting the
+   arena.  This is much cheaper than a malloc() and free() for each
+   element, and does not fragment the heap over months of running.
+
+   We keep the block from one message to the next, unless a large
+   message made it bigger than ARENA_KEEP_SIZE. */
+
+#define ARENA_KEEP_SIZE  16384
+
+/* keep everything we hand out aligned for any type */
+#define ARENA_ALIGN  8
+
+struct ARENA
+{
+    STRING base;
+    int size;       /* bytes in the block */
+    int used;       /* bytes handed out */
+    int peak;       /* most bytes ever handed out */
+};
+
+struct ARENA xml_arena = { NULL, 0, 0, 0 };
+
+
+void Arena_Reserve(struct ARENA *a, int n)
+{
+    /* make sure we have a block of at least n bytes */
+    a->used = 0;
+    if (a->size >= n) return;
+    if (a->base != NULL) free(a->base);
+    a->base = CAST(STRING, malloc(n));
+    a->size = (a->base == NULL) ? 0 : n;
+}
+
+void *Arena_Alloc(struct ARENA *a, int n)
+{
+    n = (n + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    if (a->used + n > a->size) return(NULL);
+    void *p = &a->base[a->used];
+    a->used += n;
+    return(p);
+}
+
+void Arena_Release(struct ARENA *a)
+{
+    /* everything we handed out is gone at once */
+    if (a->used > a->peak) a->peak = a->used;
+    a->used = 0;
+    if (a->size > ARENA_KEEP_SIZE)
+        {
+            free(a->base);
+            a->base = NULL;
+            a->size = 0;
+        }
+}
+
 /* ***************************************************************** */
 /*                                                                   */
 /*                                                                   */
@@ -309,6 +381,12 @@ Boolean mystrcasecmp(STRING s, STRING t)
 
 void important(const char *format, ...);
 
+/* and to stream long messages, we need to send (and log) them in
+   pieces, before we get to the network code. */
+
+void Log_Raw(STRING s, int n);
+int Send_Bytes(FileDesc fd, STRING buffer, int n);
+
 
 /* ***************************************************************** */
 /*                                                                   */
@@ -327,7 +405,7 @@ STRING Log_Directory = DEFAULT_LOG_DIRECTORY;
 STRING Config_FileName = DEFAULT_CONFIG_FILENAME;
 
 STRING Log_FileName = NULL;
-FILE *log_file = NULL;
+FileDesc log_fd = -1;
 
 
 Boolean debug = FALSE;
@@ -348,8 +426,66 @@ STRING icdVersion = NULL;
 /* Variables needed for the network connections. */
 
 STRING PortName = NULL;
+STRING ExportPortName = NULL;
+#define DEFAULT_CONTROL_SOCKET_NAME "overhead.ctl"
+STRING ControlSocketName = NULL;
+STRING captureFileName = NULL;
 STRING StringMyRefId = NULL;
 
+/* where CVM is (host:port), if we are to connect to it ourselves,
+   and how long the connection may be quiet before we send a
+   heartbeat (0 for none) */
+STRING CVMAddress = NULL;
+#define HEARTBEAT_INTERVAL  30  /* seconds */
+int heartbeatInterval = HEARTBEAT_INTERVAL;
+
+/* how many clients (CVM, and anyone else, such as a technician's
+   laptop) may be connected at once; maxClients in the config file
+   can lower this */
+#define MAX_CLIENTS  128
+int maxClients = MAX_CLIENTS;
+
+/* Socket options for clients.  Each message goes out in one call,
+   so there is nothing for Nagle's algorithm to gather, and it would
+   only hold a reply until CVM acknowledges the one before it; so
+   tcpNoDelay is on unless the config file turns it off.  With
+   tcpCork, the parts of a long response are sent marked as having
+   more to follow, so they go out in full packets.  sendBufferSize
+   sets SO_SNDBUF; 0 leaves it to the kernel. */
+Boolean tcpNoDelay = TRUE;
+Boolean tcpCork = TRUE;
+int sendBufferSize = 0;
+
+/* Queue limits.  A client that stops reading must not use up our
+   memory, which on the ioPAC is small.  Each connection may have at
+   most maxQueuedMessages messages and maxQueuedBytes bytes waiting
+   to be sent, and all of them together at most networkMemoryLimit
+   bytes.  A response counts for what it holds (its cursor and one
+   chunk), not its length, since it is made as it is sent; a shared
+   update counts in full for each client that has it.  When a
+   connection would go over, queuePolicy says what to do: "drop"
+   lets go of its oldest status updates that have not started to go
+   out, and then of the new one if it is a status update too -- but
+   never of an event or a response, so if one of those still does not
+   fit, the client is disconnected; "disconnect" disconnects it at
+   once. */
+enum Queue_Policy { QP_DROP, QP_DISCONNECT };
+enum Queue_Policy queuePolicy = QP_DROP;
+int maxQueuedMessages = 100;
+int maxQueuedBytes = 256 * 1024;
+int networkMemoryLimit = 4 * 1024 * 1024;
+
+/* TLS.  With useTLS, the clients of the CVM port, and our own
+   connection to CVM (CVMAddress), talk TLS; the program must be
+   built with USE_TLS.  The port needs tlsCertificate and
+   tlsPrivateKey (PEM files, relative to the home directory).  With
+   tlsCAFile, the CVM we dial must have a certificate signed by one
+   of those, for the host in CVMAddress. */
+Boolean useTLS = FALSE;
+STRING tlsCertificate = NULL;
+STRING tlsPrivateKey = NULL;
+STRING tlsCAFile = NULL;
+
 /* maximum allowed length of an XML request message */
 #define MAX_MESSAGE_LENGTH  100000
 
@@ -459,6 +595,48 @@ int decode_polling_delay(STRING value)
 }
 
 
+int decode_max_clients(STRING value)
+{
+    /* at least one client, for CVM */
+    int n = atoi(value);
+    if (n < 1) n = 1;
+    if (n > MAX_CLIENTS) n = MAX_CLIENTS;
+    return(n);
+}
+
+
+Boolean decode_boolean(STRING value)
+{
+    return(mystrcasecmp(value, "on") || mystrcasecmp(value, "true")
+           || mystrcasecmp(value, "yes") || (atoi(value) != 0));
+}
+
+
+enum Queue_Policy decode_queue_policy(STRING value)
+{
+    if (mystrcasecmp(value, "disconnect")) return(QP_DISCONNECT);
+    return(QP_DROP);
+}
+
+int decode_queued_messages(STRING value)
+{
+    /* room for a response and an update, at least */
+    int n = atoi(value);
+    if (n < 2) n = 2;
+    return(n);
+}
+
+
+int decode_heartbeat_interval(STRING value)
+{
+    /* 0 (no heartbeats) up to an hour */
+    int n = atoi(value);
+    if (n < 0) n = 0;
+    if (n > 3600) n = 3600;
+    return(n);
+}
+
+
 int decode_file_size(STRING value)
 {
     /* a file size can be a number <n> or <n>K or <n>M */
@@ -505,6 +683,10 @@ struct detector_device_descriptor
 
     /* the following fields may actually change */
     enum DeviceStatus status;
+
+    /* bytes cut from the front of the event file (as the clients
+       that ask for events are sent them) since we read the config */
+    off_t event_base;
     
 };
 
@@ -570,6 +752,7 @@ DEVICE search_device_array(STRING name)
             d->fault_channel = -1;    
             d->eventFileName = NULL;
             d->status = ST_ERROR;
+            d->event_base = 0;
             if (debug) fprintf(stderr, "new device %d: %s\n", i, d->name);
             return(d);
         }
@@ -596,6 +779,167 @@ void free_DDD(DEVICE d)
     free(d);
 }
 
+/* ***************************************************************** */
+/*                                                                   */
+/*                                                                   */
+/* ***************************************************************** */
+
+/* Counters.  To see how the program is doing, we count things as
+   they happen.  Each counter is just a variable; the table gives
+   them names, so we can list them all in the log. */
+
+typedef unsigned long long COUNTER;
+
+COUNTER Messages_Received = 0;
+COUNTER Fastpath_Hits = 0;
+COUNTER Fastpath_Misses = 0;
+COUNTER Bytes_Queued = 0;
+COUNTER Partial_Writes = 0;
+COUNTER Write_Stalls = 0;
+COUNTER Send_Timeouts = 0;
+COUNTER Socket_Reads = 0;
+COUNTER Socket_Writes = 0;
+COUNTER Outbound_Connects = 0;
+COUNTER Outbound_Failures = 0;
+COUNTER Heartbeats_Sent = 0;
+COUNTER Heartbeats_Received = 0;
+COUNTER Queue_Drops = 0;
+COUNTER Queue_Disconnects = 0;
+COUNTER Queued_Memory = 0;            /* now, not a count */
+COUNTER Queued_Memory_Peak = 0;
+COUNTER Log_Overflows = 0;            /* log lines dropped, ring full */
+COUNTER Log_Writes = 0;               /* batches written by the log writer */
+COUNTER Exports_Refused = 0;          /* MAX_EXPORTS were going already */
+#ifdef USE_TLS
+COUNTER TLS_Handshakes = 0;
+COUNTER TLS_Resumed = 0;
+COUNTER TLS_Failures = 0;
+COUNTER TLS_Full_CPU = 0;             /* microseconds, in all */
+COUNTER TLS_Resumed_CPU = 0;
+#endif
+
+/* Histograms.  Some things we time, and count how many took up to
+   1, 2, 4, 8, ... microseconds; the last bucket takes everything
+   longer.  The control socket shows them. */
+#define HISTOGRAM_BUCKETS  24
+
+struct histogram
+{
+    STRING name;
+    COUNTER bucket[HISTOGRAM_BUCKETS];
+};
+
+struct histogram Reply_Times = { "replyMicroseconds", { 0 } };
+struct histogram Poll_Times = { "pollMicroseconds", { 0 } };
+struct histogram Control_Times = { "controlMicroseconds", { 0 } };
+
+struct histogram *Histograms[] = { &Reply_Times, &Poll_Times, &Control_Times, NULL };
+
+COUNTER Microseconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return(CAST(COUNTER, now.tv_sec) * 1000000 + now.tv_nsec / 1000);
+}
+
+/* count the time since start */
+void Count_Time(struct histogram *h, COUNTER start)
+{
+    COUNTER us = Microseconds() - start;
+    int i = 0;
+    while ((i < HISTOGRAM_BUCKETS - 1) && (us > (1ULL << i))) i += 1;
+    h->bucket[i] += 1;
+}
+
+/* messages that the validator turns away, by why */
+enum Reject_Reason
+{
+    RJ_NONE,
+    RJ_SYNTAX,                      /* not XML */
+    RJ_MISMATCH,                    /* end tag does not match start tag */
+    RJ_UNKNOWN_MESSAGE,             /* root tag is not a request we know */
+    RJ_TOO_DEEP,                    /* a field that is not just text */
+    RJ_DUPLICATE_FIELD,
+    RJ_MISSING_FIELD,
+    RJ_MISPLACED_TEXT,              /* text outside of a field */
+    RJ_TRAILING,                    /* more after the root element */
+    RJ_TOO_LONG,                    /* skipped without reading it */
+    RJ_COUNT
+};
+
+COUNTER Rejects[RJ_COUNT] = { 0 };
+
+struct counter_table
+{
+    STRING name;
+    COUNTER *value;
+};
+
+struct counter_table Counters[] =
+{
+    { "messagesReceived", &Messages_Received },
+    { "fastpathHits", &Fastpath_Hits },
+    { "fastpathMisses", &Fastpath_Misses },
+    { "bytesQueued", &Bytes_Queued },
+    { "partialWrites", &Partial_Writes },
+    { "writeStalls", &Write_Stalls },
+    { "sendTimeouts", &Send_Timeouts },
+    { "socketReads", &Socket_Reads },
+    { "socketWrites", &Socket_Writes },
+    { "outboundConnects", &Outbound_Connects },
+    { "outboundFailures", &Outbound_Failures },
+    { "heartbeatsSent", &Heartbeats_Sent },
+    { "heartbeatsReceived", &Heartbeats_Received },
+    { "queueDrops", &Queue_Drops },
+    { "queueDisconnects", &Queue_Disconnects },
+    { "queuedMemory", &Queued_Memory },
+    { "queuedMemoryPeak", &Queued_Memory_Peak },
+    { "logOverflows", &Log_Overflows },
+    { "logWrites", &Log_Writes },
+    { "exportsRefused", &Exports_Refused },
+#ifdef USE_TLS
+    { "tlsHandshakes", &TLS_Handshakes },
+    { "tlsResumed", &TLS_Resumed },
+    { "tlsFailures", &TLS_Failures },
+    { "tlsFullMicroseconds", &TLS_Full_CPU },
+    { "tlsResumedMicroseconds", &TLS_Resumed_CPU },
+#endif
+    { "rejectedSyntax", &Rejects[RJ_SYNTAX] },
+    { "rejectedMismatch", &Rejects[RJ_MISMATCH] },
+    { "rejectedUnknownMessage", &Rejects[RJ_UNKNOWN_MESSAGE] },
+    { "rejectedTooDeep", &Rejects[RJ_TOO_DEEP] },
+    { "rejectedDuplicateField", &Rejects[RJ_DUPLICATE_FIELD] },
+    { "rejectedMissingField", &Rejects[RJ_MISSING_FIELD] },
+    { "rejectedMisplacedText", &Rejects[RJ_MISPLACED_TEXT] },
+    { "rejectedTrailing", &Rejects[RJ_TRAILING] },
+    { "rejectedTooLong", &Rejects[RJ_TOO_LONG] },
+    { NULL, NULL }
+};
+
+/* percent of a in a+b, for hit rates */
+int percent(COUNTER a, COUNTER b)
+{
+    if (a + b == 0) return(0);
+    return(CAST(int, (100 * a) / (a + b)));
+}
+
+void Dump_Counters(void)
+{
+    int i;
+    important("Counters:\n");
+    for (i = 0; Counters[i].name != NULL; i++)
+        important("\t %s: %llu\n", Counters[i].name, *Counters[i].value);
+    important("\t fast path hit rate: %d%%\n", percent(Fastpath_Hits, Fastpath_Misses));
+#ifdef USE_TLS
+    COUNTER full = TLS_Handshakes - TLS_Resumed;
+    important("\t TLS sessions resumed: %d%%\n", percent(TLS_Resumed, full));
+    important("\t CPU per TLS handshake: %llu us full, %llu us resumed\n",
+              ((full > 0) ? TLS_Full_CPU / full : 0),
+              ((TLS_Resumed > 0) ? TLS_Resumed_CPU / TLS_Resumed : 0));
+#endif
+}
+
+
 /* ***************************************************************** */
 /*                                                                   */
 /*                                                                   */
@@ -607,10 +951,31 @@ void Dump_Program_State(void)
     
     important("Initial Configuration Values\n");
     important("Listen on port %s\n", PortName);
+    if (ExportPortName != NULL)
+        important("Export on port %s\n", ExportPortName);
+    if (ControlSocketName != NULL)
+        important("Control socket is %s\n", ControlSocketName);
+    if (captureFileName != NULL)
+        important("Capture to %s\n", captureFileName);
     important("Our RefId starts at %s\n", StringMyRefId);
     important("Our icdVersion is %s\n", icdVersion);
     important("Polling delay is %d microseconds\n", pollingDelay);
+    important("At most %d clients\n", maxClients);
+    if (CVMAddress != NULL)
+        important("Connect to CVM at %s; heartbeat after %d seconds\n", CVMAddress, heartbeatInterval);
+    important("Queue at most %d messages, %d bytes per client; %d bytes in all; %s\n",
+              maxQueuedMessages, maxQueuedBytes, networkMemoryLimit,
+              ((queuePolicy == QP_DROP) ? "drop status updates" : "disconnect"));
+    important("TCP_NODELAY is %s; MSG_MORE is %s\n",
+              (tcpNoDelay ? "on" : "off"), (tcpCork ? "on" : "off"));
+    if (sendBufferSize > 0)
+        important("Send buffer is %d bytes\n", sendBufferSize);
+    if (useTLS)
+        important("TLS with certificate %s%s%s\n", tlsCertificate,
+                  ((tlsCAFile != NULL) ? "; CVM checked against " : ""),
+                  ((tlsCAFile != NULL) ? tlsCAFile : ""));
     important("Log File Limit is %d bytes\n", Log_File_Limit);
+    important("Peak XML arena use is %d bytes\n", xml_arena.peak);
 
     for (i = 0; i < MAX_DETECTORS; i++)
         {
@@ -641,6 +1006,9 @@ void Dump_Program_State(void)
                        (d->fault_channel == i) ? "fault" : "invalid")                     
                       );
         }
+
+    important("\n");
+    Dump_Counters();
 }
 
 /* ***************************************************************** */
@@ -648,198 +1016,171 @@ void Dump_Program_State(void)
 /*                                                                   */
 /* ***************************************************************** */
 
-int size_of_file(STRING name)
+/* Time service.  We format the current time over and over: a time
+   stamp for every log line, the date to check if we need a new log
+   file, the time and date of each event.  Calling localtime() and
+   snprintf() for each of those is a lot of work for a small ARM
+   box, when the answer only changes once a second.
+
+   So we keep one cache of the broken-down time.  It is good for
+   the current second.  Within the current hour we can compute the
+   minutes and seconds ourselves; only when we cross an hour
+   boundary do we call localtime() again (daylight savings changes
+   happen on the hour).  We also keep the time of the next midnight,
+   so checking for a new day is a single compare.
+
+   Digits are formatted from a table of two-digit pairs, rather
+   than thru snprintf(). */
+
+static const char Two_Digits[200] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+struct TIME_CACHE
 {
-    struct stat statusbuffer;
+    time_t now;          /* the second that this cache describes */
+    time_t hour_start;   /* time_t of hh:00:00 for the current hour */
+    time_t next_hour;    /* when we need to call localtime() again */
+    time_t midnight;     /* start of the next day */
+    struct tm tm;        /* broken-down form of now */
+
+    char stamp[20];      /* "YYYY-MM-DD HH:MM:SS" */
+    char date[9];        /* "YYYYMMDD" -- the log file name */
+};
 
-    /* stat the file, and return the size */
-    if (stat(name, &statusbuffer) < 0)
-        {
-            perror(name);
-            return(0);
-        }
-    return(statusbuffer.st_size);
-}
+struct TIME_CACHE Time_Cache = { 0 };
 
-void DeleteOldestFilesUntilUnderLimit(int n)
+/* put a number from 0 to 99 as two digits */
+static inline char *put2(char *p, unsigned int n)
 {
-    /* Run thru the log file.  Find the oldest
-       file and delete it. */
-    while (n > Log_File_Limit)
-        {
-            DIR * dirp;
-            struct dirent *dp;
-            
-            int oldest = 0;
-            char oldest_name[MAX_FILENAME_LENGTH];
-            int oldest_n = 0;
-            
-            dirp = opendir(Log_Directory);
-            if (dirp == NULL)
-                {
-                    fprintf(stderr, "%s is unreadable\n", Log_Directory);
-                    return;
-                }
-            
-            while ((dp = readdir(dirp)) != 0)
-                {
-                    if (dp->d_ino == 0)
-                        continue;
-                    if (dp->d_name[0] == '.')
-                        continue;
-
-                    char full_name[MAX_FILENAME_LENGTH];
-                    snprintf(full_name, sizeof(full_name), "%s/%s",
-                             Log_Directory, dp->d_name);
-                    struct stat statbuf;
-                    int rc = stat(full_name, &statbuf);
-                    if (rc != 0) { oldest = 0; break; }
-                    
-                    if ((oldest == 0) || (oldest > statbuf.st_ctime))
-                        {
-                            oldest = statbuf.st_ctime;
-                            strncpy(oldest_name, full_name, sizeof(oldest_name));
-                            oldest_n = statbuf.st_size;
-                        }
-                }
-            closedir(dirp);
+    const char *d = &Two_Digits[2 * (n % 100)];
+    p[0] = d[0];
+    p[1] = d[1];
+    return(p + 2);
+}
 
-            /* make sure we found a file */
-            if (oldest == 0) return;
+/* put a number from 0 to 9999 as four digits */
+static inline char *put4(char *p, unsigned int n)
+{
+    p = put2(p, (n / 100) % 100);
+    return(put2(p, n % 100));
+}
 
-            /* check if we are down to just the most recent file */
-            if (STRING_EQUAL(oldest_name, Log_FileName)) return;
-            
-            /* delete the oldest file */
-            int rc = unlink(oldest_name);
-            important("remove %s -> %d\n", oldest_name, rc);
-            n = n - oldest_n;
-        }
+void Recompute_Time_Cache(time_t t)
+{
+    /* the slow path:  once an hour, or if the clock is reset */
+    struct tm *tm = &Time_Cache.tm;
+    localtime_r(&t, tm);
+
+    Time_Cache.hour_start = t - (tm->tm_min * 60) - tm->tm_sec;
+    Time_Cache.next_hour = Time_Cache.hour_start + 3600;
+
+    /* find the start of the next day */
+    struct tm tomorrow = *tm;
+    tomorrow.tm_mday += 1;
+    tomorrow.tm_hour = 0;
+    tomorrow.tm_min = 0;
+    tomorrow.tm_sec = 0;
+    tomorrow.tm_isdst = -1;
+    Time_Cache.midnight = mktime(&tomorrow);
+
+    char *p = Time_Cache.date;
+    p = put4(p, tm->tm_year + 1900);
+    p = put2(p, tm->tm_mon + 1);
+    p = put2(p, tm->tm_mday);
+    *p = '\0';
+
+    /* the date part of the time stamp only changes here */
+    p = Time_Cache.stamp;
+    p = put4(p, tm->tm_year + 1900);   *p++ = '-';
+    p = put2(p, tm->tm_mon + 1);       *p++ = '-';
+    p = put2(p, tm->tm_mday);          *p++ = ' ';
+    p = put2(p, tm->tm_hour);          *p++ = ':';
 }
 
-void CheckForLogDirectoryFull(void)
+struct TIME_CACHE *Current_Time(void)
 {
-    /* We have a log file directory, and in that directory */
-    /* We run thru the log file directory, summing the size
-       of all the files, and then check if it exceeds our
-       limit */
-    /* if we exceed our limit, we have to delete the oldest
-       file.  Since we think we will seldom exceed our limit,
-       we run thru first to see if that is the case, and
-       only if we are exceeding our limit do we look for
-       the oldest file, and delet it. */
+    time_t t = time(NULL);
 
-    DIR * dirp;
-    struct dirent *dp;
+    /* same second -- nothing to do */
+    if (t == Time_Cache.now) return(&Time_Cache);
 
-    int n = 0;
+    if ((t < Time_Cache.hour_start) || (t >= Time_Cache.next_hour))
+        Recompute_Time_Cache(t);
 
-    dirp = opendir(Log_Directory);
-    if (dirp == NULL)
-        {
-            fprintf(stderr, "%s is unreadable\n", Log_Directory);
-            return;
-        }
+    Time_Cache.now = t;
 
-    while ((dp = readdir(dirp)) != 0)
-        {
-            if (dp->d_ino == 0)
-                continue;
-            if (dp->d_name[0] == '.')
-                continue;
+    /* minutes and seconds are just the offset into the hour */
+    int s = t - Time_Cache.hour_start;
+    Time_Cache.tm.tm_min = s / 60;
+    Time_Cache.tm.tm_sec = s % 60;
 
-            char full_name[MAX_FILENAME_LENGTH];
-            snprintf(full_name, sizeof(full_name), "%s/%s", Log_Directory, dp->d_name);
-            n += size_of_file(full_name);
-        }
-    closedir(dirp);
+    char *p = &Time_Cache.stamp[14];
+    p = put2(p, Time_Cache.tm.tm_min);  *p++ = ':';
+    p = put2(p, Time_Cache.tm.tm_sec);
+    *p = '\0';
 
-    if (n > Log_File_Limit)
-        {
-            DeleteOldestFilesUntilUnderLimit(n);
-        }
+    return(&Time_Cache);
 }
 
-
-void Check_If_Need_New_Log_File(void)
+/* fill in a struct Timestamp from the current time */
+void Current_Timestamp(struct Timestamp *timedate)
 {
-    /* get the current date */
-    time_t t = time(NULL);
-    struct tm *tm = localtime(&t);
-    
-    static char sdate[16];
-    snprintf(sdate, sizeof(sdate), "%04d%02d%02d",
-            tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday);
-
-    /* check if it is still today */
-    if ((today != NULL) && STRING_EQUAL(today, sdate))
-        return;
-
-    /* it is no longer today, so need to start a new log file
-       for the new day */
-    UPDATE_STRING(today, sdate);
-
-    /* if we had a previous log file, close it */
-    if (log_file != NULL) fclose(log_file);
-
-    static char slogname[MAX_FILENAME_LENGTH];
-    snprintf(slogname, sizeof(slogname), "%s/%s.txt", Log_Directory, sdate);
-    
-    log_file = fopen(slogname, "a");
-    if (log_file != NULL) UPDATE_STRING(Log_FileName, slogname);
+    struct tm *tm = &(Current_Time()->tm);
+    timedate->msec = 0;
+    timedate->year = tm->tm_year + 1900;
+    timedate->mon = tm->tm_mon + 1;
+    timedate->day = tm->tm_mday;
+    timedate->hour = tm->tm_hour;
+    timedate->min = tm->tm_min;
+    timedate->sec = tm->tm_sec;
+}
 
-    /* start the log out with a timestamp and pid */
-    important("Process ID (pid) is %d\n", getpid());
-    Dump_Program_State();
+/* A struct Timestamp may come from the event file, so check that the
+   values fit before using the tables.  Each returns the number of
+   characters put in the buffer, which must have at least 11 bytes. */
 
-    /* check if the log directory exceeds the maximum limit we set */
-    CheckForLogDirectoryFull();
+Boolean timestamp_in_range(struct Timestamp *timedate)
+{
+    return((timedate->year <= 9999) && (timedate->mon <= 99) && (timedate->day <= 99)
+           && (timedate->hour <= 99) && (timedate->min <= 99) && (timedate->sec <= 99));
 }
 
-void Setup_for_Logging(void)
+int Format_Reading_Time(STRING s, struct Timestamp *timedate)
 {
-    /* important() will check by itself to make sure that we
-       have a log file, and create one if need be, or append 
-       onto the end of an existing one. */
-    /* so the main thing we should do is make sure that the
-       Log directory exists, and create it if not.  Also then
-       we can check to see that it is not too big. */
-    struct stat statbuf;
-    int rc = stat(Log_Directory, &statbuf);
-    if (errno != 0)
-        {
-            /* check if directory does not exist; try to create it */
-            if (errno == ENOENT)
-                {
-                    fprintf(stderr, "Log directory (%s) does not exist\n", Log_Directory);
-                    rc = mkdir(Log_Directory, 0744);
-                    if (rc != 0)
-                        {
-                            fprintf(stderr, "Could not make Log directory (%s)\n", Log_Directory);
-                            perror(Log_Directory);
-                            exit(-1);
-                        }
-                    /* if we made the directory, stat it, so we can continue */
-                    rc = stat(Log_Directory, &statbuf);
-                    if (rc != 0)
-                        {
-                            fprintf(stderr, "Could not stat newly made Log directory (%s)\n", Log_Directory);
-                            perror(Log_Directory);
-                            exit(-1);
-                        }
-                }
-        }
-
-    /* Ok, we have stat-ed the directory.  Make sure
-       it is a directory. */
-    if (!S_ISDIR(statbuf.st_mode))
-        {
-            fprintf(stderr, "Log directory (%s) is not a directory?\n", Log_Directory);
-            exit(-1);
-        }
+    /* HH:MM:SS */
+    if (!timestamp_in_range(timedate))
+        return(snprintf(s, 11, "%02lu:%02lu:%02lu",
+                        timedate->hour % 100, timedate->min % 100, timedate->sec % 100));
+    char *p = s;
+    p = put2(p, timedate->hour);  *p++ = ':';
+    p = put2(p, timedate->min);   *p++ = ':';
+    p = put2(p, timedate->sec);
+    *p = '\0';
+    return(p - s);
+}
 
-    /* check if the log directory exceeds the maximum limit we set */
-    Check_If_Need_New_Log_File();
+int Format_Reading_Date(STRING s, struct Timestamp *timedate, char separator)
+{
+    /* YYYY-MM-DD (or YYYY/MM/DD for the event file) */
+    if (!timestamp_in_range(timedate))
+        return(snprintf(s, 11, "%04lu%c%02lu%c%02lu",
+                        timedate->year % 10000, separator,
+                        timedate->mon % 100, separator, timedate->day % 100));
+    char *p = s;
+    p = put4(p, timedate->year);  *p++ = separator;
+    p = put2(p, timedate->mon);   *p++ = separator;
+    p = put2(p, timedate->day);
+    *p = '\0';
+    return(p - s);
 }
 
 
@@ -848,422 +1189,4356 @@ void Setup_for_Logging(void)
 /*                                                                   */
 /* ***************************************************************** */
 
-STRING TimeStamp(void)
+/* The log is written by a thread of its own.  important() is called
+   all thru the program, often in the middle of answering a request,
+   and writing (and flushing) the log file each time is the slowest
+   thing it does.  So important() just formats its line into the next
+   slot of a ring, and the log writer thread takes the slots out and
+   writes them, a batch at a time: when LOG_BATCH_SIZE bytes are
+   waiting, or every LOG_FLUSH_INTERVAL milliseconds.
+
+   The ring has only one thread putting slots in (the main thread)
+   and one taking them out (the log writer), so it needs no lock:
+   the main thread only moves head, and the writer only moves tail.
+   If the ring is full, the line is dropped and counted, and how many
+   were lost is noted in the log when there is room again.  Starting
+   a new log file at midnight goes thru the ring too, so the change
+   comes between the right two lines.
+
+   Before the writer is started, in the export child, and after
+   Flush_Log() -- which exit() calls, so the last lines before a fatal
+   error are not lost -- the log is written directly, as it always
+   was. */
+
+#include <pthread.h>      /* pthread_create, pthread_join */
+#include <sys/eventfd.h>  /* eventfd */
+#include <sys/uio.h>      /* writev, struct iovec */
+#include <poll.h>         /* poll */
+
+#define LOG_RING_SIZE       (1024 * 1024)   /* a power of 2 */
+#define LOG_BATCH_SIZE      (64 * 1024)
+#define LOG_FLUSH_INTERVAL  100             /* milliseconds */
+#define LOG_LINE_GUESS      256
+#define LOG_BATCH_LINES     64
+
+enum Log_Slot_Kind { LS_TEXT, LS_NEW_FILE, LS_SKIP };
+
+struct LOG_SLOT
 {
-    /* get the current date and time */
-    time_t t = time(NULL);
-    struct tm *tm = localtime(&t);
+    unsigned int kind;
+    unsigned int n;             /* bytes after this header */
+};
 
-    static char stime[32];
-    snprintf(stime, sizeof(stime), "%04d-%02d-%02d %02d:%02d:%02d",
-              tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday,
-              tm->tm_hour, tm->tm_min, tm->tm_sec);
-    return(stime);
-}
+/* slots start on 8-byte boundaries */
+#define LOG_SLOT_BYTES(n) (sizeof(struct LOG_SLOT) + (((n) + 7) & ~7))
 
-/* log all important events */
+struct LOG_RING
+{
+    char *base;
+    unsigned long head;         /* bytes ever put in; main thread */
+    unsigned long tail;         /* bytes ever taken out; log writer */
+    unsigned long slot;         /* where the slot being filled starts */
+
+    unsigned long lost;         /* lines dropped since the last note */
+    int kicked;                 /* the writer has been woken early */
+    int stop;
+    FileDesc wake;              /* eventfd the writer waits on */
+    pthread_t writer;
+};
 
-void important(const char *format, ...)
+struct LOG_RING Log_Ring = { NULL, 0, 0, 0, 0, FALSE, FALSE, -1 };
+
+Boolean Log_Async = FALSE;
+__thread Boolean In_Log_Writer = FALSE;
+
+void Open_New_Log_File(STRING name);
+void Count_Log_Bytes(long n);
+#ifdef USE_IO_URING
+void Setup_Log_Ring(void);
+void Ring_Write_Log(struct iovec *iov, int k);
+#endif
+
+
+FileDesc Open_Log_File(STRING name)
 {
-    va_list args;
+    return(open(name, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666));
+}
 
-    /* if we have debugging on, write all important events to the console */
-    if (debug || (log_file == NULL))
-        {
-            va_start(args, format);
-            vfprintf(stderr, format, args);
-            va_end(args);    
-        }
-    
-    /* log all important events to our device log file */
-    if (log_file != NULL)
+void Write_Log(struct iovec *iov, int k)
+{
+    FileDesc fd = (log_fd >= 0) ? log_fd : 2;
+    while (k > 0)
         {
-            Check_If_Need_New_Log_File();
-            fprintf(log_file, "%s: ", TimeStamp());
-            va_start(args, format);
-            vfprintf(log_file, format, args);
-            fflush(log_file);
-            va_end(args);    
+            ssize_t rc = writev(fd, iov, k);
+            if (rc < 0 && errno == EINTR) continue;
+            if (rc <= 0) return;
+            if (fd == log_fd) Count_Log_Bytes(rc);
+
+            /* a partial write; skip what went */
+            while ((k > 0) && (CAST(size_t, rc) >= iov->iov_len))
+                {
+                    rc -= iov->iov_len;
+                    iov++;
+                    k--;
+                }
+            if (k > 0)
+                {
+                    iov->iov_base = CAST(char *, iov->iov_base) + rc;
+                    iov->iov_len -= rc;
+                }
         }
-    
 }
 
+/* the log writer's batches go thru its ring, if it has one */
+void Write_Log_Batch(struct iovec *iov, int k)
+{
+#ifdef USE_IO_URING
+    Ring_Write_Log(iov, k);
+#else
+    Write_Log(iov, k);
+#endif
+}
 
-/* ***************************************************************** */
-/*                                                                   */
-/*                                                                   */
-/* ***************************************************************** */
+/* format a log line, time stamp first, into s (of size bytes), and
+   return its length, which may be more than fits */
+int Format_Log_Line(STRING s, int size, STRING stamp, const char *format, va_list args)
+{
+    int k = snprintf(s, size, "%s: ", stamp);
+    int n = vsnprintf(s + k, (k < size) ? size - k : 0, format, args);
+    return(k + n);
+}
 
-Boolean istagchar(int c)
+/* write a log line now, rather than thru the ring */
+void Log_Now(STRING stamp, const char *format, va_list args)
 {
-    /* tag characters can be alphabetic, numeric, period, hyphen,
-       underscore, or colon. */
-    if (isalnum(c)) return(TRUE);
-    if (c == '.') return(TRUE);
-    if (c == '-') return(TRUE);
-    if (c == '_') return(TRUE);
-    if (c == ':') return(TRUE);
-    return(FALSE);
+    char line[1024];
+    va_list again;
+    va_copy(again, args);
+    struct iovec iov;
+    iov.iov_base = line;
+    iov.iov_len = Format_Log_Line(line, sizeof(line), stamp, format, args);
+    if (iov.iov_len >= sizeof(line))
+        {
+            iov.iov_base = malloc(iov.iov_len + 1);
+            if (iov.iov_base != NULL)
+                Format_Log_Line(iov.iov_base, iov.iov_len + 1, stamp, format, again);
+            else
+                iov.iov_len = 0;
+        }
+    Write_Log(&iov, 1);
+    if (iov.iov_base != line) free(iov.iov_base);
+    va_end(again);
 }
 
-/* ***************************************************************** */
-/*                                                                   */
-/*                                                                   */
-/* ***************************************************************** */
 
-void Scan_Command_Line_Arguments(int argc, char **const argv)
+/* the main thread's side:  find room for a slot of n bytes at the
+   head of the ring, and return where its text goes.  A slot does
+   not wrap around the end of the ring; if there is not room for it
+   there, the rest of the ring is skipped.  If the ring is full, we
+   return NULL -- unless we must have the room, and then we wait. */
+
+char *Log_Slot(int n, Boolean wait)
 {
-    int rc;
-    
-	while (-1 != (rc = getopt(argc, argv, "dvqhD:L:c:l:")))
+    unsigned long need = LOG_SLOT_BYTES(n);
+    if (need > LOG_RING_SIZE / 4) return(NULL);
+
+    while (TRUE)
         {
-            switch(rc)
+            unsigned long head = Log_Ring.head;
+            unsigned long tail = __atomic_load_n(&Log_Ring.tail, __ATOMIC_ACQUIRE);
+            unsigned long at = head & (LOG_RING_SIZE - 1);
+            unsigned long skip = (at + need > LOG_RING_SIZE) ? LOG_RING_SIZE - at : 0;
+
+            if (head + skip + need - tail <= LOG_RING_SIZE)
                 {
+                    if (skip > 0)
+                        {
+                            struct LOG_SLOT *h = CAST(struct LOG_SLOT *, Log_Ring.base + at);
+                            h->kind = LS_SKIP;
+                            h->n = skip - sizeof(struct LOG_SLOT);
+                        }
+                    Log_Ring.slot = head + skip;
+                    return(Log_Ring.base + (Log_Ring.slot & (LOG_RING_SIZE - 1))
+                           + sizeof(struct LOG_SLOT));
+                }
 
-                case 'd': /* debug option */
-                    debug = !debug;
-                    break;
-                    
-                case 'v': /* verbose option */
-                    verbose = TRUE;
-                    break;
-                    
-                case 'q': /* verbose option */
-                    verbose = FALSE;
-                    break;
-                    
-                case 'D':
-                    Home_Directory = remember_string(optarg);
-                    break;
+            if (!wait) return(NULL);
+            eventfd_t one = 1;
+            if (write(Log_Ring.wake, &one, sizeof(one)) < 0) { /* it will wake anyway */ }
+            struct timespec ms = { 0, 1000000 };
+            nanosleep(&ms, NULL);
+        }
+}
 
-                case 'c':
-                    Config_FileName = remember_string(optarg);
-                    break;
+/* the slot from Log_Slot() is filled in with n bytes; hand it to
+   the writer, and wake it if it has a full batch to write */
+void Log_Commit(enum Log_Slot_Kind kind, int n)
+{
+    struct LOG_SLOT *h = CAST(struct LOG_SLOT *,
+                              Log_Ring.base + (Log_Ring.slot & (LOG_RING_SIZE - 1)));
+    h->kind = kind;
+    h->n = n;
+    unsigned long head = Log_Ring.slot + LOG_SLOT_BYTES(n);
+    __atomic_store_n(&Log_Ring.head, head, __ATOMIC_RELEASE);
+
+    unsigned long tail = __atomic_load_n(&Log_Ring.tail, __ATOMIC_RELAXED);
+    if ((head - tail >= LOG_BATCH_SIZE)
+        && !__atomic_exchange_n(&Log_Ring.kicked, TRUE, __ATOMIC_ACQ_REL))
+        {
+            eventfd_t one = 1;
+            if (write(Log_Ring.wake, &one, sizeof(one)) < 0) { /* it will wake anyway */ }
+        }
+}
 
-                case 'L':
-                    Log_Directory = remember_string(optarg);
-                    break;
+void Log_Lost(void)
+{
+    Log_Ring.lost += 1;
+    Log_Overflows += 1;
+}
 
-                case 'h':
-                default:
-                    printf("Overhead Detection and Reporting.\n\n");
+/* once there is room again, say how many lines we could not log.
+   It starts with a newline, in case we lost the end of a message. */
+Boolean Log_Note_Lost(STRING stamp)
+{
+    char *p = Log_Slot(LOG_LINE_GUESS, FALSE);
+    if (p == NULL) return(FALSE);
+    int n = snprintf(p, LOG_LINE_GUESS, "\n%s: %lu log lines lost\n", stamp, Log_Ring.lost);
+    Log_Commit(LS_TEXT, n);
+    Log_Ring.lost = 0;
+    return(TRUE);
+}
 
-                    printf("Usage: ./overhead [OPTIONS]\n\n");
+void Log_Format(STRING stamp, const char *format, va_list args)
+{
+    if ((Log_Ring.lost > 0) && !Log_Note_Lost(stamp))
+        {
+            Log_Lost();
+            return;
+        }
 
-                    printf("Options:\n");
+    /* most lines fit our guess; if not, we know how much to ask for */
+    va_list again;
+    va_copy(again, args);
+    int room = LOG_LINE_GUESS;
+    char *p = Log_Slot(room, FALSE);
+    int n = 0;
+    if (p != NULL) n = Format_Log_Line(p, room, stamp, format, args);
+    if ((p != NULL) && (n >= room))
+        {
+            room = n + 1;
+            p = Log_Slot(room, FALSE);
+            if (p != NULL) Format_Log_Line(p, room, stamp, format, again);
+        }
+    va_end(again);
 
-                    printf("\t%-8s Home Directory name. Default name = %s\n",
-                           "-D", Home_Directory);
+    if (p == NULL)
+        Log_Lost();
+    else
+        Log_Commit(LS_TEXT, n);
+}
 
-                    printf("\t%-8s Configuration file name. Default name = %s\n",
-                           "-c", Config_FileName);
+/* a piece of a message, after its header line.  Once part of it is
+   lost, the rest goes too, up to the note that says so. */
+void Log_Copy(STRING s, int n)
+{
+    char *p = (Log_Ring.lost > 0) ? NULL : Log_Slot(n, FALSE);
+    if (p == NULL)
+        {
+            Log_Lost();
+            return;
+        }
+    memcpy(p, s, n);
+    Log_Commit(LS_TEXT, n);
+}
 
-                    printf("\t%-8s Log Directory name. Default name = %s\n",
-                           "-L", Log_Directory);
 
-                    printf("\t%-8s Verbose mode (Default = %s)\n",
-                           "-v", verbose ? "TRUE" : "FALSE");
+/* the log writer's side:  write out all that is in the ring */
 
+void Drain_Log_Ring(void)
+{
+    unsigned long head = __atomic_load_n(&Log_Ring.head, __ATOMIC_ACQUIRE);
+    unsigned long tail = Log_Ring.tail;
 
-                    printf("\n");
+    struct iovec iov[LOG_BATCH_LINES];
+    int k = 0;
+    while (tail != head)
+        {
+            struct LOG_SLOT *h = CAST(struct LOG_SLOT *,
+                                      Log_Ring.base + (tail & (LOG_RING_SIZE - 1)));
+            char *text = CAST(char *, h + 1);
 
-                    exit(0);
+            switch (h->kind)
+                {
+                case LS_TEXT:
+                    iov[k].iov_base = text;
+                    iov[k].iov_len = h->n;
+                    k += 1;
+                    break;
+
+                case LS_NEW_FILE:
+                    Write_Log_Batch(iov, k);
+                    k = 0;
+                    Open_New_Log_File(text);
+                    break;
+                }
+            tail += LOG_SLOT_BYTES(h->n);
+
+            /* the slots can be used again once they are written */
+            if ((k == LOG_BATCH_LINES) || (tail == head))
+                {
+                    if (k > 0) __atomic_add_fetch(&Log_Writes, 1, __ATOMIC_RELAXED);
+                    Write_Log_Batch(iov, k);
+                    k = 0;
+                    __atomic_store_n(&Log_Ring.tail, tail, __ATOMIC_RELEASE);
                 }
         }
 }
 
+void *Log_Writer(void *unused)
+{
+    In_Log_Writer = TRUE;
+    struct pollfd p;
+    p.fd = Log_Ring.wake;
+    p.events = POLLIN;
 
-/*******************************************************************************
- *
- * Code to read the Configuration file.  Done once when the program is started,
- * We may need some way to kick the program to cause it to re-read the config
- * file.  But for now, just kill the original program, and restart it.
- *
- ******************************************************************************/
+    while (TRUE)
+        {
+            /* stop only after writing what was there when asked to */
+            Boolean stop = __atomic_load_n(&Log_Ring.stop, __ATOMIC_ACQUIRE);
+            Drain_Log_Ring();
+            if (stop) return(NULL);
 
-struct config_table
+            if (poll(&p, 1, LOG_FLUSH_INTERVAL) > 0)
+                {
+                    eventfd_t n;
+                    if (read(Log_Ring.wake, &n, sizeof(n)) < 0) { /* nothing to do */ }
+                }
+            __atomic_store_n(&Log_Ring.kicked, FALSE, __ATOMIC_RELEASE);
+        }
+}
+
+void Start_Log_Writer(void)
 {
-    STRING key;
-    int    string_index;
-};
+    Log_Ring.base = CAST(char *, malloc(LOG_RING_SIZE));
+    Log_Ring.wake = eventfd(0, EFD_CLOEXEC);
+    if ((Log_Ring.base == NULL) || (Log_Ring.wake < 0))
+        {
+            important("cannot start the log writer: %d; logging directly\n", errno);
+            return;
+        }
+#ifdef USE_IO_URING
+    Setup_Log_Ring();
+#endif
+
+    /* signals come to the main thread, thru its signalfd, so the
+       writer must not take any of them */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    int rc = pthread_create(&Log_Ring.writer, NULL, Log_Writer, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (rc != 0)
+        {
+            important("cannot start the log writer: %d; logging directly\n", rc);
+            return;
+        }
+    Log_Async = TRUE;
+}
 
+/* write everything still in the ring, stop the writer, and log
+   directly from now on.  For exit(), and so for fatal errors. */
+void Flush_Log(void)
+{
+    if (!Log_Async) return;
+    __atomic_store_n(&Log_Ring.stop, TRUE, __ATOMIC_RELEASE);
+    eventfd_t one = 1;
+    if (write(Log_Ring.wake, &one, sizeof(one)) < 0) { /* it will wake anyway */ }
+    pthread_join(Log_Ring.writer, NULL);
+    Log_Async = FALSE;
+}
 
+/* the export child has no log writer; what it logs goes straight
+   to the file.  What was in the ring is the parent's to write. */
+void Log_In_Child(void)
+{
+    Log_Async = FALSE;
+}
 
-struct config_table cft[] =
+/* ***************************************************************** */
+/*                                                                   */
+/*                                                                   */
+/* ***************************************************************** */
+
+/* The log directory is kept under Log_File_Limit bytes by deleting
+   the oldest log files.  Rather than read the directory and stat()
+   every file in it to find out how big it is (and again for each
+   file deleted), we read it once, when we start, and keep a list of
+   the log files, oldest first, with their sizes.  The log files are
+   named by date, so the oldest is the first by name.  Then each
+   write to the log adds to the size of the current file and the
+   total, and if that is over the limit, the oldest file is the
+   first on the list.
+
+   The list belongs to whoever writes the log:  the log writer thread
+   once it has started (and the export child has its own copy). */
+
+struct LOG_FILE
 {
-    { "providerName", 0},
-    { "resourceType", 1},
-    { "centerId", 2},
-    { "triggerHeight", 3},
-    { "EventChannel", 4},
-    { "FaultChannel", 5},    
-    { "EventFilename", 6},
-    { "opStatus", 7},
-    { "PortName", 8},
-    { "myRefId", 9},				   
-    { "icdVersion", 10},
-    { "pollingDelay", 11},
-    { "id", 12},
-    { "logFileLimit", 13},    
-    { NULL, -1}
+    struct LOG_FILE *next;          /* the next newer */
+    STRING name;                    /* in the log directory */
+    long size;
 };
 
+struct LOG_INDEX
+{
+    struct LOG_FILE *oldest;
+    struct LOG_FILE *newest;
+    struct LOG_FILE *current;       /* the one we are writing */
+    long total;                     /* bytes in all of them */
+    Boolean built;                  /* by Build_Log_Index() */
+    Boolean removing;
+};
 
+struct LOG_INDEX Log_Index = { NULL, NULL, NULL, 0, FALSE, FALSE };
 
-STRING line_buffer = NULL;
-int line_buffer_length = 0;
 
-STRING get_line(FILE *f)
+struct LOG_FILE *new_Log_File(STRING name, long size)
 {
-    /* read a line from the file */
-    int i = 0;
-    int c;
-    while ((c = getc(f)) != EOF)
+    struct LOG_FILE *f = TYPED_MALLOC(struct LOG_FILE);
+    f->next = NULL;
+    f->name = remember_string(name);
+    f->size = size;
+    return(f);
+}
+
+int compare_log_files(const void *a, const void *b)
+{
+    return(strcmp((*CAST(struct LOG_FILE **, a))->name,
+                  (*CAST(struct LOG_FILE **, b))->name));
+}
+
+void Build_Log_Index(void)
+{
+    DIR *dirp = opendir(Log_Directory);
+    if (dirp == NULL)
         {
-            if (i > line_buffer_length-1)
+            fprintf(stderr, "%s is unreadable\n", Log_Directory);
+            return;
+        }
+
+    /* collect them, then put them in order */
+    int n = 0;
+    int length = 64;
+    struct LOG_FILE **files = CAST(struct LOG_FILE **, malloc(length * sizeof(*files)));
+    struct dirent *dp;
+    while ((dp = readdir(dirp)) != 0)
+        {
+            if (dp->d_ino == 0)
+                continue;
+            if (dp->d_name[0] == '.')
+                continue;
+
+            char full_name[MAX_FILENAME_LENGTH];
+            snprintf(full_name, sizeof(full_name), "%s/%s", Log_Directory, dp->d_name);
+            struct stat statbuf;
+            if (stat(full_name, &statbuf) != 0)
                 {
-                    if (line_buffer_length == 0)
-                        {
-                            line_buffer_length = 128;
-                            line_buffer = CAST(STRING, malloc(line_buffer_length));
-                        }
-                    else
-                        {
-                            line_buffer_length = 2 * line_buffer_length;
-                            line_buffer = CAST(STRING, realloc(line_buffer,line_buffer_length));
-                        }
+                    perror(full_name);
+                    continue;
                 }
-            if (c == '\n') break;
-            line_buffer[i] = c;
-            i += 1;
+
+            if (n == length)
+                {
+                    length = 2 * length;
+                    files = CAST(struct LOG_FILE **, realloc(files, length * sizeof(*files)));
+                }
+            files[n++] = new_Log_File(dp->d_name, statbuf.st_size);
+            Log_Index.total += statbuf.st_size;
         }
-    
-    line_buffer[i] = '\0';
+    closedir(dirp);
 
-    if ((c == EOF) && (i == 0)) return(NULL);
-    
-    return(line_buffer);
+    qsort(files, n, sizeof(*files), compare_log_files);
+    int i;
+    for (i = 0; i < n; i++)
+        {
+            if (i + 1 < n) files[i]->next = files[i + 1];
+            else Log_Index.newest = files[i];
+        }
+    if (n > 0) Log_Index.oldest = files[0];
+    free(files);
+    Log_Index.built = TRUE;
 }
 
-void define_key_string(STRING device, int string_index, STRING value)
+/* we are starting to write to a log file, which may be new, or may
+   be there already (if we are restarted, or the clock is set back) */
+void Index_Log_File(STRING path)
 {
-    if (debug)  fprintf(stderr, "config value for %s -- %d(%s) = %s\n",
-                        device, string_index, cft[string_index].key, value);
+    STRING name = strrchr(path, '/');
+    name = (name != NULL) ? name + 1 : path;
 
-    DEVICE d = NULL;
-    if (device != NULL)
+    /* usually it is the newest; if not, find where it goes */
+    struct LOG_FILE *before = NULL;
+    struct LOG_FILE *f = Log_Index.oldest;
+    if ((Log_Index.newest != NULL) && (strcmp(Log_Index.newest->name, name) < 0))
         {
-            d = search_device_array(device);
-            if (d == NULL)
-                return;
+            before = Log_Index.newest;
+            f = NULL;
         }
-    else
+    while ((f != NULL) && (strcmp(f->name, name) < 0))
         {
-            d = &default_device;
+            before = f;
+            f = f->next;
         }
 
-    switch (string_index)
+    if ((f == NULL) || !STRING_EQUAL(f->name, name))
         {
-        case 0: UPDATE_STRING(d->providerName, value); return;
-        case 1: UPDATE_STRING(d->resourceType, value); return;
-        case 2: UPDATE_STRING(d->centerId, value); return;
-        case 3: UPDATE_STRING(d->triggerHeight, value); return;
-        case 4: d->event_channel = decode_channel_number(value); return;
-        case 5: d->fault_channel = decode_channel_number(value); return;
-        case 6: UPDATE_STRING(d->eventFileName, value); return;
-        case 7: d->status = decode_status(value); return;
-        case 8: UPDATE_STRING(PortName, value); return;
-        case 9: UPDATE_STRING(StringMyRefId, value); return;
-        case 10: UPDATE_STRING(icdVersion, value); return;
-        case 11: pollingDelay = decode_polling_delay(value); return;
-        case 12: UPDATE_STRING(d->id, value); return;
-        case 13: Log_File_Limit = decode_file_size(value); return;            
+            struct stat statbuf;
+            long size = (stat(path, &statbuf) == 0) ? statbuf.st_size : 0;
+            struct LOG_FILE *g = new_Log_File(name, size);
+            Log_Index.total += size;
+            g->next = f;
+            if (before != NULL) before->next = g;
+            else Log_Index.oldest = g;
+            if (f == NULL) Log_Index.newest = g;
+            f = g;
         }
+    Log_Index.current = f;
 }
 
-void define_config_value(STRING key, STRING value)
+/* delete the oldest log files (but not the one we are writing) until
+   we are under the limit; each one is just the first on the list */
+void Remove_Oldest_Log_Files(void)
 {
-    if (debug)  fprintf(stderr, "config value -- %s = %s\n", key, value);
-    
-    /* we want to define a key with a value. 
-       Check first to see if the key has a structure.
-       We allow a key to be a simple string, or
-       a "device-name.key".  So look to see if there
-       is a period/dot in the key. */
-    STRING device = NULL;
-    STRING p;
-    for (p = key; *p != '\0'; p++)
-        {
-            if (*p == '.')
-                {
-                    /* define the device part */
-                    device = key;
-                    /* split the key string into two parts */
-                    *p = '\0'; p++;
-                    /* and keep the second part as the new key */
-                    key = p;
-                    break;
-                }
-        }
-    
-    int i;
-    for (i = 0; (cft[i].key != NULL); i++)
+    /* the lines saying what we removed come back here */
+    if (Log_Index.removing) return;
+    Log_Index.removing = TRUE;
+
+    while (Log_Index.total > Log_File_Limit)
         {
-            /* if the keys are equal, define the value */
-            if (mystrcasecmp(cft[i].key, key))
+            struct LOG_FILE *before = NULL;
+            struct LOG_FILE *f = Log_Index.oldest;
+            if ((f != NULL) && (f == Log_Index.current))
                 {
-                    define_key_string(device, cft[i].string_index, value);
-                    break;
+                    before = f;
+                    f = f->next;
                 }
-        }
-}
+            if (f == NULL) break;
+
+            char full_name[MAX_FILENAME_LENGTH];
+            snprintf(full_name, sizeof(full_name), "%s/%s", Log_Directory, f->name);
+            int rc = unlink(full_name);
+
+            /* even if it could not be removed, we stop counting it,
+               or we would try again with every line */
+            if (before != NULL) before->next = f->next;
+            else Log_Index.oldest = f->next;
+            if (Log_Index.newest == f) Log_Index.newest = before;
+            Log_Index.total -= f->size;
+            important("remove %s -> %d\n", full_name, rc);
+            free(f->name);
+            free(f);
+        }
+
+    Log_Index.removing = FALSE;
+}
+
+/* n more bytes written to the current log file */
+void Count_Log_Bytes(long n)
+{
+    /* until we have read the directory, we have nothing to count */
+    if (!Log_Index.built) return;
+    if (Log_Index.current != NULL) Log_Index.current->size += n;
+    Log_Index.total += n;
+    if (Log_Index.total > Log_File_Limit) Remove_Oldest_Log_Files();
+}
+
+void Open_New_Log_File(STRING name)
+{
+    /* if we had a previous log file, close it */
+    if (log_fd >= 0) close(log_fd);
+    log_fd = Open_Log_File(name);
+    if (log_fd >= 0) Index_Log_File(name);
+}
+
+
+/* the midnight that ends the day of the current log file.  The
+   time cache only changes its midnight when the day changes (either
+   way, if the clock is reset), so this is our check for a new day. */
+time_t today_ends = 0;
+
+void Check_If_Need_New_Log_File(void)
+{
+    /* get the current date */
+    struct TIME_CACHE *tc = Current_Time();
+
+    /* check if it is still today */
+    if ((today != NULL) && (tc->midnight == today_ends))
+        return;
+
+    /* it is no longer today, so need to start a new log file
+       for the new day */
+    STRING sdate = tc->date;
+    UPDATE_STRING(today, sdate);
+    today_ends = tc->midnight;
+
+    static char slogname[MAX_FILENAME_LENGTH];
+    snprintf(slogname, sizeof(slogname), "%s/%s.txt", Log_Directory, sdate);
+
+    if (Log_Async)
+        {
+            /* the log writer changes files when it gets to this slot,
+               after yesterday's last line */
+            int n = strlen(slogname) + 1;
+            memcpy(Log_Slot(n, TRUE), slogname, n);
+            Log_Commit(LS_NEW_FILE, n);
+            UPDATE_STRING(Log_FileName, slogname);
+        }
+    else
+        {
+            Open_New_Log_File(slogname);
+            if (log_fd >= 0) UPDATE_STRING(Log_FileName, slogname);
+        }
+
+    /* start the log out with a timestamp and pid */
+    important("Process ID (pid) is %d\n", getpid());
+    Dump_Program_State();
+}
+
+void Setup_for_Logging(void)
+{
+    /* important() will check by itself to make sure that we
+       have a log file, and create one if need be, or append 
+       onto the end of an existing one. */
+    /* so the main thing we should do is make sure that the
+       Log directory exists, and create it if not.  Also then
+       we can check to see that it is not too big. */
+    struct stat statbuf;
+    int rc = stat(Log_Directory, &statbuf);
+    if (errno != 0)
+        {
+            /* check if directory does not exist; try to create it */
+            if (errno == ENOENT)
+                {
+                    fprintf(stderr, "Log directory (%s) does not exist\n", Log_Directory);
+                    rc = mkdir(Log_Directory, 0744);
+                    if (rc != 0)
+                        {
+                            fprintf(stderr, "Could not make Log directory (%s)\n", Log_Directory);
+                            perror(Log_Directory);
+                            exit(-1);
+                        }
+                    /* if we made the directory, stat it, so we can continue */
+                    rc = stat(Log_Directory, &statbuf);
+                    if (rc != 0)
+                        {
+                            fprintf(stderr, "Could not stat newly made Log directory (%s)\n", Log_Directory);
+                            perror(Log_Directory);
+                            exit(-1);
+                        }
+                }
+        }
+
+    /* Ok, we have stat-ed the directory.  Make sure
+       it is a directory. */
+    if (!S_ISDIR(statbuf.st_mode))
+        {
+            fprintf(stderr, "Log directory (%s) is not a directory?\n", Log_Directory);
+            exit(-1);
+        }
+
+    /* find what is in the log directory, and start today's log
+       file; if the directory is over the limit, the first lines
+       we write will bring it under */
+    Build_Log_Index();
+    Check_If_Need_New_Log_File();
+
+    /* from now on, the log writer thread writes the log */
+    Start_Log_Writer();
+    atexit(Flush_Log);
+}
+
+
+/* ***************************************************************** */
+/*                                                                   */
+/*                                                                   */
+/* ***************************************************************** */
+
+STRING TimeStamp(void)
+{
+    /* get the current date and time */
+    return(Current_Time()->stamp);
+}
+
+/* log a part of a message as is, without a time stamp.  Used when
+   we send a long message in pieces, after logging its header. */
+
+void Log_Raw(STRING s, int n)
+{
+    if (debug || (!Log_Async && (log_fd < 0)))
+        fwrite(s, 1, n, stderr);
+    if (Log_Async)
+        Log_Copy(s, n);
+    else if (log_fd >= 0)
+        {
+            struct iovec iov = { s, n };
+            Write_Log(&iov, 1);
+        }
+}
+
+/* log all important events */
+
+void important(const char *format, ...)
+{
+    va_list args;
+
+    /* if we have debugging on, write all important events to the console */
+    if (debug || (!Log_Async && (log_fd < 0)))
+        {
+            va_start(args, format);
+            vfprintf(stderr, format, args);
+            va_end(args);    
+        }
+
+    /* the log writer logs what it does itself, with its own time
+       stamp, since the time cache belongs to the main thread */
+    if (In_Log_Writer)
+        {
+            char stamp[32];
+            time_t t = time(NULL);
+            struct tm tm;
+            strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime_r(&t, &tm));
+            va_start(args, format);
+            Log_Now(stamp, format, args);
+            va_end(args);
+            return;
+        }
+    
+    /* log all important events to our device log file */
+    if (Log_Async || (log_fd >= 0))
+        {
+            Check_If_Need_New_Log_File();
+            va_start(args, format);
+            if (Log_Async)
+                Log_Format(TimeStamp(), format, args);
+            else
+                Log_Now(TimeStamp(), format, args);
+            va_end(args);    
+        }
+    
+}
+
+
+/* ***************************************************************** */
+/*                                                                   */
+/*                                                                   */
+/* ***************************************************************** */
+
+/* The XML code looks at every character of every message, so these
+   are done inline, for ASCII, rather than thru the locale tables. */
+
+static inline Boolean istagchar(int c)
+{
+    /* tag characters can be alphabetic, numeric, period, hyphen,
+       underscore, or colon. */
+    if ((c >= 'a') && (c <= 'z')) return(TRUE);
+    if ((c >= 'A') && (c <= 'Z')) return(TRUE);
+    if ((c >= '0') && (c <= ':')) return(TRUE);
+    if (c == '.') return(TRUE);
+    if (c == '-') return(TRUE);
+    if (c == '_') return(TRUE);
+    return(FALSE);
+}
+
+static inline Boolean isxmlspace(int c)
+{
+    return((c == ' ') || (c == '\t') || (c == '\n') || (c == '\r'));
+}
+
+/* ***************************************************************** */
+/*                                                                   */
+/*                                                                   */
+/* ***************************************************************** */
+
+void Scan_Command_Line_Arguments(int argc, char **const argv)
+{
+    int rc;
+    
+	while (-1 != (rc = getopt(argc, argv, "dvqhD:L:c:l:")))
+        {
+            switch(rc)
+                {
+
+                case 'd': /* debug option */
+                    debug = !debug;
+                    break;
+                    
+                case 'v': /* verbose option */
+                    verbose = TRUE;
+                    break;
+                    
+                case 'q': /* verbose option */
+                    verbose = FALSE;
+                    break;
+                    
+                case 'D':
+                    Home_Directory = remember_string(optarg);
+                    break;
+
+                case 'c':
+                    Config_FileName = remember_string(optarg);
+                    break;
+
+                case 'L':
+                    Log_Directory = remember_string(optarg);
+                    break;
+
+                case 'h':
+                default:
+                    printf("Overhead Detection and Reporting.\n\n");
+
+                    printf("Usage: ./overhead [OPTIONS]\n\n");
+
+                    printf("Options:\n");
+
+                    printf("\t%-8s Home Directory name. Default name = %s\n",
+                           "-D", Home_Directory);
+
+                    printf("\t%-8s Configuration file name. Default name = %s\n",
+                           "-c", Config_FileName);
+
+                    printf("\t%-8s Log Directory name. Default name = %s\n",
+                           "-L", Log_Directory);
+
+                    printf("\t%-8s Verbose mode (Default = %s)\n",
+                           "-v", verbose ? "TRUE" : "FALSE");
+
+
+                    printf("\n");
+
+                    exit(0);
+                }
+        }
+}
+
+
+/*******************************************************************************
+ *
+ * Code to read the Configuration file.  Done once when the program is started,
+ * We may need some way to kick the program to cause it to re-read the config
+ * file.  But for now, just kill the original program, and restart it.
+ *
+ ******************************************************************************/
+
+struct config_table
+{
+    STRING key;
+    int    string_index;
+};
+
+
+
+struct config_table cft[] =
+{
+    { "providerName", 0},
+    { "resourceType", 1},
+    { "centerId", 2},
+    { "triggerHeight", 3},
+    { "EventChannel", 4},
+    { "FaultChannel", 5},    
+    { "EventFilename", 6},
+    { "opStatus", 7},
+    { "PortName", 8},
+    { "myRefId", 9},				   
+    { "icdVersion", 10},
+    { "pollingDelay", 11},
+    { "id", 12},
+    { "logFileLimit", 13},    
+    { "ExportPortName", 14},
+    { "maxClients", 15},
+    { "tcpNoDelay", 16},
+    { "tcpCork", 17},
+    { "sendBufferSize", 18},
+    { "CVMAddress", 19},
+    { "heartbeatInterval", 20},
+    { "queuePolicy", 21},
+    { "maxQueuedMessages", 22},
+    { "maxQueuedBytes", 23},
+    { "networkMemoryLimit", 24},
+    { "useTLS", 25},
+    { "tlsCertificate", 26},
+    { "tlsPrivateKey", 27},
+    { "tlsCAFile", 28},
+    { "ControlSocketName", 29},
+    { "captureFileName", 30},
+    { NULL, -1}
+};
+
+
+
+STRING line_buffer = NULL;
+int line_buffer_length = 0;
+
+STRING get_line(FILE *f)
+{
+    /* read a line from the file */
+    int i = 0;
+    int c;
+    while ((c = getc(f)) != EOF)
+        {
+            if (i > line_buffer_length-1)
+                {
+                    if (line_buffer_length == 0)
+                        {
+                            line_buffer_length = 128;
+                            line_buffer = CAST(STRING, malloc(line_buffer_length));
+                        }
+                    else
+                        {
+                            line_buffer_length = 2 * line_buffer_length;
+                            line_buffer = CAST(STRING, realloc(line_buffer,line_buffer_length));
+                        }
+                }
+            if (c == '\n') break;
+            line_buffer[i] = c;
+            i += 1;
+        }
+    
+    line_buffer[i] = '\0';
+
+    if ((c == EOF) && (i == 0)) return(NULL);
+    
+    return(line_buffer);
+}
+
+void define_key_string(STRING device, int string_index, STRING value)
+{
+    if (debug)  fprintf(stderr, "config value for %s -- %d(%s) = %s\n",
+                        device, string_index, cft[string_index].key, value);
+
+    DEVICE d = NULL;
+    if (device != NULL)
+        {
+            d = search_device_array(device);
+            if (d == NULL)
+                return;
+        }
+    else
+        {
+            d = &default_device;
+        }
+
+    switch (string_index)
+        {
+        case 0: UPDATE_STRING(d->providerName, value); return;
+        case 1: UPDATE_STRING(d->resourceType, value); return;
+        case 2: UPDATE_STRING(d->centerId, value); return;
+        case 3: UPDATE_STRING(d->triggerHeight, value); return;
+        case 4: d->event_channel = decode_channel_number(value); return;
+        case 5: d->fault_channel = decode_channel_number(value); return;
+        case 6: UPDATE_STRING(d->eventFileName, value); return;
+        case 7: d->status = decode_status(value); return;
+        case 8: UPDATE_STRING(PortName, value); return;
+        case 9: UPDATE_STRING(StringMyRefId, value); return;
+        case 10: UPDATE_STRING(icdVersion, value); return;
+        case 11: pollingDelay = decode_polling_delay(value); return;
+        case 12: UPDATE_STRING(d->id, value); return;
+        case 13: Log_File_Limit = decode_file_size(value); return;            
+        case 14: UPDATE_STRING(ExportPortName, value); return;
+        case 15: maxClients = decode_max_clients(value); return;
+        case 16: tcpNoDelay = decode_boolean(value); return;
+        case 17: tcpCork = decode_boolean(value); return;
+        case 18: sendBufferSize = decode_file_size(value); return;
+        case 19: UPDATE_STRING(CVMAddress, value); return;
+        case 20: heartbeatInterval = decode_heartbeat_interval(value); return;
+        case 21: queuePolicy = decode_queue_policy(value); return;
+        case 22: maxQueuedMessages = decode_queued_messages(value); return;
+        case 23: maxQueuedBytes = decode_file_size(value); return;
+        case 24: networkMemoryLimit = decode_file_size(value); return;
+        case 25: useTLS = decode_boolean(value); return;
+        case 26: UPDATE_STRING(tlsCertificate, value); return;
+        case 27: UPDATE_STRING(tlsPrivateKey, value); return;
+        case 28: UPDATE_STRING(tlsCAFile, value); return;
+        case 29: UPDATE_STRING(ControlSocketName, value); return;
+        case 30: UPDATE_STRING(captureFileName, value); return;
+        }
+}
+
+void define_config_value(STRING key, STRING value)
+{
+    if (debug)  fprintf(stderr, "config value -- %s = %s\n", key, value);
+    
+    /* we want to define a key with a value. 
+       Check first to see if the key has a structure.
+       We allow a key to be a simple string, or
+       a "device-name.key".  So look to see if there
+       is a period/dot in the key. */
+    STRING device = NULL;
+    STRING p;
+    for (p = key; *p != '\0'; p++)
+        {
+            if (*p == '.')
+                {
+                    /* define the device part */
+                    device = key;
+                    /* split the key string into two parts */
+                    *p = '\0'; p++;
+                    /* and keep the second part as the new key */
+                    key = p;
+                    break;
+                }
+        }
+    
+    int i;
+    for (i = 0; (cft[i].key != NULL); i++)
+        {
+            /* if the keys are equal, define the value */
+            if (mystrcasecmp(cft[i].key, key))
+                {
+                    define_key_string(device, cft[i].string_index, value);
+                    break;
+                }
+        }
+}
+
+    
+Boolean Read_Config_File(void)
+{
+    /* The config file needs to do three things:
+
+       1. set values that control our overall processing
+          that can be configured -- the port we use for
+          TCP network activity, the base refId that we use
+          for our messages, the name of the log file 
+          and so on.
+
+       2. It needs to build a detector device descriptor
+          for each detector attached to the MOXA, and use
+          those to define the DDD array.
+
+       3. It needs to use the DDD array to build the 
+          Channel_Table, so we can go from a channel back
+          to the detector device that drives that channel
+          (either as an event or a fault channel).
+    */
+    
+    int i = 0;
+    
+    FILE *cfile = fopen(Config_FileName, "r");
+    if (cfile == NULL)
+        {
+            important("No config file: %s\n", Config_FileName);
+            return(FALSE);
+        }
+
+    line_buffer = NULL;
+    line_buffer_length = 0;
+
+    for (i = 0; i < 4; i++)
+        {
+            if (DDD[i] != NULL) free_DDD(DDD[i]);
+            DDD[i] = NULL;
+        }
+    
+    /* config file should consist of a sequence of lines.
+       Each line has a keyword, then an value.  Mostly the
+       values are strings.  We trim leading and trailing spaces.
+       A line that starts with "#" is a comment.
+    */
+
+    STRING line;
+    while ((line = get_line(cfile)) != NULL)
+        {
+            i = 0;
+            /* skip leading blanks */
+            while ((line[i] != '\0') && isspace(line[i])) i += 1;
+
+            /* skip blank lines, and comments */
+            if (!isalpha(line[i])) continue;
+
+            /* find first letter of key */
+            STRING key = &(line[i]);
+
+            /* skip over the key; key is alphabetic or period */
+            while (isalpha(line[i]) || (line[i] == '.')) i += 1;
+            /* this character terminates the key */
+            line[i] = '\0';
+            i += 1;
+
+            /* find the value */
+            while ((line[i] != '\0') && !isalnum(line[i])) i += 1;
+
+            /* found first character of the value */
+            STRING value = &(line[i]);
+
+            /* trim off any trailing spaces */
+            int n = strlen(value);
+            while ((n > 0) && isspace(value[n-1]))
+                {
+                    value[n-1] = '\0';
+                    n -= 1;
+                }
+
+            /* now we have the key and value strings,
+               use them to define the config values */
+            define_config_value(key, value);
+        }
+    
+    /* close the config file */
+    fclose(cfile);
+    /* and free any line buffer space */
+    line_buffer_length = 0;
+    if (line_buffer != NULL)
+        {
+            free(line_buffer);
+            line_buffer = NULL;
+        }
+
+    /* make sure we have at least one device defined */
+    /* I think we can just check DDD[0], since they
+       are allocated from 0 up. */
+    if ((DDD[0] == NULL) && (DDD[1] == NULL)
+        && (DDD[2] == NULL) && (DDD[3] == NULL))
+        {
+            /* side-effect of the search is to create a DDD entry */
+            (void) search_device_array("default device");
+        }
+    
+    /* now initialize the Channel_Table. */
+    for (i = 0; i < MAX_CHANNELS; i++)
+        Channel_Table[i] = NULL;
+
+    /* Walk thru the DDD array and make sure that
+       all fields are defined.  If they were not 
+       defined originally, then try to define them from
+       the default device descriptor.  Then use the
+       channels in the DDD array to define the 
+       non-NULL entries in the Channel_Table. */
+    for (i = 0; i < MAX_DETECTORS; i++)
+        {
+            DEVICE d = DDD[i];
+            if (d == NULL) continue;
+            if (d->providerName == NULL)
+                d->providerName = remember_string(default_device.providerName);
+            if (d->resourceType == NULL)
+                d->resourceType = remember_string(default_device.resourceType);
+            if (d->centerId == NULL)
+                d->centerId = remember_string(default_device.centerId);
+            if (d->id == NULL)
+                d->id = remember_string(default_device.id);
+            if (d->triggerHeight == NULL)
+                d->triggerHeight = remember_string(default_device.triggerHeight);
+            if (d->event_channel == -1)
+                d->event_channel = default_device.event_channel;
+            if (d->fault_channel == -1)
+                d->fault_channel = default_device.fault_channel;    
+            if (d->eventFileName == NULL)
+                d->eventFileName = remember_string(default_device.eventFileName);
+            if (d->status == ST_ERROR)
+                d->status = default_device.status;
+
+            if (Channel_Table[d->event_channel] != NULL)
+                important("both %s and %s use channel %d\n",
+                          Channel_Table[d->event_channel]->name, d->name, d->event_channel);
+            if (Channel_Table[d->fault_channel] != NULL)
+                important("both %s and %s use channel %d\n",
+                          Channel_Table[d->fault_channel]->name, d->name, d->fault_channel);
+            Channel_Table[d->event_channel] = d;
+            Channel_Table[d->fault_channel] = d;            
+        }
+    return(TRUE);
+}
+
+
+/* ***************************************************************** */
+/*                                                                   */
+/*                                                                   */
+/* ***************************************************************** */
+
+/* used for both reading and writing.  Should be the same for both */
+#define EVENT_FILE_FORMAT "%04lu/%02lu/%02lu %02lu:%02lu:%02lu\n"
+
+/* The event file keeps every event that has happened since CVM last
+   asked for them, one line per event, oldest first.  When CVM gets
+   them, we cut the file back to just the last event, so that we
+   always know the last event (for the overheightUpdateMsg) and can
+   report it again if CVM asks before anything new happens.
+
+   Older versions of this program wrote just one line, followed by
+   a NUL byte, so we skip any NUL bytes when reading. */
+
+/* a line is 20 characters and a newline; this is enough to find the
+   last line from the end of the file */
+#define EVENT_TAIL_SIZE 64
+
+
+/* This line is actually only 21 bytes long, so 32 is plenty of space. */
+#define EVENT_LINE_SIZE  32
+
+#ifdef USE_IO_URING
+Boolean Ring_Write_And_Sync(FileDesc fd, STRING data, int n);
+#endif
+
+void WriteEventToFile(DEVICE d, struct Timestamp *timedate)
+{
+    char szLine[EVENT_LINE_SIZE];
+
+    /* It must match EVENT_FILE_FORMAT, since that is how we read it back. */
+    int n = Format_Reading_Date(szLine, timedate, '/');
+    szLine[n++] = ' ';
+    n += Format_Reading_Time(&szLine[n], timedate);
+    szLine[n++] = '\n';
+    szLine[n] = '\0';
+    if (debug)
+        fprintf(stderr, szLine);
+
+    /* szLine has newline (/n) at the end, so we don't need another */
+    important("Event for %s at: %s", d->name, szLine);
+    
+#ifndef USE_IO_URING
+    /* open the output event file to add this event to the end */
+    FileDesc fd = open(d->eventFileName, O_WRONLY|O_CREAT|O_APPEND|O_DSYNC, 00664);
+    if (fd < 0)
+        {
+            important("Error open event file: %s\n", d->eventFileName);
+            return;
+        }
+
+    /* write the event file output line */
+    n = write(fd, szLine, n);
+    if (n <= 0)
+        {
+            important("Error write event file: %s\n", d->eventFileName);
+        }
+#else
+    /* the write is synced, with the write, on the ring */
+    FileDesc fd = open(d->eventFileName, O_WRONLY|O_CREAT|O_APPEND, 00664);
+    if (fd < 0)
+        {
+            important("Error open event file: %s\n", d->eventFileName);
+            return;
+        }
+    if (!Ring_Write_And_Sync(fd, szLine, n))
+        {
+            important("Error write event file: %s\n", d->eventFileName);
+        }
+#endif
+    
+    /* flush and close the file */
+    /*  syncfs(fd); */
+    
+    close(fd);
+}
+
+
+/* find the last complete line in the tail of an event file.  Returns
+   the index of the start of the line in buf, or -1 if none. */
+int find_last_event_line(STRING buf, int n)
+{
+    /* skip trailing newlines and NULs */
+    while ((n > 0) && ((buf[n-1] == '\n') || (buf[n-1] == '\0'))) n -= 1;
+    if (n == 0) return(-1);
+
+    int i = n;
+    while ((i > 0) && (buf[i-1] != '\n') && (buf[i-1] != '\0')) i -= 1;
+    return(i);
+}
+
+Boolean decode_event_line(DEVICE d, STRING line, struct Timestamp *timedate)
+{
+    /* get the time and date in the right formats */
+    int n = sscanf(line, EVENT_FILE_FORMAT,
+                   &timedate->year, &timedate->mon, &timedate->day,
+                   &timedate->hour, &timedate->min, &timedate->sec);
+    if (n != 6)
+        {
+            important("data in %s of wrong format (%s)\n",
+                      d->eventFileName, line);
+            return(FALSE);
+        }
+    return(TRUE);
+}
+
+Boolean ReadEventFromFile(DEVICE d, struct Timestamp *timedate)
+{
+    /* read the last event in the file */
+    Boolean dataexists = TRUE;
+    
+    /* open the output log file for read */
+    FileDesc fd = open(d->eventFileName, O_RDONLY);
+    if (fd < 0)
+        {
+            important("Error open file: %s\n", d->eventFileName);
+            dataexists = FALSE;
+        }
+    else
+        {
+            /* read the tail of the file, which has the last line */
+            char szLine[EVENT_TAIL_SIZE+1];
+            off_t size = lseek(fd, 0, SEEK_END);
+            off_t start = (size > EVENT_TAIL_SIZE) ? size - EVENT_TAIL_SIZE : 0;
+            int n = pread(fd, szLine, sizeof(szLine)-1, start);
+            close(fd);
+
+            int i = -1;
+            if (n > 0)
+                {
+                    szLine[n] = '\0';
+                    i = find_last_event_line(szLine, n);
+                }
+            if (i < 0)
+                {
+                    important("Error read file: %s\n", d->eventFileName);
+                    dataexists = FALSE;
+                }
+            else
+                {
+                    dataexists = decode_event_line(d, &szLine[i], timedate);
+                }
+        }
+    return(dataexists);
+}
+
+
+/* A client has been sent all the events in the file up to acked, an
+   offset counted from the start of the event file before anything
+   was cut from it (see event_base).  Its next response starts after
+   them, or if there are none, with the last event, so that one goes
+   again.  Returns where that is, counted the same way. */
+off_t Event_Keep_Position(DEVICE d, off_t acked)
+{
+    off_t limit = acked - d->event_base;
+    if (limit <= 0) return(acked);
+
+    FileDesc fd = open(d->eventFileName, O_RDONLY);
+    if (fd < 0) return(d->event_base);
+
+    char buf[EVENT_TAIL_SIZE+1];
+    off_t size = lseek(fd, 0, SEEK_END);
+    off_t keep = limit;
+
+    if (size <= limit)
+        {
+            /* nothing new; keep the last event we sent */
+            off_t start = (limit > EVENT_TAIL_SIZE) ? limit - EVENT_TAIL_SIZE : 0;
+            int n = pread(fd, buf, limit - start, start);
+            int i = (n > 0) ? find_last_event_line(buf, n) : -1;
+            keep = (i < 0) ? limit : start + i;
+        }
+    close(fd);
+    return(d->event_base + keep);
+}
+
+
+/* No client needs the events before keep (counted as for
+   event_base) any more, so cut the file back to start there.  More
+   than one response may be on its way at once, and one that
+   finishes later may find the file already cut. */
+void Cut_Event_File(DEVICE d, off_t keep)
+{
+    off_t start = keep - d->event_base;
+    if (start <= 0) return;
+
+    FileDesc fd = open(d->eventFileName, O_RDONLY);
+    if (fd < 0) return;
+
+    /* copy what we keep to a new file, and then replace the old one */
+    char tmpname[MAX_FILENAME_LENGTH];
+    snprintf(tmpname, sizeof(tmpname), "%s.tmp", d->eventFileName);
+    FileDesc out = open(tmpname, O_WRONLY|O_CREAT|O_TRUNC|O_DSYNC, 00664);
+    if (out < 0)
+        {
+            important("Error open event file: %s\n", tmpname);
+            close(fd);
+            return;
+        }
+
+    Boolean ok = TRUE;
+    off_t offset = start;
+    char copy[512];
+    int n;
+    while ((n = pread(fd, copy, sizeof(copy), offset)) > 0)
+        {
+            /* skip the NUL bytes of older versions */
+            int i, m = 0;
+            for (i = 0; i < n; i++)
+                if (copy[i] != '\0') copy[m++] = copy[i];
+            if (write(out, copy, m) != m) ok = FALSE;
+            offset += n;
+        }
+    close(fd);
+    close(out);
+
+    if (!ok || (rename(tmpname, d->eventFileName) != 0))
+        {
+            important("Error write event file: %s\n", tmpname);
+            unlink(tmpname);
+            return;
+        }
+    d->event_base += start;
+}
+
+
+/* ***************************************************************** */
+/*                                                                   */
+/*                                                                   */
+/* ***************************************************************** */
+
+/* to send messages, we need to build them up, one string at a time 
+   until we have the entire message.  That way, we know how long they
+   are, which we need when we send them.  To make this easy, we define
+   a buffer structure and a function to add a string to the end of the
+   buffer.  When you are done, we will give you a pointer to the
+   buffer contents. */
+/* the buffer grows as needed for the messages, but we keep the old
+   buffer around, so that once we allocate the memory, we just keep
+   re-using it. */
+/* A response to CVM can have any number of events in it, so we do
+   not want to hold all of it in memory.  For that, a buffer can also
+   just count the bytes that would be added to it (to find the length
+   of a message), or count them and copy them to the log thru a
+   fixed-size window that is written out each time it fills up. */
+
+enum Buffer_Mode { BM_GROW, BM_SIZE, BM_LOG };
+
+struct BUFFER
+{
+    int  n;
+    int  length;
+    STRING b;
+
+    enum Buffer_Mode mode;
+    int total;          /* bytes added */
+};
+
+struct BUFFER b = { 0, 0, NULL, BM_GROW, 0 };
+
+struct BUFFER *ClearBuffer(void)
+{
+    /* clear the buffer for new use */
+    if (b.length <= 0)
+        {
+            b.length = 1024;
+            b.b = CAST(STRING, malloc(b.length));
+        }
+    b.n = 0;
+    b.total = 0;
+    b.b[b.n] = '\0';
+    return(&b);
+}
+
+void FlushBuffer(struct BUFFER *b)
+{
+    /* log what we have in a logging buffer */
+    if (b->n == 0) return;
+    Log_Raw(b->b, b->n);
+    b->n = 0;
+}
+
+void AppendBuffer(struct BUFFER *b, STRING s)
+{
+    if ((s == NULL) || (*s == '\0')) return;
+    
+    int n = strlen(s);
+
+    /* sizing just counts */
+    b->total += n;
+    if (b->mode == BM_SIZE) return;
+
+    /* logging copies into the window, writing it when full */
+    if (b->mode == BM_LOG)
+        {
+            while (n > 0)
+                {
+                    int m = b->length - b->n;
+                    if (m > n) m = n;
+                    memcpy(&b->b[b->n], s, m);
+                    b->n += m;
+                    s += m;
+                    n -= m;
+                    if (b->n == b->length) FlushBuffer(b);
+                }
+            return;
+        }
+
+    /* check that we have room for the string */
+    while ((b->n + n + 1) > b->length)
+        {
+            b->length = 2*b->length;
+            b->b = CAST(STRING, realloc(b->b, b->length));
+        }
+    /* copy the string to the end */
+    int i;
+    for (i = 0; i < n; i++)
+        {
+            b->b[b->n] = s[i];
+            b->n += 1;
+        }
+    /* terminate the new string */
+    b->b[b->n] = '\0';
+}
+
+void QAppendBuffer(struct BUFFER *b, STRING s)
+{
+    AppendBuffer(b,"\"");
+    AppendBuffer(b,s);    
+    AppendBuffer(b,"\"");    
+}
+
+
+STRING FinishBuffer(struct BUFFER *b)
+{
+    if (b->b == NULL) return(NULL);
+    STRING s = remember_string(b->b);
+    return(s);
+}
+
+
+/* ***************************************************************** */
+/*                                                                   */
+/*                                                                   */
+/* ***************************************************************** */
+
+/* we want to create, in memory, in a buffer, the complete message
+   (so we know how long it is). */
+
+/* There are two XML messages we create: the response and the update messages. 
+   Most of those are the same, so we use a couple of routines to do the
+   formatting. */
+
+void AppendHeader(struct BUFFER *buffer, STRING MyRefId, STRING icdVersion)
+{
+    AppendBuffer(buffer, "<refId>");
+    AppendBuffer(buffer, MyRefId);
+    AppendBuffer(buffer, "</refId>");
+    AppendBuffer(buffer, "<icdVersion>");
+    AppendBuffer(buffer, icdVersion);
+    AppendBuffer(buffer, "</icdVersion>");
+}
+
+void AppendId(struct BUFFER *buffer, DEVICE d)
+{
+    AppendBuffer(buffer, "<id");
+    AppendBuffer(buffer, " providerName=");
+    QAppendBuffer(buffer, d->providerName);
+    AppendBuffer(buffer, " resourceType=");
+    QAppendBuffer(buffer, d->resourceType);
+    AppendBuffer(buffer, " centerId=");
+    QAppendBuffer(buffer, d->centerId);
+    AppendBuffer(buffer, ">");
+    AppendBuffer(buffer, d->id);    
+    AppendBuffer(buffer, "</id>");
+}
+
+void AppendReadingData(struct BUFFER *buffer, DEVICE d, struct Timestamp *timedate)
+{
+    char readingTime[16];
+    char readingDate[16];
+    Format_Reading_Time(readingTime, timedate);
+    Format_Reading_Date(readingDate, timedate, '-');
+
+    AppendBuffer(buffer, "<overheightReadingData>");
+    AppendBuffer(buffer, "<readingTime>");
+    AppendBuffer(buffer, readingTime);
+    AppendBuffer(buffer, "</readingTime>");
+    AppendBuffer(buffer, "<readingDate>");
+    AppendBuffer(buffer, readingDate);
+    AppendBuffer(buffer, "</readingDate>");
+    AppendBuffer(buffer, "<triggerHeight units=");
+    QAppendBuffer(buffer, "in");
+    AppendBuffer(buffer, ">");                        
+    AppendBuffer(buffer, d->triggerHeight);
+    AppendBuffer(buffer, "</triggerHeight>");
+    AppendBuffer(buffer, "</overheightReadingData>");
+}
+
+void AppendStatus(struct BUFFER *buffer, enum DeviceStatus status)
+{
+    STRING opStatus = Format_Device_Status(status);
+    
+    AppendBuffer(buffer, "<overheightStatus>");
+    AppendBuffer(buffer, "<opStatus>");
+    AppendBuffer(buffer, opStatus);
+    AppendBuffer(buffer, "</opStatus>");
+    AppendBuffer(buffer, "</overheightStatus>");
+}
+
+void AppendOverheight(struct BUFFER *buffer, DEVICE d, struct Timestamp *timedate, Boolean dataexists)
+{
+    AppendBuffer(buffer, "<overheight>");
+    if (dataexists)
+        {
+            AppendReadingData(buffer, d, timedate);
+        }
+    AppendStatus(buffer, d->status);
+    AppendBuffer(buffer, "</overheight>");
+}
+
+
+/* we have an event and want to send a message saying so.
+   The XML message looks like:
+
+<overheightUpdateMsg>
+	<refId> aaa </refId>
+	<icdVersion> bbb </icdVersion>
+	<id>
+		<providerName> fff1 </providerName>
+		<resourceType> fff2 </resourceType>
+		<centerId> fff3 </centerId>
+	</id>
+	<overheight>
+		<overheightStatus>
+			<opStatus> ggg </opStatus>
+		</overheightStatus>
+		<overheightReadingData>
+		    <readingTime> iii </readingTime>
+			<readingDate> jjj </readingDate>
+			<triggerHeight> kkk </triggerHeight>
+	    </overheightReadingData>
+	</overheight>
+</overheightUpdateMsg>
+*/
+
+/* the update message, in the buffer */
+struct BUFFER *Build_One_Event_Message(DEVICE d, struct Timestamp *timedate, Boolean dataexists)
+{
+    /* first get STRING forms of the important things */
+    char MyRefId[16];
+
+    myRefId += 1;
+    snprintf(MyRefId, sizeof(MyRefId), "%d", myRefId);
+    
+    struct BUFFER *buffer = ClearBuffer();
+    AppendBuffer(buffer, "<overheightUpdateMsg>");
+    AppendHeader(buffer, MyRefId, icdVersion);
+    AppendId(buffer, d);
+    AppendOverheight(buffer, d, timedate, dataexists);
+    AppendBuffer(buffer, "</overheightUpdateMsg>");
+    return(buffer);
+}
+
+STRING Format_One_Event_Message(DEVICE d, struct Timestamp *timedate, Boolean dataexists)
+{
+    STRING b = FinishBuffer(Build_One_Event_Message(d, timedate, dataexists));
+    return(b);
+}
+
+
+/* ***************************************************************** */
+/*                                                                   */
+/*                                                                   */
+/* ***************************************************************** */
+
+/* we expect a request message that looks like:
+   
+   <retrieveDataReq>
+   <refId> aaa </refId>
+   <icdVersion> bbb </icdVersion>
+   <overheightData> TRUE </overheightData>
+   </retrieveDataReq>
+   
+   We need to keep the refId, and icdVersion,
+   and knowledge that overheightData is true.
+
+   I guess the way to do it is to define a
+   set of key/value pairs.  When we get an
+   actual value, we define the tag as the
+   key and store the value as a STRING.
+
+   In general, we build a tree of
+   key/value pair lists.  A leaf of the
+   tree is a key/value pair.
+   Interior nodes of the tree just
+   have a key and a pointer to another
+   node.
+
+*/
+/* for parsing an incoming XML message, we will need a tree.
+   The tree is either a key/value pair, or a key
+   and a pointer to another node. We don't use both
+   value and xml_list at the same time (they could be
+   a union to save space, but that really seems like
+   over-kill.
+*/
+
+struct xml_element
+{
+    struct xml_element *next /* peer nodes */;
+
+    /* the key and value point into the message buffer; they are
+       not zero-terminated, so we keep their lengths */
+    STRING key;
+    int key_length;
+    int tag;                        /* the key, if it is a known tag */
+
+    /* the "value" is either a string, or another XML element */
+    struct xml_element *xml_list /* child node */;
+    STRING value;
+    int value_length;
+};
+
+
+/* the memory for the tree of a message with this many elements;
+   the validator counts them as it goes */
+int xml_arena_size(int elements)
+{
+    int size = (sizeof(struct xml_element) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    return(elements * size);
+}
+
+/* compare a (pointer, length) string to a zero-terminated string,
+   ignoring case */
+Boolean view_equal(STRING s, int n, STRING t)
+{
+    if (s == NULL) return(FALSE);
+    while (n > 0)
+        {
+            /* ASCII letters differ in case only by 0x20 */
+            int c = *s ^ *t;
+            if (c != 0)
+                {
+                    int l = *s | 0x20;
+                    if ((c != 0x20) || (l < 'a') || (l > 'z')) return(FALSE);
+                }
+            s++;
+            t++;
+            n--;
+        }
+    return(*t == '\0');
+}
+
+/* make a zero-terminated copy of a (pointer, length) string */
+STRING remember_view(STRING s, int n)
+{
+    if (s == NULL) return(NULL);
+    STRING p = CAST(STRING, malloc(n + 1));
+    memcpy(p, s, n);
+    p[n] = '\0';
+    return(p);
+}
+
+
+
+/* Tag names.  The tags we know are turned into small numbers as
+   the message is parsed, so the type of a message, or one of its
+   fields, is found by an index rather than a string compare.
+
+   A tag goes to its slot in Tag_Hash[] by its length plus its first
+   and last letters (in lower case).  The slots were worked out so
+   that no two known tags share one.  To add a tag, add it to the
+   enum and Tag_Names[], and put it in the slot tag_hash() gives it;
+   if that slot is taken, change the hash.  Check_Tag_Hash() stops
+   the program at start-up (and fails make bench) if any tag is not
+   where it should be. */
+
+enum XML_Tag
+{
+    TAG_UNKNOWN,
+    TAG_RETRIEVEDATAREQ,
+    TAG_REFID,
+    TAG_ICDVERSION,
+    TAG_OVERHEIGHTDATA,
+    TAG_COUNT
+};
+
+struct tag_name
+{
+    STRING name;
+    int length;
+};
+
+struct tag_name Tag_Names[TAG_COUNT] =
+{
+    { NULL, 0 },
+    { "retrieveDataReq", 15 },
+    { "refId", 5 },
+    { "icdVersion", 10 },
+    { "overheightData", 14 },
+};
+
+#define TAG_HASH_SIZE 16
+
+static inline int tag_hash(STRING s, int n)
+{
+    return((n + (s[0] | 0x20) + (s[n-1] | 0x20)) & (TAG_HASH_SIZE - 1));
+}
+
+/* the tag in each slot of the hash */
+UINT8 Tag_Hash[TAG_HASH_SIZE] =
+{
+    [1] = TAG_ICDVERSION,
+    [2] = TAG_RETRIEVEDATAREQ,
+    [11] = TAG_REFID,
+    [14] = TAG_OVERHEIGHTDATA,
+};
+
+
+int intern_tag(STRING s, int n)
+{
+    if (n <= 0) return(TAG_UNKNOWN);
+    int tag = Tag_Hash[tag_hash(s, n)];
+    if ((tag != TAG_UNKNOWN) && (n == Tag_Names[tag].length) && view_equal(s, n, Tag_Names[tag].name))
+        return(tag);
+    return(TAG_UNKNOWN);
+}
+
+/* TRUE if every tag is in its slot */
+Boolean Tag_Hash_OK(void)
+{
+    Boolean ok = TRUE;
+    int tag;
+    for (tag = TAG_UNKNOWN + 1; tag < TAG_COUNT; tag++)
+        if (intern_tag(Tag_Names[tag].name, Tag_Names[tag].length) != tag)
+            {
+                important("tag %s should be in slot %d of the tag hash\n",
+                          Tag_Names[tag].name, tag_hash(Tag_Names[tag].name, Tag_Names[tag].length));
+                ok = FALSE;
+            }
+    return(ok);
+}
+
+void Check_Tag_Hash(void)
+{
+    if (!Tag_Hash_OK())
+        {
+            fprintf(stderr, "tag hash is wrong; see the log\n");
+            exit(-1);
+        }
+}
+
+
+/* find the fields of a message: the first child with each known tag */
+void index_xml_children(struct xml_element *list, struct xml_element *field[TAG_COUNT])
+{
+    int i;
+    for (i = 0; i < TAG_COUNT; i++)
+        field[i] = NULL;
+    for (; list != NULL; list = list->next)
+        if (field[list->tag] == NULL) field[list->tag] = list;
+}
+
+void dump_xml_element(struct xml_element *root, int level)
+{
+    int i;
+    struct xml_element *element;
+    
+    for (element = root; element != NULL; element = element->next)
+        {
+            if (element->value == NULL)
+                {
+                    for (i = 0; i < level; i++) fprintf(stderr, "    ");
+                    fprintf(stderr, "%.*s:\n", element->key_length, element->key);
+                    dump_xml_element(element->xml_list, level+1);
+                }
+            else
+                {
+                    for (i = 0; i < level; i++) fprintf(stderr, "    ");                    
+                    fprintf(stderr, "%.*s: %.*s\n", element->key_length, element->key,
+                            element->value_length, element->value);
+                }
+        }
+}
+
+
+/* ***************************************************************** */
+/*                                                                   */
+/*                                                                   */
+/* ***************************************************************** */
+
+/* The XML tokenizer.  We do not change the message buffer, and we do
+   not copy anything out of it.  Each call returns the next token: a
+   start tag, a text value, or an end tag, as a pointer into the
+   buffer and a length.  We keep a stack of the open tags (so we can
+   check the end tags) instead of recursing, and the stack has a
+   fixed depth, so a hostile message cannot run us out of stack.
+
+   XML comments <!--...--> and declarations <?xml...?> are skipped
+   wherever they appear.  Attributes are skipped; we have no use for
+   them.  An empty element <tag/> is a start tag and an end tag.
+
+   The tokenizer can also be run on a message as it comes in.  If
+   more of the message is on the way, and a token runs off the end of
+   what we have, we return XT_MORE, and start that token over again
+   when we are called with more of the message. */
+
+#define XML_MAX_DEPTH  16
+
+enum XML_Token_Type { XT_START, XT_TEXT, XT_END, XT_EOF, XT_ERROR, XT_MORE };
+
+struct XML_TOKEN
+{
+    enum XML_Token_Type type;
+    STRING s;
+    int n;
+};
+
+struct XML_PULL
+{
+    STRING p;                  /* next character to look at */
+    STRING end;                /* just past the end of what we have */
+    Boolean more;              /* more of the message is coming */
+    int depth;                 /* number of open tags */
+    Boolean empty_end;         /* we owe an end tag for <tag/> */
+    Boolean mismatch;          /* an end tag did not match */
+    STRING error;              /* why we returned XT_ERROR */
+    struct { STRING s; int n; } open[XML_MAX_DEPTH];
+};
+
+
+void xml_pull_init(struct XML_PULL *x, STRING buffer, int n)
+{
+    x->p = buffer;
+    x->end = buffer + n;
+    x->more = FALSE;
+    x->depth = 0;
+    x->empty_end = FALSE;
+    x->mismatch = FALSE;
+    x->error = NULL;
+}
+
+/* find the string s (of length n) at or after p; NULL if not found */
+STRING xml_find(STRING p, STRING end, STRING s, int n)
+{
+    while (p + n <= end)
+        {
+            if ((*p == *s) && (memcmp(p, s, n) == 0)) return(p);
+            p++;
+        }
+    return(NULL);
+}
+
+/* more of the message has come in; it now ends at end */
+void xml_pull_extend(struct XML_PULL *x, STRING end, Boolean more)
+{
+    x->end = end;
+    x->more = more;
+}
+
+enum XML_Token_Type xml_error(struct XML_PULL *x, struct XML_TOKEN *t, STRING why)
+{
+    x->error = why;
+    t->type = XT_ERROR;
+    t->s = x->p;
+    t->n = 0;
+    return(XT_ERROR);
+}
+
+/* we ran off the end of what we have.  If more is coming, try this
+   token again later (x->p is still at its start). */
+enum XML_Token_Type xml_short(struct XML_PULL *x, struct XML_TOKEN *t, STRING why)
+{
+    if (!x->more) return(xml_error(x, t, why));
+    t->type = XT_MORE;
+    t->s = x->p;
+    t->n = 0;
+    return(XT_MORE);
+}
+
+enum XML_Token_Type xml_pull_next(struct XML_PULL *x, struct XML_TOKEN *t)
+{
+    STRING p = x->p;
+    STRING end = x->end;
+
+    /* the end tag of an empty element */
+    if (x->empty_end)
+        {
+            x->empty_end = FALSE;
+            x->depth -= 1;
+            t->type = XT_END;
+            t->s = x->open[x->depth].s;
+            t->n = x->open[x->depth].n;
+            return(XT_END);
+        }
+
+    while (TRUE)
+        {
+            /* skip any leading blanks */
+            while ((p < end) && isxmlspace(*p)) p++;
+            x->p = p;
+
+            if ((p >= end) && x->more) return(xml_short(x, t, "more"));
+            if ((p >= end) || (*p == '\0'))
+                {
+                    if (x->depth > 0) return(xml_error(x, t, "message ends inside a tag"));
+                    t->type = XT_EOF;
+                    t->s = p;
+                    t->n = 0;
+                    return(XT_EOF);
+                }
+
+            if (*p != '<') break;
+
+            /* need a few characters to tell what this is */
+            if ((end - p < 4) && x->more) return(xml_short(x, t, "more"));
+
+            /* XML comments are skipped */
+            if ((end - p >= 4) && (memcmp(p, "<!--", 4) == 0))
+                {
+                    p = xml_find(p + 4, end, "-->", 3);
+                    if (p == NULL) return(xml_short(x, t, "unterminated comment"));
+                    p += 3;
+                    continue;
+                }
+
+            /* XML declarations are treated as comments for this application. */
+            if ((end - p >= 2) && (p[1] == '?'))
+                {
+                    p = xml_find(p + 2, end, "?>", 2);
+                    if (p == NULL) return(xml_short(x, t, "unterminated declaration"));
+                    p += 2;
+                    continue;
+                }
+
+            /* another tag.  Advance past the < */
+            p++;
+            Boolean end_tag = (p < end) && (*p == '/');
+            if (end_tag) p++;
+
+            STRING tag = p;
+            while ((p < end) && istagchar(*p)) p++;
+            int n = p - tag;
+            if (p >= end) return(xml_short(x, t, "unterminated tag"));
+            if (n == 0) return(xml_error(x, t, "bad tag"));
+
+            /* skip any attributes */
+            while ((p < end) && (*p != '>')) p++;
+            if (p >= end) return(xml_short(x, t, "unterminated tag"));
+            Boolean empty = (!end_tag) && (p[-1] == '/');
+            p++;
+            x->p = p;
+
+            t->s = tag;
+            t->n = n;
+
+            if (end_tag)
+                {
+                    if (x->depth == 0) return(xml_error(x, t, "end tag without start tag"));
+                    x->depth -= 1;
+                    STRING s = x->open[x->depth].s;
+                    int m = x->open[x->depth].n;
+                    if ((m != n) || (strncasecmp(s, tag, n) != 0))
+                        {
+                            fprintf(stderr, "tags do not match: <%.*s> ... </%.*s>\n", m, s, n, tag);
+                            x->mismatch = TRUE;
+                        }
+                    t->type = XT_END;
+                    return(XT_END);
+                }
+
+            if (x->depth >= XML_MAX_DEPTH) return(xml_error(x, t, "tags nested too deep"));
+            x->open[x->depth].s = tag;
+            x->open[x->depth].n = n;
+            x->depth += 1;
+            x->empty_end = empty;
+            t->type = XT_START;
+            return(XT_START);
+        }
+
+    /* a text value: everything up to the next tag, without
+       leading or trailing blanks */
+    STRING begin = p;
+    while ((p < end) && (*p != '<') && (*p != '\0')) p++;
+    if ((p >= end) && x->more) return(xml_short(x, t, "more"));
+    x->p = p;
+    STRING last = p;
+    while ((last > begin) && isxmlspace(last[-1])) last--;
+
+    t->type = XT_TEXT;
+    t->s = begin;
+    t->n = last - begin;
+    return(XT_TEXT);
+}
+
+
+/* Build the tree of a message from its tokens, in the arena.
+   Children are kept in the order they appear in the message.
+   Returns the root element, or NULL if the message is not
+   well-formed.  The tree goes away when the arena is released. */
+
+struct xml_element *new_xml_element(struct ARENA *arena, STRING key, int n)
+{
+    struct xml_element *e = CAST(struct xml_element *, Arena_Alloc(arena, sizeof(struct xml_element)));
+    if (e == NULL) return(NULL);
+    e->next = NULL;
+    e->key = key;
+    e->key_length = n;
+    e->tag = intern_tag(key, n);
+    e->xml_list = NULL;
+    e->value = NULL;
+    e->value_length = 0;
+    return(e);
+}
+
+struct xml_element *parse_xml_message(struct ARENA *arena, STRING buffer, int n)
+{
+    struct XML_PULL x;
+    struct XML_TOKEN t;
+
+    struct xml_element *root = NULL;
+
+    /* the open elements, and the last child of each */
+    struct xml_element *parent[XML_MAX_DEPTH];
+    struct xml_element *last_child[XML_MAX_DEPTH];
+    int depth = 0;
+
+    xml_pull_init(&x, buffer, n);
+    while (xml_pull_next(&x, &t) != XT_EOF)
+        {
+            switch (t.type)
+                {
+                case XT_START:
+                    {
+                        /* only one root; ignore anything after it */
+                        if ((depth == 0) && (root != NULL))
+                            return(root);
+
+                        struct xml_element *e = new_xml_element(arena, t.s, t.n);
+                        if (e == NULL)
+                            {
+                                important("XML arena of %d bytes is full\n", arena->size);
+                                return(NULL);
+                            }
+                        if (depth == 0)
+                            root = e;
+                        else if (last_child[depth-1] == NULL)
+                            parent[depth-1]->xml_list = e;
+                        else
+                            last_child[depth-1]->next = e;
+                        if (depth > 0) last_child[depth-1] = e;
+                        parent[depth] = e;
+                        last_child[depth] = NULL;
+                        depth += 1;
+                    }
+                    break;
+
+                case XT_TEXT:
+                    /* text only counts as the value of a leaf */
+                    if ((depth > 0) && (parent[depth-1]->xml_list == NULL))
+                        {
+                            parent[depth-1]->value = t.s;
+                            parent[depth-1]->value_length = t.n;
+                        }
+                    break;
+
+                case XT_END:
+                    depth -= 1;
+                    break;
+
+                case XT_EOF:
+                case XT_MORE:
+                    break;
+
+                case XT_ERROR:
+                    if (debug) fprintf(stderr, "XML error: %s\n", x.error);
+                    return(NULL);
+                }
+        }
+
+    return(root);
+}
+
+
+/* ***************************************************************** */
+/*                                                                   */
+/*                                                                   */
+/* ***************************************************************** */
+
+/* The fast path.  Nearly every message from CVM is the same
+   retrieveDataReq:
+
+   <retrieveDataReq>
+       <refId> aaa </refId>
+       <icdVersion> bbb </icdVersion>
+       <overheightData> TRUE </overheightData>
+   </retrieveDataReq>
+
+   so rather than build a tree and search it, we check for exactly
+   that shape as the tokens go by, and pick out the three values.
+   The fields can come in any order, but each must be there exactly
+   once, with just a text value.  Anything else is a surprise, and
+   the message goes to the general parser instead. */
+
+enum Fastpath_State { FP_ROOT, FP_FIELDS, FP_VALUE, FP_FIELD_END, FP_AFTER, FP_MATCH, FP_FAIL };
+
+enum Fastpath_Field { FF_REFID, FF_ICDVERSION, FF_OVERHEIGHTDATA, FF_COUNT };
+
+struct FASTPATH
+{
+    enum Fastpath_State state;
+    int field;                      /* the field we are in */
+    struct
+    {
+        STRING s;
+        int n;
+        Boolean seen;
+    } value[FF_COUNT];
+};
+
+
+void fastpath_init(struct FASTPATH *fp)
+{
+    int i;
+    fp->state = FP_ROOT;
+    fp->field = -1;
+    for (i = 0; i < FF_COUNT; i++)
+        {
+            fp->value[i].s = NULL;
+            fp->value[i].n = 0;
+            fp->value[i].seen = FALSE;
+        }
+}
+
+int fastpath_field(STRING s, int n)
+{
+    switch (intern_tag(s, n))
+        {
+        case TAG_REFID:           return(FF_REFID);
+        case TAG_ICDVERSION:      return(FF_ICDVERSION);
+        case TAG_OVERHEIGHTDATA:  return(FF_OVERHEIGHTDATA);
+        }
+    return(-1);
+}
+
+/* take the next token; returns the new state */
+enum Fastpath_State fastpath_token(struct FASTPATH *fp, struct XML_TOKEN *t)
+{
+    int i;
+
+    switch (fp->state)
+        {
+        case FP_ROOT:
+            if ((t->type == XT_START) && (intern_tag(t->s, t->n) == TAG_RETRIEVEDATAREQ))
+                fp->state = FP_FIELDS;
+            else
+                fp->state = FP_FAIL;
+            break;
+
+        case FP_FIELDS:
+            if (t->type == XT_START)
+                {
+                    i = fastpath_field(t->s, t->n);
+                    if ((i < 0) || fp->value[i].seen)
+                        {
+                            fp->state = FP_FAIL;
+                            break;
+                        }
+                    fp->field = i;
+                    fp->value[i].seen = TRUE;
+                    fp->state = FP_VALUE;
+                    break;
+                }
+            if (t->type == XT_END)
+                {
+                    /* end of the retrieveDataReq; need all the fields */
+                    fp->state = FP_AFTER;
+                    for (i = 0; i < FF_COUNT; i++)
+                        if (!fp->value[i].seen) fp->state = FP_FAIL;
+                    break;
+                }
+            fp->state = FP_FAIL;
+            break;
+
+        case FP_VALUE:
+            if (t->type == XT_TEXT)
+                {
+                    fp->value[fp->field].s = t->s;
+                    fp->value[fp->field].n = t->n;
+                    fp->state = FP_FIELD_END;
+                }
+            else if (t->type == XT_END)
+                fp->state = FP_FIELDS;       /* an empty value */
+            else
+                fp->state = FP_FAIL;
+            break;
+
+        case FP_FIELD_END:
+            fp->state = (t->type == XT_END) ? FP_FIELDS : FP_FAIL;
+            break;
+
+        case FP_AFTER:
+            fp->state = (t->type == XT_EOF) ? FP_MATCH : FP_FAIL;
+            break;
+
+        case FP_MATCH:
+        case FP_FAIL:
+            break;
+        }
+    return(fp->state);
+}
+
+
+
+/* ***************************************************************** */
+/*                                                                   */
+/*                                                                   */
+/* The validator.  Before we build a tree for a message, or act on
+   it, we check its shape in one pass over its tokens: a root that is
+   a request we know, then fields that are just text, each at most
+   once, with all the required ones, and nothing after the root.
+   Fields we do not know are allowed (a newer ICD may add some), but
+   must also be just text.  This needs no memory, and a message that
+   fails is dropped and counted by why.
+
+   The requests come from the ICD, written out as a root tag and its
+   fields; a ! after a field means it is required.  At start-up
+   Compile_Validator() turns these into sets of tags, one bit per
+   tag, for the state machine. */
+
+struct request_definition
+{
+    STRING root;
+    STRING fields;
+};
+
+struct request_definition Request_Definitions[] =
+{
+    { "retrieveDataReq", "refId! icdVersion overheightData!" },
+    { NULL, NULL }
+};
+
+typedef unsigned int TAG_SET;
+#define TAG_BIT(tag) (CAST(TAG_SET, 1) << (tag))
+
+Boolean Request_Defined[TAG_COUNT] = { FALSE };
+TAG_SET Request_Required[TAG_COUNT] = { 0 };
+
+STRING Reject_Names[RJ_COUNT] =
+{
+    "none", "not XML", "tags do not match", "unknown message",
+    "field is not text", "duplicate field", "missing field",
+    "text outside a field", "more after the message",
+    "message too long"
+};
+
+
+void Compile_Validator(void)
+{
+    int i;
+    for (i = 0; Request_Definitions[i].root != NULL; i++)
+        {
+            STRING name = Request_Definitions[i].root;
+            int root = intern_tag(name, strlen(name));
+            if (root == TAG_UNKNOWN)
+                {
+                    important("request %s is not a known tag\n", name);
+                    continue;
+                }
+            Request_Defined[root] = TRUE;
+            Request_Required[root] = 0;
+
+            STRING p = Request_Definitions[i].fields;
+            while (*p != '\0')
+                {
+                    while (isxmlspace(*p)) p++;
+                    STRING field = p;
+                    while (istagchar(*p)) p++;
+                    int n = p - field;
+                    if (n == 0) break;
+
+                    int tag = intern_tag(field, n);
+                    if (tag == TAG_UNKNOWN)
+                        important("field %.*s of request %s is not a known tag\n", n, field, name);
+                    if (*p == '!')
+                        {
+                            if (tag != TAG_UNKNOWN) Request_Required[root] |= TAG_BIT(tag);
+                            p++;
+                        }
+                }
+        }
+}
+
+
+enum Validator_State { VS_ROOT, VS_FIELDS, VS_VALUE, VS_FIELD_END, VS_AFTER, VS_VALID, VS_INVALID };
+
+struct VALIDATOR
+{
+    enum Validator_State state;
+    int root;                       /* tag of the root element */
+    TAG_SET seen;                   /* fields we have had */
+    int elements;                   /* start tags, for the tree */
+    enum Reject_Reason reason;
+};
+
+void validator_init(struct VALIDATOR *v)
+{
+    v->state = VS_ROOT;
+    v->root = TAG_UNKNOWN;
+    v->seen = 0;
+    v->elements = 0;
+    v->reason = RJ_NONE;
+}
+
+enum Validator_State validator_reject(struct VALIDATOR *v, enum Reject_Reason reason)
+{
+    v->reason = reason;
+    v->state = VS_INVALID;
+    return(VS_INVALID);
+}
+
+/* take the next token; returns the new state */
+enum Validator_State validate_token(struct VALIDATOR *v, struct XML_PULL *x, struct XML_TOKEN *t)
+{
+    if ((v->state == VS_VALID) || (v->state == VS_INVALID)) return(v->state);
+    if (t->type == XT_ERROR) return(validator_reject(v, RJ_SYNTAX));
+    if (x->mismatch) return(validator_reject(v, RJ_MISMATCH));
+
+    int tag;
+    switch (v->state)
+        {
+        case VS_ROOT:
+            if (t->type == XT_START)
+                {
+                    v->root = intern_tag(t->s, t->n);
+                    if (!Request_Defined[v->root]) return(validator_reject(v, RJ_UNKNOWN_MESSAGE));
+                    v->elements += 1;
+                    v->state = VS_FIELDS;
+                    break;
+                }
+            if (t->type == XT_TEXT) return(validator_reject(v, RJ_MISPLACED_TEXT));
+            return(validator_reject(v, RJ_SYNTAX));
+
+        case VS_FIELDS:
+            if (t->type == XT_START)
+                {
+                    tag = intern_tag(t->s, t->n);
+                    if (tag != TAG_UNKNOWN)
+                        {
+                            if (v->seen & TAG_BIT(tag)) return(validator_reject(v, RJ_DUPLICATE_FIELD));
+                            v->seen |= TAG_BIT(tag);
+                        }
+                    v->elements += 1;
+                    v->state = VS_VALUE;
+                    break;
+                }
+            if (t->type == XT_END)
+                {
+                    TAG_SET required = Request_Required[v->root];
+                    if ((v->seen & required) != required) return(validator_reject(v, RJ_MISSING_FIELD));
+                    v->state = VS_AFTER;
+                    break;
+                }
+            if (t->type == XT_TEXT) return(validator_reject(v, RJ_MISPLACED_TEXT));
+            return(validator_reject(v, RJ_SYNTAX));
+
+        case VS_VALUE:
+            if (t->type == XT_TEXT) v->state = VS_FIELD_END;
+            else if (t->type == XT_END) v->state = VS_FIELDS;     /* an empty value */
+            else if (t->type == XT_START) return(validator_reject(v, RJ_TOO_DEEP));
+            else return(validator_reject(v, RJ_SYNTAX));
+            break;
+
+        case VS_FIELD_END:
+            if (t->type == XT_END) v->state = VS_FIELDS;
+            else if (t->type == XT_START) return(validator_reject(v, RJ_TOO_DEEP));
+            else return(validator_reject(v, RJ_SYNTAX));
+            break;
+
+        case VS_AFTER:
+            if (t->type == XT_EOF) v->state = VS_VALID;
+            else return(validator_reject(v, RJ_TRAILING));
+            break;
+
+        case VS_VALID:
+        case VS_INVALID:
+            break;
+        }
+    return(v->state);
+}
+
+/* count and log a message we will not act on */
+void Reject_XML_Message(struct VALIDATOR *v)
+{
+    Rejects[v->reason] += 1;
+    important("XML message rejected: %s\n", Reject_Names[v->reason]);
+}
+
+
+
+/* ***************************************************************** */
+
+
+/* The response to a retrieveDataReq has every event that we have
+   for each detector since CVM last asked.  If CVM has been away for
+   a while, that could be a lot of events, so we do not build the
+   whole response in memory.  Instead we generate it a piece at a
+   time from a cursor: a header, then for each detector its id, one
+   piece for each event, and its status, then a trailer.  We run the
+   cursor twice: once to count the bytes (the length goes first in
+   the message) and log them, and then again, a chunk at a time, as
+   the connection has room for more.
+
+   Events that come in while we are sending are not part of the
+   response; we fix where each event file ends when we start, and
+   count offsets as for event_base, so we read the same events both
+   times, even if the file is cut in the meantime (it is not cut past
+   where the response starts; see below).  An event file is open
+   only while a chunk is being made from it, so a response waiting
+   on a slow client holds no files open.
+
+   Each client that asks gets every event since it last asked (CVM
+   is not the only one that may ask; a technician's laptop may too),
+   so an EVENT_READER keeps, for each connection, where in each event
+   file its next response starts, and a file is cut back only as far
+   as the client furthest behind.  A client that has not asked yet
+   gets everything in the files when it does, so they are not cut
+   while it might still ask.  But an idle laptop, or a link to CVM
+   that only takes the updates, must not make the files grow without
+   end on the ioPAC's small flash, so a client that has not asked for
+   EVENT_HOLD_TIME is no longer waited for; if it does ask again, it
+   gets what is left in the files. */
+
+/* how long we keep events for a client that does not ask for them */
+#define EVENT_HOLD_TIME  600  /* seconds */
+
+/* how much of an event file we read at a time */
+#define EVENT_READ_SIZE  512
+
+/* how much of a response we send at a time */
+#define RESPONSE_CHUNK_SIZE  16384
+
+enum Response_Phase { RP_HEADER, RP_DEVICE, RP_EVENTS, RP_DEVICE_END, RP_TRAILER, RP_DONE };
+
+/* offsets are counted as for event_base */
+struct EVENT_READER
+{
+    off_t from[MAX_DETECTORS];     /* its next response starts here; -1 for all of it */
+    int responses;                 /* responses to it not yet finished */
+    time_t asked;                  /* when it last asked (or connected) */
+};
+
+void Reset_Event_Reader(struct EVENT_READER *er)
+{
+    int i;
+    for (i = 0; i < MAX_DETECTORS; i++)
+        er->from[i] = -1;
+    er->responses = 0;
+    er->asked = time(NULL);
+}
+
+/* how far the event file of DDD[i] can be cut back: to keep, or to
+   where a client that is further behind is */
+off_t Oldest_Event_Position(int i, off_t keep);
+
+struct RESPONSE_CURSOR
+{
+    STRING refID;
+    STRING icdVersion;             /* as it was when we started */
+    STRING strings;                /* the memory for both */
+    struct EVENT_READER *reader;   /* the client's, or NULL */
+    enum Response_Phase phase;
+    int device;                    /* which DDD entry we are on */
+    FileDesc fd;                   /* its event file, while we read it */
+    off_t offset;                  /* how far we have read in the event file */
+    off_t start[MAX_DETECTORS];    /* we report events from here */
+    off_t end[MAX_DETECTORS];      /* up to here (all counted as for event_base) */
+    enum DeviceStatus status[MAX_DETECTORS];  /* as it was when we started */
+    char events[EVENT_READ_SIZE];  /* the part of the event file we have read */
+    int have;                      /* bytes in events[] */
+    int used;                      /* bytes in events[] already reported */
+};
+
+
+int next_response_device(int i)
+{
+    for (; i < MAX_DETECTORS; i++)
+        if (DDD[i] != NULL) return(i);
+    return(-1);
+}
+
+/* close the event file we are reading, until we want more of it */
+void Release_XML_Response_File(struct RESPONSE_CURSOR *rc)
+{
+    if (rc->fd >= 0) close(rc->fd);
+    rc->fd = -1;
+}
+
+void Rewind_XML_Response(struct RESPONSE_CURSOR *rc)
+{
+    Release_XML_Response_File(rc);
+    rc->phase = RP_HEADER;
+    rc->device = -1;
+    rc->offset = 0;
+    rc->have = 0;
+    rc->used = 0;
+}
+
+void Start_XML_Response(struct RESPONSE_CURSOR *rc,
+                        STRING refID, int refID_length,
+                        STRING CVM_icdVersion, int CVM_icdVersion_length)
+{
+    /* we are asked to send back the data for the last
+       events. Read them from the files, if there are any. */
+
+    /* if we get an icdVersion, which differs from what we
+       have, keep their version. */
+    if ((CVM_icdVersion != NULL)
+        && ((icdVersion == NULL) || !view_equal(CVM_icdVersion, CVM_icdVersion_length, icdVersion)))
+        {
+            if (icdVersion != NULL) free(icdVersion);
+            icdVersion = remember_view(CVM_icdVersion, CVM_icdVersion_length);
+        }
+
+    /* The status of a detector, and the icdVersion (if another
+       client asks), may change while the response waits for a slow
+       client, but its length is already on its way; so it has them
+       as they are now.  The refId and icdVersion share one piece of
+       memory. */
+    int m = (refID != NULL) ? refID_length + 1 : 0;
+    int v = (icdVersion != NULL) ? strlen(icdVersion) + 1 : 0;
+    rc->strings = (m + v > 0) ? CAST(STRING, malloc(m + v)) : NULL;
+    rc->refID = NULL;
+    rc->icdVersion = NULL;
+    if (refID != NULL)
+        {
+            rc->refID = rc->strings;
+            memcpy(rc->refID, refID, refID_length);
+            rc->refID[refID_length] = '\0';
+        }
+    if (icdVersion != NULL)
+        {
+            rc->icdVersion = rc->strings + m;
+            memcpy(rc->icdVersion, icdVersion, v);
+        }
+
+    struct EVENT_READER *er = rc->reader;
+    if (er != NULL)
+        {
+            er->responses += 1;
+            er->asked = time(NULL);
+        }
+
+    /* fix which events we will report for each detector */
+    int i;
+    for (i = 0; i < MAX_DETECTORS; i++)
+        {
+            DEVICE d = DDD[i];
+            rc->start[i] = 0;
+            rc->end[i] = 0;
+            if (d == NULL) continue;
+            rc->status[i] = d->status;
+
+            struct stat statbuf;
+            if (stat(d->eventFileName, &statbuf) < 0)
+                {
+                    important("Error open file: %s\n", d->eventFileName);
+                    continue;
+                }
+            rc->start[i] = d->event_base;
+            rc->end[i] = d->event_base + statbuf.st_size;
+
+            /* from where this client got to */
+            if ((er == NULL) || (er->from[i] < rc->start[i])) continue;
+            rc->start[i] = (er->from[i] < rc->end[i]) ? er->from[i] : rc->end[i];
+        }
+
+    rc->fd = -1;
+    Rewind_XML_Response(rc);
+}
+
+Boolean next_response_event(struct RESPONSE_CURSOR *rc, struct Timestamp *timedate)
+{
+    DEVICE d = DDD[rc->device];
+
+    while (TRUE)
+        {
+            /* skip newlines (and the NULs of older versions) */
+            while ((rc->used < rc->have)
+                   && ((rc->events[rc->used] == '\n') || (rc->events[rc->used] == '\0')))
+                rc->used += 1;
+
+            /* look for a complete line in what we have read */
+            int i;
+            for (i = rc->used; i < rc->have; i++)
+                if (rc->events[i] == '\n') break;
+
+            /* the last line may not end with a newline */
+            if ((i < rc->have) || ((rc->offset >= rc->end[rc->device]) && (i > rc->used)))
+                {
+                    /* i is the newline; make the line a string */
+                    char line[32];
+                    int n = i - rc->used;
+                    if (n >= sizeof(line)) n = sizeof(line) - 1;
+                    memcpy(line, &rc->events[rc->used], n);
+                    line[n] = '\0';
+                    rc->used = i;
+                    if (decode_event_line(d, line, timedate)) return(TRUE);
+                    continue;
+                }
+
+            /* need to read more of the file */
+            if (rc->offset >= rc->end[rc->device]) return(FALSE);
+            off_t at = rc->offset - d->event_base;
+            if (at < 0) return(FALSE);
+            if (rc->fd < 0)
+                {
+                    rc->fd = open(d->eventFileName, O_RDONLY);
+                    if (rc->fd < 0)
+                        {
+                            important("Error open file: %s\n", d->eventFileName);
+                            return(FALSE);
+                        }
+                }
+
+            /* move what is left to the front of the buffer */
+            int left = rc->have - rc->used;
+            memmove(rc->events, &rc->events[rc->used], left);
+            rc->have = left;
+            rc->used = 0;
+
+            /* a line that fills the whole buffer is garbage */
+            if (rc->have == sizeof(rc->events)) rc->have = 0;
+
+            int m = sizeof(rc->events) - rc->have;
+            if (m > rc->end[rc->device] - rc->offset) m = rc->end[rc->device] - rc->offset;
+            int n = pread(rc->fd, &rc->events[rc->have], m, at);
+            if (n <= 0) return(FALSE);
+            rc->have += n;
+            rc->offset += n;
+        }
+}
+
+/* add the next piece of the response to the buffer.  Returns FALSE
+   when there is nothing more to add. */
+Boolean Next_XML_Response_Piece(struct RESPONSE_CURSOR *rc, struct BUFFER *buffer)
+{
+    DEVICE d;
+    struct Timestamp timedate;
+
+    switch (rc->phase)
+        {
+        case RP_HEADER:
+            AppendBuffer(buffer, "<retrieveDataResp xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\">");    
+            AppendHeader(buffer, rc->refID, rc->icdVersion);
+            AppendBuffer(buffer, "<data xsi:type=\"retrieveData\">");
+            rc->device = next_response_device(0);
+            rc->phase = (rc->device < 0) ? RP_TRAILER : RP_DEVICE;
+            return(TRUE);
+
+        case RP_DEVICE:
+            d = DDD[rc->device];
+            AppendBuffer(buffer, "<overheightData>");    
+            AppendId(buffer, d);
+            AppendBuffer(buffer, "<overheight>");
+
+            /* get ready to read its events */
+            rc->offset = rc->start[rc->device];
+            rc->have = 0;
+            rc->used = 0;
+            rc->phase = RP_EVENTS;
+            return(TRUE);
+
+        case RP_EVENTS:
+            d = DDD[rc->device];
+            if (next_response_event(rc, &timedate))
+                {
+                    AppendReadingData(buffer, d, &timedate);
+                    return(TRUE);
+                }
+            Release_XML_Response_File(rc);
+            rc->phase = RP_DEVICE_END;
+            /* fall thru */
+
+        case RP_DEVICE_END:
+            AppendStatus(buffer, rc->status[rc->device]);
+            AppendBuffer(buffer, "</overheight>");
+            AppendBuffer(buffer, "</overheightData>");
+            rc->device = next_response_device(rc->device + 1);
+            rc->phase = (rc->device < 0) ? RP_TRAILER : RP_DEVICE;
+            return(TRUE);
+
+        case RP_TRAILER:
+            AppendBuffer(buffer, "</data>");        
+            AppendBuffer(buffer, "</retrieveDataResp>");
+            rc->phase = RP_DONE;
+            return(TRUE);
+
+        case RP_DONE:
+            break;
+        }
+    return(FALSE);
+}
+
+void Finish_XML_Response(struct RESPONSE_CURSOR *rc, Boolean sent)
+{
+    Release_XML_Response_File(rc);
+
+    if (rc->strings != NULL) free(rc->strings);
+    rc->strings = NULL;
+    rc->refID = NULL;
+    rc->icdVersion = NULL;
+
+    /* if the client got the events, we do not need to send them to
+       it again; its next response starts after them (unless another
+       response to it, which started from where this one did, is
+       still on its way) */
+    struct EVENT_READER *er = rc->reader;
+    rc->reader = NULL;
+    if (er != NULL) er->responses -= 1;
+    if (!sent) return;
+
+    int i;
+    for (i = 0; i < MAX_DETECTORS; i++)
+        {
+            DEVICE d = DDD[i];
+            if ((d == NULL) || (rc->end[i] <= rc->start[i])) continue;
+
+            off_t keep = Event_Keep_Position(d, rc->end[i]);
+            if (er != NULL)
+                {
+                    if ((er->responses == 0) && (keep > er->from[i])) er->from[i] = keep;
+                    keep = Oldest_Event_Position(i, keep);
+                }
+            Cut_Event_File(d, keep);
+        }
+}
+
+
+/* ***************************************************************** */
+/*                                                                   */
+/*                                                                   */
+/* ***************************************************************** */
+
+/* the usual retrieveDataReq; the fast path has picked out its
+   values.  Returns TRUE if the message needs a reply. */
+
+Boolean Answer_Retrieve_Data_Req(struct FASTPATH *fp, struct RESPONSE_CURSOR *response)
+{
+    Fastpath_Hits += 1;
+    if (!view_equal(fp->value[FF_OVERHEIGHTDATA].s, fp->value[FF_OVERHEIGHTDATA].n, "true"))
+        return(FALSE);
+
+    /* get ready to send an XML overheight data message */
+    Start_XML_Response(response,
+                       fp->value[FF_REFID].s, fp->value[FF_REFID].n,
+                       fp->value[FF_ICDVERSION].s, fp->value[FF_ICDVERSION].n);
+    return(TRUE);
+}
+
+
+/* Each type of message has a handler, found by its root tag.  The
+   handler gets the message's fields by tag, and returns TRUE if the
+   message needs a reply. */
+
+typedef Boolean (*Request_Handler)(struct xml_element *root,
+                                   struct xml_element *field[TAG_COUNT],
+                                   struct RESPONSE_CURSOR *response);
+
+Boolean Handle_Retrieve_Data_Req(struct xml_element *root,
+                                 struct xml_element *field[TAG_COUNT],
+                                 struct RESPONSE_CURSOR *response)
+{
+    struct xml_element *v = field[TAG_OVERHEIGHTDATA];
+    if ((v == NULL) || !view_equal(v->value, v->value_length, "true"))
+        return(FALSE);
+
+    struct xml_element *refID = field[TAG_REFID];
+    struct xml_element *icdVersion = field[TAG_ICDVERSION];
+
+    /* get ready to send an XML overheight data message */
+    Start_XML_Response(response,
+                       (refID != NULL) ? refID->value : NULL,
+                       (refID != NULL) ? refID->value_length : 0,
+                       (icdVersion != NULL) ? icdVersion->value : NULL,
+                       (icdVersion != NULL) ? icdVersion->value_length : 0);
+    return(TRUE);
+}
+
+Request_Handler Request_Handlers[TAG_COUNT] =
+{
+    [TAG_RETRIEVEDATAREQ] = Handle_Retrieve_Data_Req,
+};
+
+
+/* anything else (that has passed the validator): first
+   parse it into a tree, then if it is the right type of
+   message, set up the cursor for a reply message.  Returns
+   TRUE if the message needs a reply. */
+
+Boolean Parse_General_XML_Message(STRING buffer, int n, int elements, struct RESPONSE_CURSOR *response)
+{
+    Boolean reply = FALSE;
+
+    Fastpath_Misses += 1;
+    
+    /* parse */
+    Arena_Reserve(&xml_arena, xml_arena_size(elements));
+    struct xml_element *root = parse_xml_message(&xml_arena, buffer, n);
+    if (root == NULL)
+        {
+            Arena_Release(&xml_arena);
+            return(FALSE);
+        }
+
+    if (debug) dump_xml_element(root, 0);
+
+    /* act */
+    Request_Handler handler = Request_Handlers[root->tag];
+    if (handler != NULL)
+        {
+            struct xml_element *field[TAG_COUNT];
+            index_xml_children(root->xml_list, field);
+            reply = handler(root, field, response);
+        }
+
+    /* the whole tree goes at once */
+    if (debug) fprintf(stderr, "XML arena: %d of %d bytes\n", xml_arena.used, xml_arena.size);
+    Arena_Release(&xml_arena);
+    
+    return(reply);
+}
+
+
+/* ***************************************************************** */
+/*                                                                   */
+/*                                                                   */
+/* ***************************************************************** */
+
+#include <sys/types.h>    /* send, recv, ... */
+#include <sys/socket.h>   /* socket, bind, accept, ... */
+#include <arpa/inet.h>    /* htons, inet_ntoa, ... */
+#include <sys/epoll.h>    /* epoll_create1, epoll_ctl, epoll_wait */
+#include <sys/uio.h>      /* struct iovec */
+#include <netinet/tcp.h>  /* TCP_NODELAY */
+
+#define INVALID_SOCKET  (-1)
+
+
+/* The reactor.  Everything we wait for -- the listening sockets,
+   each client, the polling timer and our signals -- is a file
+   descriptor, registered once along with the function to call when
+   it is ready.  main_loop() just calls Reactor_Dispatch(), which
+   waits and calls them.
+
+   Normally the waiting is done with epoll.  On a gateway with a
+   recent kernel, building with USE_IO_URING waits with io_uring
+   instead (below).  Then plain (not TLS) clients are read and
+   written on the ring as well, and so is the log; see
+   Start_Client_IO() and Ring_Write_Log(). */
+
+struct SOURCE
+{
+    FileDesc fd;
+    void (*ready)(struct SOURCE *s, UINT32 events);
+#ifdef USE_IO_URING
+    int watch;                       /* its Watches[] entry, plus 1 */
+#endif
+};
+
+FileDesc Reactor = INVALID_SOCKET;
+
+#ifndef USE_IO_URING
+
+void Setup_Reactor(void)
+{
+    Reactor = epoll_create1(EPOLL_CLOEXEC);
+    if (Reactor < 0)
+        {
+            important("cannot create epoll: %d\n", errno);
+            perror("epoll_create1");
+            exit(-1);
+        }
+}
+
+void Watch(struct SOURCE *s, UINT32 events)
+{
+    struct epoll_event e;
+    e.events = events;
+    e.data.ptr = s;
+    if (epoll_ctl(Reactor, EPOLL_CTL_ADD, s->fd, &e) < 0)
+        {
+            important("cannot watch FD %d: %d\n", s->fd, errno);
+            perror("epoll_ctl");
+        }
+}
+
+void Unwatch(struct SOURCE *s)
+{
+    /* closing the fd would do this too, unless a child has it */
+    (void)epoll_ctl(Reactor, EPOLL_CTL_DEL, s->fd, NULL);
+}
+
+#define MAX_EVENTS  32
+
+/* wait for something to be ready, and deal with it; FALSE if
+   we cannot wait any more */
+Boolean Reactor_Dispatch(void)
+{
+    struct epoll_event events[MAX_EVENTS];
+    int i;
+
+    int n = epoll_wait(Reactor, events, MAX_EVENTS, -1);
+    if (n < 0)
+        {
+            /* check for a signal; just continue if so */
+            if (errno == EINTR) return(TRUE);
+
+            important("error on epoll_wait\n");
+            perror("epoll_wait");
+            return(FALSE);
+        }
+
+    for (i = 0; i < n; i++)
+        {
+            struct SOURCE *s = CAST(struct SOURCE *, events[i].data.ptr);
+            s->ready(s, events[i].events);
+        }
+    return(TRUE);
+}
+
+#else /* USE_IO_URING */
+
+/* With io_uring, each source is a multishot poll request on the
+   ring, which goes on telling us each time the fd becomes ready.
+   Watch() and Unwatch() only put their requests in the submission
+   queue; they go to the kernel along with the wait, in one system
+   call for the lot.  (The poll bits that epoll uses are the same as
+   poll()'s, so the ready functions get what they always did.)
+
+   A poll can still complete after Unwatch(), when the source may
+   have been freed, so a request does not point to its source but to
+   an entry in Watches[], and carries the entry's generation, which
+   changes when the entry is let go.  Anything from an older
+   generation is ignored.
+
+   There is no liburing on our targets, so we talk to the kernel
+   directly. */
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>  /* io_uring_setup, io_uring_enter, ... */
+#include <sys/mman.h>     /* mmap */
+
+struct RING
+{
+    FileDesc fd;
+    unsigned entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned tail;                   /* our copy, ahead of *sq_tail */
+    unsigned pending;                /* requests not yet submitted */
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+Boolean ring_setup(struct RING *r, unsigned entries)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0) return(FALSE);
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    Boolean single = ((p.features & IORING_FEAT_SINGLE_MMAP) != 0);
+    if (single && (cq_size > sq_size)) sq_size = cq_size;
+
+    char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    r->fd, IORING_OFF_SQ_RING);
+    char *cq = single ? sq : mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+                                  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if ((sq == MAP_FAILED) || (cq == MAP_FAILED) || (r->sqes == MAP_FAILED))
+        {
+            close(r->fd);
+            r->fd = INVALID_SOCKET;
+            return(FALSE);
+        }
+
+    r->entries = p.sq_entries;
+    r->sq_head = CAST(unsigned *, sq + p.sq_off.head);
+    r->sq_tail = CAST(unsigned *, sq + p.sq_off.tail);
+    r->sq_mask = CAST(unsigned *, sq + p.sq_off.ring_mask);
+    r->sq_array = CAST(unsigned *, sq + p.sq_off.array);
+    r->tail = *r->sq_tail;
+    r->pending = 0;
+    r->cq_head = CAST(unsigned *, cq + p.cq_off.head);
+    r->cq_tail = CAST(unsigned *, cq + p.cq_off.tail);
+    r->cq_mask = CAST(unsigned *, cq + p.cq_off.ring_mask);
+    r->cqes = CAST(struct io_uring_cqe *, cq + p.cq_off.cqes);
+    return(TRUE);
+}
+
+/* hand the kernel what we have queued, and wait for at least
+   wait completions.  The kernel may take fewer than we have (or, if
+   the call fails, none); the rest go with the next call. */
+int ring_enter(struct RING *r, unsigned wait)
+{
+    __atomic_store_n(r->sq_tail, r->tail, __ATOMIC_RELEASE);
+    int rc = syscall(__NR_io_uring_enter, r->fd, r->pending, wait,
+                     (wait > 0) ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (rc > 0) r->pending -= (CAST(unsigned, rc) < r->pending) ? CAST(unsigned, rc) : r->pending;
+    return(rc);
+}
+
+/* the next request to fill in; it goes with the next ring_enter() */
+struct io_uring_sqe *ring_sqe(struct RING *r)
+{
+    if (r->tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->entries)
+        (void)ring_enter(r, 0);
+
+    unsigned i = r->tail & *r->sq_mask;
+    struct io_uring_sqe *e = &r->sqes[i];
+    memset(e, 0, sizeof(*e));
+    r->sq_array[i] = i;
+    r->tail += 1;
+    r->pending += 1;
+    return(e);
+}
+
+/* the next completion, or NULL; ring_seen() when done with it */
+struct io_uring_cqe *ring_cqe(struct RING *r)
+{
+    unsigned head = *r->cq_head;
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) return(NULL);
+    return(&r->cqes[head & *r->cq_mask]);
+}
+
+void ring_seen(struct RING *r)
+{
+    __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+
+#define RING_ENTRIES  256
+#define MAX_WATCHES   (MAX_CLIENTS + 16)
+#define NOT_A_WATCH   (~0ULL)
+
+struct WATCH
+{
+    struct SOURCE *s;                /* NULL if free */
+    UINT32 events;
+    unsigned generation;
+};
+
+struct RING Ring;
+struct WATCH Watches[MAX_WATCHES];
+
+/* the top bit is left for RING_CLIENT */
+unsigned long long watch_data(int i)
+{
+    return((CAST(unsigned long long, Watches[i].generation & 0x7FFFFFFF) << 32) | i);
+}
+
+void poll_watch(int i)
+{
+    struct io_uring_sqe *e = ring_sqe(&Ring);
+    e->opcode = IORING_OP_POLL_ADD;
+    e->fd = Watches[i].s->fd;
+    e->poll32_events = Watches[i].events;
+    e->len = IORING_POLL_ADD_MULTI;
+    e->user_data = watch_data(i);
+}
+
+void Setup_Reactor(void)
+{
+    if (!ring_setup(&Ring, RING_ENTRIES))
+        {
+            important("cannot create io_uring: %d\n", errno);
+            perror("io_uring_setup");
+            exit(-1);
+        }
+    Reactor = Ring.fd;
+}
+
+void Watch(struct SOURCE *s, UINT32 events)
+{
+    int i;
+    for (i = 0; i < MAX_WATCHES; i++)
+        if (Watches[i].s == NULL) break;
+    if (i >= MAX_WATCHES)
+        {
+            important("cannot watch FD %d: too many\n", s->fd);
+            return;
+        }
+    Watches[i].s = s;
+    Watches[i].events = events & ~EPOLLET;
+    s->watch = i + 1;
+    poll_watch(i);
+}
+
+void Unwatch(struct SOURCE *s)
+{
+    int i = s->watch - 1;
+    if (i < 0) return;
+
+    struct io_uring_sqe *e = ring_sqe(&Ring);
+    e->opcode = IORING_OP_POLL_REMOVE;
+    e->addr = watch_data(i);
+    e->user_data = NOT_A_WATCH;
+
+    Watches[i].s = NULL;
+    Watches[i].generation += 1;
+    s->watch = 0;
+}
+
+/* a read or send for a client, rather than a watch; the rest is its
+   CONNECTION, and which it was in the low bits */
+#define RING_CLIENT  (1ULL << 63)
+#define RING_READ    1ULL
+#define RING_SEND    2ULL
+
+void Ring_Client_Done(unsigned long long data, int res);
+
+Boolean Reactor_Dispatch(void)
+{
+    if ((ring_enter(&Ring, 1) < 0) && (errno != EINTR))
+        {
+            important("error on io_uring_enter\n");
+            perror("io_uring_enter");
+            return(FALSE);
+        }
+
+    struct io_uring_cqe *c;
+    while ((c = ring_cqe(&Ring)) != NULL)
+        {
+            unsigned long long data = c->user_data;
+            int res = c->res;
+            unsigned flags = c->flags;
+            ring_seen(&Ring);
+
+            if (data == NOT_A_WATCH) continue;
+            if (data & RING_CLIENT)
+                {
+                    Ring_Client_Done(data, res);
+                    continue;
+                }
+            int i = data & 0xFFFFFFFF;
+            if ((i >= MAX_WATCHES) || (Watches[i].s == NULL) || (watch_data(i) != data))
+                continue;
+
+            /* the kernel may end a multishot poll; start another */
+            if (!(flags & IORING_CQE_F_MORE)) poll_watch(i);
+
+            if (res > 0)
+                {
+                    struct SOURCE *s = Watches[i].s;
+                    s->ready(s, res);
+                }
+        }
+    return(TRUE);
+}
+
+
+/* Event files are appended to with a write and an fdatasync, linked
+   so the sync happens only if the write worked, on a ring of their
+   own (so we can wait for just those two), from a buffer registered
+   with the kernel once.  It is one system call, for what O_DSYNC
+   did with a write that waited on the disk anyway. */
+
+struct RING File_Ring = { INVALID_SOCKET };
+char File_Buffer[EVENT_LINE_SIZE];
+
+void Setup_File_Ring(void)
+{
+    if (!ring_setup(&File_Ring, 4))
+        {
+            important("no io_uring for event files: %d\n", errno);
+            return;
+        }
+    struct iovec v;
+    v.iov_base = File_Buffer;
+    v.iov_len = sizeof(File_Buffer);
+    if (syscall(__NR_io_uring_register, File_Ring.fd, IORING_REGISTER_BUFFERS, &v, 1) < 0)
+        {
+            important("cannot register event file buffer: %d\n", errno);
+            close(File_Ring.fd);
+            File_Ring.fd = INVALID_SOCKET;
+        }
+}
+
+Boolean Ring_Write_And_Sync(FileDesc fd, STRING data, int n)
+{
+    if (File_Ring.fd == INVALID_SOCKET)
+        return((write(fd, data, n) == n) && (fdatasync(fd) == 0));
+
+    memcpy(File_Buffer, data, n);
+    struct io_uring_sqe *e = ring_sqe(&File_Ring);
+    e->opcode = IORING_OP_WRITE_FIXED;
+    e->fd = fd;
+    e->off = -1;                     /* where the file is; O_APPEND */
+    e->addr = CAST(unsigned long, File_Buffer);
+    e->len = n;
+    e->buf_index = 0;
+    e->flags = IOSQE_IO_LINK;
+    e->user_data = 1;
+
+    e = ring_sqe(&File_Ring);
+    e->opcode = IORING_OP_FSYNC;
+    e->fd = fd;
+    e->fsync_flags = IORING_FSYNC_DATASYNC;
+    e->user_data = 2;
+
+    int rc;
+    while (((rc = ring_enter(&File_Ring, 2)) < 0) && (errno == EINTR))
+        continue;
+    Boolean ok = (rc >= 0);
+
+    /* both complete, one way or the other */
+    int done = 0;
+    while (done < 2)
+        {
+            struct io_uring_cqe *c = ring_cqe(&File_Ring);
+            if (c == NULL)
+                {
+                    if (ring_enter(&File_Ring, 2 - done) < 0) return(FALSE);
+                    continue;
+                }
+            if ((c->user_data == 1) && (c->res != n)) ok = FALSE;
+            if ((c->user_data == 2) && (c->res < 0)) ok = FALSE;
+            ring_seen(&File_Ring);
+            done += 1;
+        }
+    return(ok);
+}
+
+
+/* The log writer thread has a ring of its own, with the log ring's
+   memory registered, so the lines go to the file straight from
+   their slots.  A batch is one linked write per line, all in one
+   system call, as writev() was; a write that comes up short stops
+   the rest, and they are finished with Write_Log(). */
+
+struct RING Log_File_Ring = { INVALID_SOCKET };
+
+void Setup_Log_Ring(void)
+{
+    if (!ring_setup(&Log_File_Ring, LOG_BATCH_LINES))
+        {
+            important("no io_uring for the log: %d\n", errno);
+            return;
+        }
+    struct iovec v;
+    v.iov_base = Log_Ring.base;
+    v.iov_len = LOG_RING_SIZE;
+    if (syscall(__NR_io_uring_register, Log_File_Ring.fd, IORING_REGISTER_BUFFERS, &v, 1) < 0)
+        {
+            important("cannot register the log ring: %d\n", errno);
+            close(Log_File_Ring.fd);
+            Log_File_Ring.fd = INVALID_SOCKET;
+        }
+}
+
+void Ring_Write_Log(struct iovec *iov, int k)
+{
+    if ((Log_File_Ring.fd == INVALID_SOCKET) || (k == 0))
+        {
+            Write_Log(iov, k);
+            return;
+        }
+
+    FileDesc fd = (log_fd >= 0) ? log_fd : 2;
+    int i;
+    for (i = 0; i < k; i++)
+        {
+            struct io_uring_sqe *e = ring_sqe(&Log_File_Ring);
+            e->opcode = IORING_OP_WRITE_FIXED;
+            e->fd = fd;
+            e->off = -1;                     /* O_APPEND */
+            e->addr = CAST(unsigned long, iov[i].iov_base);
+            e->len = iov[i].iov_len;
+            e->buf_index = 0;
+            if (i < k - 1) e->flags = IOSQE_IO_LINK;
+            e->user_data = i;
+        }
+
+    int rc;
+    while (((rc = ring_enter(&Log_File_Ring, k)) < 0) && (errno == EINTR))
+        continue;
+
+    /* every one completes, one way or the other */
+    int res[LOG_BATCH_LINES];
+    int done = 0;
+    while (done < k)
+        {
+            struct io_uring_cqe *c = ring_cqe(&Log_File_Ring);
+            if (c == NULL)
+                {
+                    if ((ring_enter(&Log_File_Ring, k - done) < 0) && (errno != EINTR))
+                        return;
+                    continue;
+                }
+            res[c->user_data] = c->res;
+            ring_seen(&Log_File_Ring);
+            done += 1;
+        }
+
+    for (i = 0; i < k; i++)
+        {
+            int n = (res[i] > 0) ? res[i] : 0;
+            if ((fd == log_fd) && (n > 0)) Count_Log_Bytes(n);
+            if (CAST(size_t, n) == iov[i].iov_len) continue;
+
+            iov[i].iov_base = CAST(char *, iov[i].iov_base) + n;
+            iov[i].iov_len -= n;
+            Write_Log(iov + i, k - i);
+            return;
+        }
+}
+
+#endif /* USE_IO_URING */
+
+void Finish_Reactor(void)
+{
+    if (Reactor != INVALID_SOCKET) close(Reactor);
+}
+
+/* all our configuration variables are strings.  If we want
+   integers, we need to convert them. */
+
+void Initialize_Network_Config_Values(void)
+{
+    if (StringMyRefId != NULL)
+        {
+            myRefId = atoi(StringMyRefId);
+        }
 
     
-Boolean Read_Config_File(void)
+    if (PortName == NULL)
+        PortName = "3080";
+    if (ControlSocketName == NULL)
+        ControlSocketName = remember_string(DEFAULT_CONTROL_SOCKET_NAME);
+}
+
+/* ***************************************************************** */
+/*                                                                   */
+/*                                                                   */
+/* ***************************************************************** */
+
+
+/* send all n bytes on a blocking socket (the export) */
+int Send_Bytes(FileDesc SocketFD, STRING buffer, int n)
 {
-    /* The config file needs to do three things:
+    /* send() may take less than all of them */
+    while (n > 0)
+        {
+            int rc = send(SocketFD, buffer, n, MSG_NOSIGNAL);
+            if (rc < 0)
+                {
+                    if (errno == EINTR) continue;
+                    important("send of %d bytes fails\n", n);
+                    perror("send");
+                    return(-5);
+                }
+            buffer += rc;
+            n -= rc;
+        }
+    return(0);
+}
+
+void Format_Message_Header(UINT8 *buf, int n)
+{
+    /* Sending, like receiving, requires first the 
+       big-endian number of bytes, then a second 
+       reserved word, then the message. */
+
+    /* first word is length, second word of zeros */
+    int i;
+    int shift = 32;
+    for (i = 0; i < 4; i++)
+        {
+            shift = shift - 8;
+            buf[i] = (n >> shift) & 0xFF;
+        }
+    for (i = 4; i < 8; i++) buf[i] = 0;
+}
+
+
+
+
+/* ***************************************************************** */
+/*                                                                   */
+/*                                                                   */
+/* ***************************************************************** */
+
+/* We set up a socket for others to connect to. */
+
+#define BACKLOG 5
+
+
+FileDesc Initialize_for_Network_Requests(STRING portName)
+{
+    FileDesc ConnectionSocket;
+    struct sockaddr_in  sin;
+
+    /* create the connection socket and set its parameters of use */
+    ConnectionSocket = socket(AF_INET, SOCK_STREAM, 0);
+    if (ConnectionSocket < 0)
+        {
+            perror("socket");
+            return(INVALID_SOCKET);
+        }
+
+    (void)setsockopt(ConnectionSocket, SOL_SOCKET, SO_REUSEADDR,   (char *)NULL, 0);
+
+    /* define the name and port to be used with the connection socket */
+    bzero((char *)&sin, sizeof(sin));
+
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = INADDR_ANY;
+
+    int port = CAST(unsigned short, atoi(portName)); /* get the port number */
+    sin.sin_port = htons(port);
+
+    /* bind the name and port number to the connection socket */
+    if (bind(ConnectionSocket, (struct sockaddr *)&sin, sizeof(sin)) < 0)
+        {
+            perror("bind");
+            return(INVALID_SOCKET);
+        }
+
+    important("Socket is FD %d for port %d\n", ConnectionSocket, port);
+
+    /* now activate the named connection socket to get messages */
+    if (listen(ConnectionSocket, BACKLOG) < 0)
+        {
+            perror("listen");
+            return(INVALID_SOCKET);
+        };
+
+    important("Listening on FD %d\n", ConnectionSocket);
+    return(ConnectionSocket);
+}
+
+FileDesc Accept_Client(FileDesc ConnectionSocket)
+{
+    /* wait for a connection from a Client */
+    
+    FileDesc ClientFD;
+    struct sockaddr_in  from;
+    socklen_t   len = sizeof (from);
+    
+    ClientFD = accept(ConnectionSocket, (struct sockaddr *)&from, &len);
+    if (ClientFD < 0)
+        {
+            important("NewConnection: error %d\n", errno);
+            return(INVALID_SOCKET);
+        }
+
+    important("Connect To Client: FD %d \n", ClientFD);
+    return(ClientFD);
+}
+
+
+/* ***************************************************************** */
+/*                                                                   */
+/*                                                                   */
+/* ***************************************************************** */
+
+/* We have two kinds of file descriptors to worry about:
+   
+   ServerConnection -- the socket that we create to allow clients
+                       to create a connection.  We create the
+                       socket(), bind(), and then listen().  This is
+                       done once, and we keep that connection open
+                       for CVM to attach to when it wants.
+
+   Connections[]    -- the actual connections between us and our
+                       clients: CVM, and perhaps a technician's
+                       laptop.  Each client will connect to our
+                       ServerConnection, and we will do an accept()
+                       to create the connection.  These connections
+                       may go away, and be recreated as necessary.
+   
+ */
+
+FileDesc ServerConnection = INVALID_SOCKET;
+struct SOURCE Server_Source;
+
+
+/* ***************************************************************** */
+/*                                                                   */
+/*                                                                   */
+/* ***************************************************************** */
+
+/* The request/message format is defined by the CVM-VCS-Protocol
+   as 
+       4 bytes -- bigendian number of bytes in messages (n)
+       4 bytes -- reserved for future use (0)
+       n bytes -- XML message
+
+   CVM may send us a message a few bytes at a time (a slow link, or
+   a CVM that stalls part way through), and we must not sit waiting
+   for the rest of it while the input lines go unpolled.  So when the
+   socket is readable we take whatever bytes are there, and remember
+   where we are in the message: the header, then the body.  As the
+   body comes in we run it through the tokenizer and the fast path,
+   so by the time the last byte arrives we usually know what the
+   message is.
+
+   Each read takes as much as the socket has (up to the size of the
+   input buffer), so a small message -- header and body -- is one
+   read, and several messages sent together are all handled from
+   what the one read got.  A body that is too long is skipped, so
+   the next message is still found where it should be. */
+
+#define READ_BUFFER_SIZE  4096
+
+enum Reader_State { RS_HEADER, RS_BODY, RS_SKIP };
+
+struct CVM_READER
+{
+    enum Reader_State state;
+    UINT8 header[8];
+    int header_have;                /* bytes of the header we have */
+    int n;                          /* length of the body */
+    int m;                          /* the reserved word */
+    STRING body;
+    int have;                       /* bytes of the body we have */
+    UINT32 skip;                    /* RS_SKIP: bytes still to skip */
+    struct XML_PULL pull;
+    struct FASTPATH fp;
+    struct VALIDATOR v;
+
+    /* what we have read, but not yet used */
+    UINT8 in[READ_BUFFER_SIZE];
+    int in_next;
+    int in_end;
+};
+
+
+/* Most messages are small, so their bodies go in buffers of
+   BODY_BUFFER_SIZE bytes, which are kept for the next message
+   (of any client) rather than freed.  A bigger body gets a buffer
+   of its own. */
+
+#define BODY_BUFFER_SIZE  4096
+#define BODY_POOL_SIZE    16
+
+STRING Body_Pool[BODY_POOL_SIZE];
+int Body_Pool_Count = 0;
+
+STRING take_body_buffer(int n)
+{
+    if (n + 1 > BODY_BUFFER_SIZE)
+        return(CAST(STRING, malloc(n + 1)));
+    if (Body_Pool_Count > 0)
+        return(Body_Pool[--Body_Pool_Count]);
+    return(CAST(STRING, malloc(BODY_BUFFER_SIZE)));
+}
+
+void give_body_buffer(STRING body, int n)
+{
+    if (body == NULL) return;
+    if ((n + 1 > BODY_BUFFER_SIZE) || (Body_Pool_Count >= BODY_POOL_SIZE))
+        free(body);
+    else
+        Body_Pool[Body_Pool_Count++] = body;
+}
+
+
+/* get ready for the next message; anything already read for
+   it stays in the input buffer */
+void Reset_Reader(struct CVM_READER *r)
+{
+    give_body_buffer(r->body, r->n);
+    r->body = NULL;
+    r->state = RS_HEADER;
+    r->header_have = 0;
+    r->n = 0;
+    r->m = 0;
+    r->have = 0;
+    r->skip = 0;
+}
+
+
+/* An update goes to every client, so it is formatted once, header
+   and all, into a shared message.  Each client's queue holds a
+   reference to it, and the last one to let go frees it. */
+
+struct SHARED_MESSAGE
+{
+    int refs;
+    Boolean droppable;               /* a status update, not an event */
+    int n;                           /* bytes in data, with the header */
+    char data[1];
+};
+
+struct SHARED_MESSAGE *New_Shared_Message(STRING message, int n)
+{
+    struct SHARED_MESSAGE *m =
+        CAST(struct SHARED_MESSAGE *, malloc(sizeof(struct SHARED_MESSAGE) + n + 8));
+    m->refs = 1;
+    m->droppable = FALSE;
+    m->n = n + 8;
+    Format_Message_Header(CAST(UINT8 *, m->data), n);
+    memcpy(m->data + 8, message, n);
+    return(m);
+}
+
+void Release_Shared_Message(struct SHARED_MESSAGE *m)
+{
+    m->refs -= 1;
+    if (m->refs == 0) free(m);
+}
+
+
+/* What we have to send to a client waits in a queue until the
+   socket has room for it.  An item is either a shared message, or a
+   response, which is generated a chunk at a time as the one before
+   it is sent, so a long response never has to be all in memory; its
+   header goes at the front of the first chunk. */
+
+enum Out_Kind { OUT_SHARED, OUT_RESPONSE };
+
+struct OUT_ITEM
+{
+    struct OUT_ITEM *next;
+    enum Out_Kind kind;
+    STRING data;                     /* what we are sending now */
+    int n;                           /* bytes in data */
+    int sent;                        /* bytes of data sent */
+    int size;                        /* what it counts for, in the limits */
+    Boolean droppable;
+
+    /* OUT_SHARED */
+    struct SHARED_MESSAGE *shared;
+
+    /* OUT_RESPONSE */
+    struct RESPONSE_CURSOR *response;
+    struct BUFFER chunk;             /* data is chunk.b; none until we start */
+    int length;                      /* from the counting pass */
+};
+
+/* The chunk of a response is made in a buffer big enough for a
+   chunk and the piece that goes past the end of it.  Each response
+   takes one when it starts to send, and gives it back when it is
+   done; we keep a few to use again. */
+#define RESPONSE_BUFFER_SIZE  (2 * RESPONSE_CHUNK_SIZE)
+#define SPARE_CHUNKS  8
+
+STRING Spare_Chunks[SPARE_CHUNKS];
+int Spare_Chunk_Count = 0;
+
+STRING new_Response_Chunk(void)
+{
+    if (Spare_Chunk_Count > 0)
+        return(Spare_Chunks[--Spare_Chunk_Count]);
+    return(CAST(STRING, malloc(RESPONSE_BUFFER_SIZE)));
+}
+
+void Free_Response_Chunk(struct BUFFER *chunk)
+{
+    if (chunk->b == NULL) return;
+    /* one that grew for a very long piece is not kept */
+    if ((chunk->length == RESPONSE_BUFFER_SIZE) && (Spare_Chunk_Count < SPARE_CHUNKS))
+        Spare_Chunks[Spare_Chunk_Count++] = chunk->b;
+    else
+        free(chunk->b);
+    chunk->b = NULL;
+}
+
+/* items come and go with every message, so we keep the ones we
+   are done with, to use again */
+struct OUT_ITEM *Spare_Out_Items = NULL;
+
+struct OUT_ITEM *new_Out_Item(enum Out_Kind kind)
+{
+    struct OUT_ITEM *q = Spare_Out_Items;
+    if (q != NULL)
+        Spare_Out_Items = q->next;
+    else
+        q = TYPED_MALLOC(struct OUT_ITEM);
+    q->next = NULL;
+    q->kind = kind;
+    q->data = NULL;
+    q->n = 0;
+    q->sent = 0;
+    q->size = 0;
+    q->droppable = FALSE;
+    q->shared = NULL;
+    q->response = NULL;
+    return(q);
+}
+
+void Free_Out_Item(struct OUT_ITEM *q, Boolean sent)
+{
+    if (q->kind == OUT_RESPONSE)
+        {
+            Finish_XML_Response(q->response, sent);
+            free(q->response);
+            Free_Response_Chunk(&q->chunk);
+        }
+    else
+        Release_Shared_Message(q->shared);
+    q->next = Spare_Out_Items;
+    Spare_Out_Items = q;
+}
 
-       1. set values that control our overall processing
-          that can be configured -- the port we use for
-          TCP network activity, the base refId that we use
-          for our messages, the name of the log file 
-          and so on.
 
-       2. It needs to build a detector device descriptor
-          for each detector attached to the MOXA, and use
-          those to define the DDD array.
+/* let go of an item that has been taken off a connection's queue */
+struct CONNECTION;
+void Forget_Out_Item(struct CONNECTION *c, struct OUT_ITEM *q, Boolean sent);
 
-       3. It needs to use the DDD array to build the 
-          Channel_Table, so we can go from a channel back
-          to the detector device that drives that channel
-          (either as an event or a fault channel).
-    */
-    
-    int i = 0;
-    
-    FILE *cfile = fopen(Config_FileName, "r");
-    if (cfile == NULL)
+#ifdef USE_TLS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+void Finish_TLS_Connection(struct CONNECTION *c);
+int TLS_Read(struct CONNECTION *c, STRING where, int want);
+#endif
+
+#ifdef USE_IO_URING
+int Ring_Read(struct CONNECTION *c, STRING where, int want);
+Boolean Ring_Send(struct CONNECTION *c);
+#endif
+
+
+/* Capture.  To take a field incident back to the desk, the program
+   can record everything it reads from and sends to its clients, as
+   it goes, in a capture file (captureFileName in the config file,
+   relative to the home directory, or "capture NAME" on the control
+   socket).  cvmreplay can play the requests in it back, and compare
+   the answers.  The file starts with CAPTURE_MAGIC; then each record
+   is a 17-byte header -- the time in microseconds (8 bytes), the
+   connection (4), what happened (1), and how many bytes follow (4),
+   all most significant byte first -- and the bytes.  What happened
+   is 'O' (opened), 'I' (bytes in), 'S' (bytes sent), or 'C'
+   (closed).  The bytes are as the client sees them, before TLS
+   and after it. */
+
+#include <sys/time.h>     /* gettimeofday */
+
+#define CAPTURE_MAGIC  "overhead capture 1\n"
+
+FileDesc Capture_FD = INVALID_SOCKET;
+int Connection_Serial = 0;
+
+void put_capture_word(UINT8 *p, unsigned long long v, int n)
+{
+    int i;
+    for (i = n - 1; i >= 0; i--)
         {
-            important("No config file: %s\n", Config_FileName);
+            p[i] = v & 0xFF;
+            v >>= 8;
+        }
+}
+
+void Capture(int id, char what, const void *data, int n)
+{
+    if (Capture_FD == INVALID_SOCKET) return;
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    UINT8 header[17];
+    put_capture_word(header, CAST(unsigned long long, now.tv_sec) * 1000000 + now.tv_usec, 8);
+    put_capture_word(header + 8, id, 4);
+    header[12] = what;
+    put_capture_word(header + 13, n, 4);
+
+    struct iovec iov[2];
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = CAST(void *, data);
+    iov[1].iov_len = n;
+    if (writev(Capture_FD, iov, 2) != sizeof(header) + n)
+        {
+            important("capture fails (%d); stop\n", errno);
+            close(Capture_FD);
+            Capture_FD = INVALID_SOCKET;
+        }
+}
+
+Boolean Start_Capture(STRING name)
+{
+    if (Capture_FD != INVALID_SOCKET) close(Capture_FD);
+    Capture_FD = open(name, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (Capture_FD < 0)
+        {
+            important("cannot open capture file %s: %d\n", name, errno);
+            Capture_FD = INVALID_SOCKET;
             return(FALSE);
         }
+    if (lseek(Capture_FD, 0, SEEK_END) == 0)
+        (void)write(Capture_FD, CAPTURE_MAGIC, strlen(CAPTURE_MAGIC));
+    important("capture to %s\n", name);
+    return(TRUE);
+}
 
-    line_buffer = NULL;
-    line_buffer_length = 0;
+void Stop_Capture(void)
+{
+    if (Capture_FD == INVALID_SOCKET) return;
+    close(Capture_FD);
+    Capture_FD = INVALID_SOCKET;
+    important("capture stopped\n");
+}
+
+
+/* the most queued items that go in one send */
+#define SEND_IOV_MAX  16
+
+/* everything we keep for one client */
+struct CONNECTION
+{
+    struct SOURCE source;
+    FileDesc fd;
+    int id;                          /* for the capture file */
+    struct CVM_READER reader;
+    struct OUT_ITEM *out_head;       /* waiting to be sent */
+    struct OUT_ITEM *out_tail;
+    time_t stalled_since;            /* when the socket filled up, or 0 */
+    int queued_messages;             /* in out_head, for the limits */
+    int queued_bytes;
+    struct EVENT_READER events;      /* how far its responses have got */
+    time_t last_sent;                /* when we last sent anything */
+    void (*closed)(struct CONNECTION *c);  /* called when it closes */
+    struct CONNECTION *next_closed;
+#ifdef USE_TLS
+    SSL *tls;                        /* NULL for plain TCP */
+    Boolean handshaking;
+    STRING tls_out;                  /* the record being written */
+    int tls_out_n;
+#endif
+#ifdef USE_IO_URING
+    int slot;                        /* in Ring_Input, or -1 if watched */
+    Boolean reading;                 /* a read is on the ring */
+    int ring_next;                   /* what it got, not yet used */
+    int ring_end;
+    int ring_last;                   /* 0 at the end, or -errno */
+    int sending;                     /* items in the send on the ring */
+    struct msghdr msg;
+    struct iovec iov[SEND_IOV_MAX];
+#endif
+};
+
+struct CONNECTION *Connections[MAX_CLIENTS] = { NULL };
+int Client_Count = 0;
+
+off_t Oldest_Event_Position(int i, off_t keep)
+{
+    time_t now = time(NULL);
+    int j;
+    for (j = 0; j < MAX_CLIENTS; j++)
+        {
+            struct CONNECTION *c = Connections[j];
+            if (c == NULL) continue;
+            /* one that is being sent a response is always waited for */
+            if ((c->events.responses == 0) && (now - c->events.asked > EVENT_HOLD_TIME))
+                continue;
+            off_t from = c->events.from[i];
+            if (from < 0) return(DDD[i]->event_base);
+            if (from < keep) keep = from;
+        }
+    return(keep);
+}
+
+/* A connection may be closed while epoll has more news of it
+   waiting to be handled, so closed connections are kept until
+   main_loop() has finished with the news. */
+struct CONNECTION *Closed_Connections = NULL;
+
+#ifdef USE_IO_URING
+Boolean Ring_Slot_Used[MAX_CLIENTS];
+#endif
+
+/* let go of what it had queued, and of the connection itself */
+void release_Client_Connection(struct CONNECTION *c)
+{
+    /* anything not sent is lost; the events will go next time */
+    while (c->out_head != NULL)
+        {
+            struct OUT_ITEM *q = c->out_head;
+            c->out_head = q->next;
+            Forget_Out_Item(c, q, FALSE);
+        }
+    c->out_tail = NULL;
+#ifdef USE_IO_URING
+    if (c->slot >= 0) Ring_Slot_Used[c->slot] = FALSE;
+#endif
+
+    c->next_closed = Closed_Connections;
+    Closed_Connections = c;
+}
+
+void close_Client_Connection(struct CONNECTION *c)
+{
+    if (c->fd == INVALID_SOCKET) return;
+
+    important("close client: FD %d\n", c->fd);
+    Capture(c->id, 'C', NULL, 0);
+    Unwatch(&c->source);
+#ifdef USE_TLS
+    Finish_TLS_Connection(c);
+#endif
+    Boolean busy = FALSE;
+#ifdef USE_IO_URING
+    /* The kernel still has its read, and maybe a send, which use
+       its buffers and what it has queued.  After the shutdown they
+       come back at once, and we let go of it then. */
+    busy = c->reading || (c->sending > 0);
+    if (busy) (void)shutdown(c->fd, SHUT_RDWR);
+#endif
+    close(c->fd);
+    c->fd = INVALID_SOCKET;
+    c->source.fd = INVALID_SOCKET;
+    Reset_Reader(&c->reader);
+
+    int i;
+    for (i = 0; i < MAX_CLIENTS; i++)
+        if (Connections[i] == c) Connections[i] = NULL;
+    Client_Count -= 1;
+
+    if (!busy) release_Client_Connection(c);
+
+    if (c->closed != NULL) c->closed(c);
+}
+
+void Free_Closed_Connections(void)
+{
+    while (Closed_Connections != NULL)
+        {
+            struct CONNECTION *c = Closed_Connections;
+            Closed_Connections = c->next_closed;
+            free(c);
+        }
+}
+
+struct CONNECTION *new_Client_Connection(FileDesc fd)
+{
+    int i;
+    for (i = 0; i < MAX_CLIENTS; i++)
+        {
+            if (Connections[i] != NULL) continue;
+
+            struct CONNECTION *c = Connections[i] = TYPED_MALLOC(struct CONNECTION);
+            c->source.fd = fd;
+            c->source.ready = NULL;
+#ifdef USE_IO_URING
+            c->source.watch = 0;
+#endif
+            c->fd = fd;
+            c->id = ++Connection_Serial;
+            Capture(c->id, 'O', NULL, 0);
+            c->out_head = NULL;
+            c->out_tail = NULL;
+            c->stalled_since = 0;
+            c->queued_messages = 0;
+            c->queued_bytes = 0;
+            Reset_Event_Reader(&c->events);
+            c->last_sent = time(NULL);
+            c->closed = NULL;
+            c->next_closed = NULL;
+            c->reader.body = NULL;
+            c->reader.in_next = 0;
+            c->reader.in_end = 0;
+            Reset_Reader(&c->reader);
+#ifdef USE_TLS
+            c->tls = NULL;
+            c->handshaking = FALSE;
+            c->tls_out = NULL;
+            c->tls_out_n = 0;
+#endif
+#ifdef USE_IO_URING
+            c->slot = -1;
+            c->reading = FALSE;
+            c->ring_next = 0;
+            c->ring_end = 0;
+            c->ring_last = 1;
+            c->sending = 0;
+#endif
+            Client_Count += 1;
+            return(c);
+        }
+    return(NULL);
+}
 
+
+/* we have the header; get ready for the body */
+Boolean reader_header(struct CVM_READER *r)
+{
+    int i;
+    UINT32 n = 0;
+    UINT32 m = 0;
     for (i = 0; i < 4; i++)
         {
-            if (DDD[i] != NULL) free_DDD(DDD[i]);
-            DDD[i] = NULL;
+            n = (n << 8) | r->header[i];
+            m = (m << 8) | r->header[i+4];
         }
-    
-    /* config file should consist of a sequence of lines.
-       Each line has a keyword, then an value.  Mostly the
-       values are strings.  We trim leading and trailing spaces.
-       A line that starts with "#" is a comment.
-    */
+    r->m = m;
+    if (debug) fprintf(stderr, "message of %lu bytes\n", CAST(unsigned long, n));
+    if ((r->m != 0) && debug) fprintf(stderr, "message 2nd byte is 0x%08X\n", r->m);
 
-    STRING line;
-    while ((line = get_line(cfile)) != NULL)
+    if (n == 0)
         {
-            i = 0;
-            /* skip leading blanks */
-            while ((line[i] != '\0') && isspace(line[i])) i += 1;
+            /* a heartbeat; there is nothing more to it */
+            Heartbeats_Received += 1;
+            Reset_Reader(r);
+            return(TRUE);
+        }
+    if (n > MAX_MESSAGE_LENGTH)
+        {
+            /* we will not read it, but we must get past it */
+            important("message of %lu bytes is too long; skipping it\n", CAST(unsigned long, n));
+            Rejects[RJ_TOO_LONG] += 1;
+            r->skip = n;
+            r->state = RS_SKIP;
+            return(TRUE);
+        }
 
-            /* skip blank lines, and comments */
-            if (!isalpha(line[i])) continue;
+    /* get a memory buffer for the message */
+    r->n = n;
+    r->body = take_body_buffer(r->n);
+    if (r->body == NULL)
+        {
+            important("no memory for message of %d bytes\n", r->n);
+            return(FALSE);
+        }
+    r->have = 0;
+    xml_pull_init(&r->pull, r->body, 0);
+    fastpath_init(&r->fp);
+    validator_init(&r->v);
+    r->state = RS_BODY;
+    return(TRUE);
+}
 
-            /* find first letter of key */
-            STRING key = &(line[i]);
 
-            /* skip over the key; key is alphabetic or period */
-            while (isalpha(line[i]) || (line[i] == '.')) i += 1;
-            /* this character terminates the key */
-            line[i] = '\0';
-            i += 1;
+/* run the tokens we have now through the validator and the fast path */
+void reader_tokens(struct CVM_READER *r)
+{
+    struct XML_TOKEN t;
 
-            /* find the value */
-            while ((line[i] != '\0') && !isalnum(line[i])) i += 1;
+    xml_pull_extend(&r->pull, r->body + r->have, (r->have < r->n));
+    while ((r->v.state != VS_VALID) && (r->v.state != VS_INVALID))
+        {
+            if (xml_pull_next(&r->pull, &t) == XT_MORE) return;
+            validate_token(&r->v, &r->pull, &t);
+            fastpath_token(&r->fp, &t);
+            if (r->pull.mismatch) r->fp.state = FP_FAIL;
+        }
+}
 
-            /* found first character of the value */
-            STRING value = &(line[i]);
 
-            /* trim off any trailing spaces */
-            int n = strlen(value);
-            while ((n > 0) && isspace(value[n-1]))
+/* we have all of the body */
+void reader_body_done(struct CVM_READER *r)
+{
+    /* be sure the buffer is zero-terminated */
+    r->body[r->n] = '\0';
+
+    important("incoming message:\n(%d)(%d)%s\n", r->n, r->m, r->body);
+}
+
+
+/* Use what is in the input buffer.  Returns 1 when we have a whole
+   message (the rest of the buffer is left for the next one), 0 when
+   we have used it all, and -1 if the header is no good. */
+
+int reader_use_input(struct CVM_READER *r)
+{
+    while (r->in_next < r->in_end)
+        {
+            int k = r->in_end - r->in_next;
+            UINT8 *from = r->in + r->in_next;
+
+            if (r->state == RS_HEADER)
                 {
-                    value[n-1] = '\0';
-                    n -= 1;
+                    if (k > 8 - r->header_have) k = 8 - r->header_have;
+                    memcpy(r->header + r->header_have, from, k);
+                    r->in_next += k;
+                    r->header_have += k;
+                    if ((r->header_have == 8) && !reader_header(r))
+                        return(-1);
                 }
+            else if (r->state == RS_SKIP)
+                {
+                    if (k > r->skip) k = r->skip;
+                    r->in_next += k;
+                    r->skip -= k;
+                    if (r->skip == 0) Reset_Reader(r);
+                }
+            else
+                {
+                    if (k > r->n - r->have) k = r->n - r->have;
+                    memcpy(r->body + r->have, from, k);
+                    r->in_next += k;
+                    r->have += k;
+                    reader_tokens(r);
+                    if (r->have == r->n)
+                        {
+                            reader_body_done(r);
+                            return(1);
+                        }
+                }
+        }
+    return(0);
+}
 
-            /* now we have the key and value strings,
-               use them to define the config values */
-            define_config_value(key, value);
+
+/* Read whatever CVM has sent.  Returns 1 when we have a whole
+   message, 0 when we need to wait for more, and -1 if the
+   connection is gone. */
+
+int Read_XML_Message(struct CONNECTION *c)
+{
+    struct CVM_READER *r = &c->reader;
+
+    while (TRUE)
+        {
+            /* first, what we already have */
+            int used = reader_use_input(r);
+            if (used > 0) return(1);
+            if (used < 0)
+                {
+                    close_Client_Connection(c);
+                    return(-1);
+                }
+
+            /* the rest of a long body can go right where it belongs */
+            STRING where = CAST(STRING, r->in);
+            int want = READ_BUFFER_SIZE;
+            if ((r->state == RS_BODY) && (r->n - r->have >= READ_BUFFER_SIZE))
+                {
+                    where = r->body + r->have;
+                    want = r->n - r->have;
+                }
+
+            int rc;
+#ifdef USE_IO_URING
+            if (c->slot >= 0)
+                rc = Ring_Read(c, where, want);
+            else
+#endif
+#ifdef USE_TLS
+            if (c->tls != NULL)
+                {
+                    rc = TLS_Read(c, where, want);
+                    Socket_Reads += 1;
+                }
+            else
+#endif
+                {
+                    rc = recv(c->fd, where, want, MSG_DONTWAIT);
+                    Socket_Reads += 1;
+                }
+            if (rc < 0)
+                {
+                    if (errno == EINTR) continue;
+                    if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return(0);
+                    important("recv() failed for XML\n");
+                    perror("recv");
+                    close_Client_Connection(c);
+                    return(-1);
+                }
+            if (rc == 0)
+                {
+                    /* CVM has closed the connection */
+                    if (r->state == RS_BODY)
+                        important("recv() failed for XML; should have been %d bytes, but only %d\n", r->n, r->have);
+                    else if (r->state == RS_SKIP)
+                        important("connection closed while skipping a message\n");
+                    else if (r->header_have >= 4)
+                        important("message truncated second 4 bytes\n");
+                    else if (r->header_have > 0)
+                        important("message truncated first 4 bytes\n");
+                    close_Client_Connection(c);
+                    return(-1);
+                }
+            Capture(c->id, 'I', where, rc);
+
+            if (where == CAST(STRING, r->in))
+                {
+                    r->in_next = 0;
+                    r->in_end = rc;
+                    continue;
+                }
+
+            r->have += rc;
+            reader_tokens(r);
+            if (r->have == r->n)
+                {
+                    reader_body_done(r);
+                    return(1);
+                }
         }
-    
-    /* close the config file */
-    fclose(cfile);
-    /* and free any line buffer space */
-    line_buffer_length = 0;
-    if (line_buffer != NULL)
+}
+
+
+/* a whole message from the reader; the validator and the fast
+   path have already seen it */
+Boolean Parse_CVM_Message(struct CVM_READER *r, struct RESPONSE_CURSOR *response)
+{
+    Messages_Received += 1;
+
+    if (r->v.state != VS_VALID)
         {
-            free(line_buffer);
-            line_buffer = NULL;
+            Reject_XML_Message(&r->v);
+            return(FALSE);
         }
 
-    /* make sure we have at least one device defined */
-    /* I think we can just check DDD[0], since they
-       are allocated from 0 up. */
-    if ((DDD[0] == NULL) && (DDD[1] == NULL)
-        && (DDD[2] == NULL) && (DDD[3] == NULL))
+    if (r->fp.state == FP_MATCH)
+        return(Answer_Retrieve_Data_Req(&r->fp, response));
+
+    return(Parse_General_XML_Message(r->body, r->n, r->v.elements, response));
+}
+
+
+/* ***************************************************************** */
+
+/* get the next chunk of a queued item to send; FALSE if it is done */
+Boolean next_out_chunk(struct OUT_ITEM *q)
+{
+    if (q->kind != OUT_RESPONSE) return(FALSE);
+
+    if (q->chunk.b == NULL)
         {
-            /* side-effect of the search is to create a DDD entry */
-            (void) search_device_array("default device");
+            q->chunk.b = new_Response_Chunk();
+            q->chunk.length = RESPONSE_BUFFER_SIZE;
         }
-    
-    /* now initialize the Channel_Table. */
-    for (i = 0; i < MAX_CHANNELS; i++)
-        Channel_Table[i] = NULL;
+    q->chunk.n = 0;
+    if (q->chunk.total == 0)
+        {
+            /* the header, which is not part of the length */
+            Format_Message_Header(CAST(UINT8 *, q->chunk.b), q->length);
+            q->chunk.n = 8;
+        }
+    while ((q->chunk.n < RESPONSE_CHUNK_SIZE) && Next_XML_Response_Piece(q->response, &q->chunk))
+        continue;
+    Release_XML_Response_File(q->response);
+    q->data = q->chunk.b;
+    q->n = q->chunk.n;
+    q->sent = 0;
+    return(q->n > 0);
+}
 
-    /* Walk thru the DDD array and make sure that
-       all fields are defined.  If they were not 
-       defined originally, then try to define them from
-       the default device descriptor.  Then use the
-       channels in the DDD array to define the 
-       non-NULL entries in the Channel_Table. */
-    for (i = 0; i < MAX_DETECTORS; i++)
+
+/* Gather what is ready to go.  A response that has more to come is
+   the last thing, as we have only the one chunk of it; *more says
+   whether that is so. */
+
+int gather_out_items(struct CONNECTION *c, struct iovec *iov, Boolean *more)
+{
+    struct OUT_ITEM *q;
+    int k = 0;
+    *more = FALSE;
+    for (q = c->out_head; (q != NULL) && (k < SEND_IOV_MAX); q = q->next)
         {
-            DEVICE d = DDD[i];
-            if (d == NULL) continue;
-            if (d->providerName == NULL)
-                d->providerName = remember_string(default_device.providerName);
-            if (d->resourceType == NULL)
-                d->resourceType = remember_string(default_device.resourceType);
-            if (d->centerId == NULL)
-                d->centerId = remember_string(default_device.centerId);
-            if (d->id == NULL)
-                d->id = remember_string(default_device.id);
-            if (d->triggerHeight == NULL)
-                d->triggerHeight = remember_string(default_device.triggerHeight);
-            if (d->event_channel == -1)
-                d->event_channel = default_device.event_channel;
-            if (d->fault_channel == -1)
-                d->fault_channel = default_device.fault_channel;    
-            if (d->eventFileName == NULL)
-                d->eventFileName = remember_string(default_device.eventFileName);
-            if (d->status == ST_ERROR)
-                d->status = default_device.status;
+            if ((q->sent == q->n) && !next_out_chunk(q)) break;
+            iov[k].iov_base = q->data + q->sent;
+            iov[k].iov_len = q->n - q->sent;
+            k += 1;
+            if ((q->kind == OUT_RESPONSE) && (q->response->phase != RP_DONE))
+                {
+                    *more = TRUE;
+                    break;
+                }
+        }
+    return(k);
+}
 
-            if (Channel_Table[d->event_channel] != NULL)
-                important("both %s and %s use channel %d\n",
-                          Channel_Table[d->event_channel]->name, d->name, d->event_channel);
-            if (Channel_Table[d->fault_channel] != NULL)
-                important("both %s and %s use channel %d\n",
-                          Channel_Table[d->fault_channel]->name, d->name, d->fault_channel);
-            Channel_Table[d->event_channel] = d;
-            Channel_Table[d->fault_channel] = d;            
+/* mark off n bytes, from the front of the queue, as sent */
+void mark_sent(struct CONNECTION *c, int n)
+{
+    struct OUT_ITEM *q;
+    for (q = c->out_head; n > 0; q = q->next)
+        {
+            int m = q->n - q->sent;
+            if (m > n) m = n;
+            Capture(c->id, 'S', q->data + q->sent, m);
+            q->sent += m;
+            n -= m;
         }
-    return(TRUE);
 }
 
 
@@ -1272,379 +5547,920 @@ Boolean Read_Config_File(void)
 /*                                                                   */
 /* ***************************************************************** */
 
-/* used for both reading and writing.  Should be the same for both */
-#define EVENT_FILE_FORMAT "%04lu/%02lu/%02lu %02lu:%02lu:%02lu\n"
+/* TLS.  CVM polls often and reconnects often, and a full handshake
+   costs this CPU tens of milliseconds, so we make each handshake as
+   cheap as we can.  The contexts are made once, at start-up, with
+   the certificate and key already loaded.  The port gives out one
+   session ticket per connection, and a CVM that comes back with it
+   skips the key exchange; when we dial CVM ourselves, we keep the
+   last ticket CVM gave us and offer it the next time.  The counters
+   show how many handshakes we did, how many were resumed, and how
+   much CPU the full and the resumed ones took.
 
+   Reads and writes go through the TLS connection instead of the
+   socket.  A record that SSL_write() cannot send yet must be offered
+   again just as it was, so what is to go out is first copied from
+   the queue into tls_out, and stays there until it has all gone. */
 
-void WriteEventToFile(DEVICE d, struct Timestamp *timedate)
+#ifdef USE_TLS
+
+#define TLS_RECORD_SIZE  16384
+
+SSL_CTX *TLS_Server = NULL;
+SSL_CTX *TLS_Client = NULL;
+SSL_SESSION *Outbound_Session = NULL;
+
+
+void tls_log_errors(STRING what)
 {
-    char szLine[32];
+    unsigned long e;
+    char text[256];
+    while ((e = ERR_get_error()) != 0)
+        {
+            ERR_error_string_n(e, text, sizeof(text));
+            important("%s: %s\n", what, text);
+        }
+}
 
-    /* This line is actually only 21 bytes long, so 32 is plenty of space */
-    snprintf(szLine, sizeof(szLine), EVENT_FILE_FORMAT,
-            timedate->year, timedate->mon, timedate->day,
-            timedate->hour, timedate->min, timedate->sec);
-    if (debug)
-        fprintf(stderr, szLine);
+/* keep the newest ticket from CVM, for the next time we dial */
+int tls_new_session(SSL *tls, SSL_SESSION *session)
+{
+    if (Outbound_Session != NULL) SSL_SESSION_free(Outbound_Session);
+    Outbound_Session = session;
+    return(1);
+}
 
-    /* szLine has newline (/n) at the end, so we don't need another */
-    important("Event for %s at: %s", d->name, szLine);
-    
-    /* open the output event file for write */
-    FileDesc fd = open(d->eventFileName, O_WRONLY|O_CREAT|O_DSYNC, 00664);
-    if (fd < 0)
+
+Boolean Start_TLS(struct CONNECTION *c, STRING host)
+{
+    c->tls = SSL_new((host == NULL) ? TLS_Server : TLS_Client);
+    if ((c->tls == NULL) || !SSL_set_fd(c->tls, c->fd))
         {
-            important("Error open event file: %s\n", d->eventFileName);
-            return;
+            tls_log_errors("SSL_new");
+            return(FALSE);
+        }
+    if (host == NULL)
+        SSL_set_accept_state(c->tls);
+    else
+        {
+            SSL_set_connect_state(c->tls);
+            SSL_set_tlsext_host_name(c->tls, host);
+            if (tlsCAFile != NULL) SSL_set1_host(c->tls, host);
+            if (Outbound_Session != NULL) SSL_set_session(c->tls, Outbound_Session);
         }
+    c->handshaking = TRUE;
+    c->tls_out = CAST(STRING, malloc(TLS_RECORD_SIZE));
+    c->tls_out_n = 0;
+    return(TRUE);
+}
 
-    /* write the event file output line */
-    int n = write(fd, szLine, 1+strlen(szLine));
-    if (n <= 0)
+void Finish_TLS_Connection(struct CONNECTION *c)
+{
+    if (c->tls == NULL) return;
+
+    /* say goodbye properly, or the session cannot be resumed */
+    if (!c->handshaking) SSL_shutdown(c->tls);
+    SSL_free(c->tls);
+    c->tls = NULL;
+    free(c->tls_out);
+    c->tls_out = NULL;
+    c->tls_out_n = 0;
+}
+
+
+/* Take the handshake as far as it will go.  Returns FALSE if the
+   connection has been closed. */
+Boolean TLS_Handshake(struct CONNECTION *c)
+{
+    struct timespec start, end;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+    int rc = SSL_do_handshake(c->tls);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+    COUNTER us = (end.tv_sec - start.tv_sec) * 1000000LL + (end.tv_nsec - start.tv_nsec) / 1000;
+
+    Boolean resumed = SSL_session_reused(c->tls);
+    if (resumed)
+        TLS_Resumed_CPU += us;
+    else
+        TLS_Full_CPU += us;
+
+    if (rc == 1)
         {
-            important("Error write event file: %s\n", d->eventFileName);
+            c->handshaking = FALSE;
+            TLS_Handshakes += 1;
+            if (resumed) TLS_Resumed += 1;
+            important("TLS on FD %d: %s %s%s\n", c->fd, SSL_get_version(c->tls),
+                      SSL_get_cipher_name(c->tls), (resumed ? ", resumed" : ""));
+            return(TRUE);
         }
-    
-    /* flush and close the file */
-    /*  syncfs(fd); */
-    
-    close(fd);
+
+    int e = SSL_get_error(c->tls, rc);
+    if ((e == SSL_ERROR_WANT_READ) || (e == SSL_ERROR_WANT_WRITE)) return(TRUE);
+
+    important("TLS handshake fails on FD %d\n", c->fd);
+    tls_log_errors("TLS");
+    TLS_Failures += 1;
+    close_Client_Connection(c);
+    return(FALSE);
 }
 
-Boolean ReadEventFromFile(DEVICE d, struct Timestamp *timedate)
+
+/* like recv(): -1 with errno EAGAIN when there is nothing yet, and
+   0 when the other end has closed */
+int TLS_Read(struct CONNECTION *c, STRING where, int want)
 {
-    Boolean dataexists = TRUE;
-    
-    /* open the output log file for read */
-    FileDesc fd = open(d->eventFileName, O_RDONLY);
-    if (fd < 0)
+    int rc = SSL_read(c->tls, where, want);
+    if (rc > 0) return(rc);
+
+    switch (SSL_get_error(c->tls, rc))
         {
-            important("Error open file: %s\n", d->eventFileName);
-            dataexists = FALSE;
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            return(-1);
+        case SSL_ERROR_ZERO_RETURN:
+            return(0);
+        case SSL_ERROR_SYSCALL:
+            if (errno == 0) return(0);
+            return(-1);
+        default:
+            tls_log_errors("SSL_read");
+            errno = EPROTO;
+            return(-1);
         }
-    else
+}
+
+
+/* Send the record in tls_out, first filling it from the queue if it
+   is empty.  Returns 1 if it has gone, 0 if we must wait for room,
+   2 if there was nothing to send, and -1 if the connection has been
+   closed. */
+int TLS_Write(struct CONNECTION *c)
+{
+    if (c->tls_out_n == 0)
         {
-            /* read the log file output line */
-            char szLine[MAX_FILENAME_LENGTH];
-            int n = read(fd, szLine, sizeof(szLine)-1);
-            if (n <= 0)
+            struct iovec iov[SEND_IOV_MAX];
+            Boolean more;
+            int k = gather_out_items(c, iov, &more);
+            int i;
+            for (i = 0; i < k; i++)
                 {
-                    important("Error read file: %s\n", d->eventFileName);
-                    dataexists = FALSE;
+                    int n = iov[i].iov_len;
+                    if (n > TLS_RECORD_SIZE - c->tls_out_n) n = TLS_RECORD_SIZE - c->tls_out_n;
+                    memcpy(c->tls_out + c->tls_out_n, iov[i].iov_base, n);
+                    c->tls_out_n += n;
                 }
-            else
+            if (c->tls_out_n == 0) return(2);
+            mark_sent(c, c->tls_out_n);
+        }
+
+    int rc = SSL_write(c->tls, c->tls_out, c->tls_out_n);
+    Socket_Writes += 1;
+    if (rc > 0)
+        {
+            c->tls_out_n = 0;
+            c->stalled_since = 0;
+            c->last_sent = time(NULL);
+            return(1);
+        }
+
+    int e = SSL_get_error(c->tls, rc);
+    if ((e == SSL_ERROR_WANT_WRITE) || (e == SSL_ERROR_WANT_READ))
+        {
+            /* full; wait for room */
+            Write_Stalls += 1;
+            if (c->stalled_since == 0) c->stalled_since = time(NULL);
+            return(0);
+        }
+    important("TLS send of %d bytes fails\n", c->tls_out_n);
+    tls_log_errors("SSL_write");
+    close_Client_Connection(c);
+    return(-1);
+}
+
+
+void Setup_TLS(void)
+{
+    if (!useTLS) return;
+
+    /* a client that goes away while we write must not kill us */
+    signal(SIGPIPE, SIG_IGN);
+
+    TLS_Server = SSL_CTX_new(TLS_server_method());
+    TLS_Client = SSL_CTX_new(TLS_client_method());
+    if ((TLS_Server == NULL) || (TLS_Client == NULL))
+        {
+            tls_log_errors("SSL_CTX_new");
+            exit(-1);
+        }
+
+    /* Our framing finds a message cut short, so a peer that just
+       closes, without close_notify, has closed; taking that as an
+       error would also throw its session away. */
+    SSL_CTX_set_options(TLS_Server, SSL_OP_IGNORE_UNEXPECTED_EOF);
+    SSL_CTX_set_options(TLS_Client, SSL_OP_IGNORE_UNEXPECTED_EOF);
+
+    SSL_CTX_set_min_proto_version(TLS_Server, TLS1_2_VERSION);
+    SSL_CTX_set_mode(TLS_Server, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    if ((tlsCertificate == NULL) || (tlsPrivateKey == NULL)
+        || (SSL_CTX_use_certificate_chain_file(TLS_Server, tlsCertificate) != 1)
+        || (SSL_CTX_use_PrivateKey_file(TLS_Server, tlsPrivateKey, SSL_FILETYPE_PEM) != 1)
+        || (SSL_CTX_check_private_key(TLS_Server) != 1))
+        {
+            important("cannot use TLS certificate %s with key %s\n",
+                      (tlsCertificate ? tlsCertificate : "(none)"),
+                      (tlsPrivateKey ? tlsPrivateKey : "(none)"));
+            tls_log_errors("TLS");
+            exit(-1);
+        }
+    /* resumption: tickets for TLS 1.3, and the session cache for 1.2 */
+    SSL_CTX_set_session_cache_mode(TLS_Server, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_session_id_context(TLS_Server, CAST(const unsigned char *, "overhead"), 8);
+    SSL_CTX_set_num_tickets(TLS_Server, 1);
+
+    SSL_CTX_set_min_proto_version(TLS_Client, TLS1_2_VERSION);
+    SSL_CTX_set_mode(TLS_Client, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    SSL_CTX_set_session_cache_mode(TLS_Client, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(TLS_Client, tls_new_session);
+    if (tlsCAFile != NULL)
+        {
+            if (SSL_CTX_load_verify_locations(TLS_Client, tlsCAFile, NULL) != 1)
                 {
-                    szLine[n] = '\0';
+                    important("cannot load TLS CA file %s\n", tlsCAFile);
+                    tls_log_errors("TLS");
+                    exit(-1);
                 }
-            close(fd);
-            
-            if (dataexists)
+            SSL_CTX_set_verify(TLS_Client, SSL_VERIFY_PEER, NULL);
+        }
+}
+
+void Finish_TLS(void)
+{
+    if (Outbound_Session != NULL) SSL_SESSION_free(Outbound_Session);
+    Outbound_Session = NULL;
+    if (TLS_Server != NULL) SSL_CTX_free(TLS_Server);
+    if (TLS_Client != NULL) SSL_CTX_free(TLS_Client);
+    TLS_Server = NULL;
+    TLS_Client = NULL;
+}
+
+#else /* USE_TLS */
+
+void Setup_TLS(void)
+{
+    if (!useTLS) return;
+    important("useTLS is set, but this program was built without TLS\n");
+    exit(-1);
+}
+
+void Finish_TLS(void)
+{
+}
+
+#endif /* USE_TLS */
+
+
+
+/* ***************************************************************** */
+
+/* Send what we can of what is queued for a client, without waiting.
+   Everything that is ready -- messages, the next chunk of a
+   response -- goes in one sendmsg() (or, over TLS, one record).  If
+   the socket fills up, we will be called again when it has room.
+   Returns FALSE if the connection has been closed. */
+
+Boolean Flush_Connection(struct CONNECTION *c)
+{
+#ifdef USE_TLS
+    if ((c->tls != NULL) && c->handshaking) return(TRUE);
+#endif
+
+    while (TRUE)
+        {
+            /* let go of what has all been sent */
+            struct OUT_ITEM *q;
+            while (((q = c->out_head) != NULL) && (q->sent == q->n) && !next_out_chunk(q))
                 {
-                    /* get the time and date in the right formats */
-                    int n = sscanf(szLine, EVENT_FILE_FORMAT,
-                                   &timedate->year, &timedate->mon, &timedate->day,
-                                   &timedate->hour, &timedate->min, &timedate->sec);
-                    if (n != 6)
+                    c->out_head = q->next;
+                    if (c->out_head == NULL) c->out_tail = NULL;
+                    Boolean whole = (q->kind != OUT_RESPONSE) || (q->chunk.total == q->length);
+                    if (!whole)
+                        important("response was %d bytes, not %d\n", q->chunk.total, q->length);
+                    Forget_Out_Item(c, q, whole);
+                    if (!whole)
                         {
-                            important("data in %s of wrong format (%s)\n",
-                                      d->eventFileName, szLine);
-                            dataexists = FALSE;
+                            close_Client_Connection(c);
+                            return(FALSE);
                         }
                 }
+
+#ifdef USE_TLS
+            if (c->tls != NULL)
+                {
+                    int sent = TLS_Write(c);
+                    if (sent < 0) return(FALSE);
+                    if (sent == 0) return(TRUE);
+                    if (sent == 2) break;
+                    continue;
+                }
+#endif
+            if (c->out_head == NULL) break;
+#ifdef USE_IO_URING
+            if (c->slot >= 0) return(Ring_Send(c));
+#endif
+
+            struct iovec iov[SEND_IOV_MAX];
+            Boolean more;
+            int k = gather_out_items(c, iov, &more);
+            int total = 0;
+            int i;
+            for (i = 0; i < k; i++) total += iov[i].iov_len;
+
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = k;
+            int flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+            if (more && tcpCork) flags |= MSG_MORE;
+
+            int rc = sendmsg(c->fd, &msg, flags);
+            Socket_Writes += 1;
+            if (rc < 0)
+                {
+                    if (errno == EINTR) continue;
+                    if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+                        {
+                            /* full; wait for room */
+                            Write_Stalls += 1;
+                            if (c->stalled_since == 0) c->stalled_since = time(NULL);
+                            return(TRUE);
+                        }
+                    important("send of %d bytes fails\n", total);
+                    perror("sendmsg");
+                    close_Client_Connection(c);
+                    return(FALSE);
+                }
+            if (rc < total) Partial_Writes += 1;
+            c->stalled_since = 0;
+            c->last_sent = time(NULL);
+            mark_sent(c, rc);
         }
-    return(dataexists);
+    c->stalled_since = 0;
+    return(TRUE);
 }
 
+void Forget_Out_Item(struct CONNECTION *c, struct OUT_ITEM *q, Boolean sent)
+{
+    c->queued_messages -= 1;
+    c->queued_bytes -= q->size;
+    Queued_Memory -= q->size;
+    Free_Out_Item(q, sent);
+}
 
-/* ***************************************************************** */
-/*                                                                   */
-/*                                                                   */
-/* ***************************************************************** */
-
-/* to send messages, we need to build them up, one string at a time 
-   until we have the entire message.  That way, we know how long they
-   are, which we need when we send them.  To make this easy, we define
-   a buffer structure and a function to add a string to the end of the
-   buffer.  When you are done, we will give you a pointer to the
-   buffer contents. */
-/* the buffer grows as needed for the messages, but we keep the old
-   buffer around, so that once we allocate the memory, we just keep
-   re-using it. */
+Boolean over_queue_limits(struct CONNECTION *c, int size, int messages)
+{
+    return((c->queued_messages + messages > maxQueuedMessages)
+           || (c->queued_bytes + size > maxQueuedBytes)
+           || (Queued_Memory + size > networkMemoryLimit));
+}
 
-struct BUFFER
+/* drop the oldest status updates until there is room */
+void drop_status_updates(struct CONNECTION *c, int size, int messages)
 {
-    int  n;
-    int  length;
-    STRING b;
-};
+    struct OUT_ITEM *prev = NULL;
+    struct OUT_ITEM *q = c->out_head;
+#ifdef USE_IO_URING
+    /* not what the kernel is sending */
+    int i;
+    for (i = 0; (i < c->sending) && (q != NULL); i++)
+        {
+            prev = q;
+            q = q->next;
+        }
+#endif
+    while ((q != NULL) && over_queue_limits(c, size, messages))
+        {
+            struct OUT_ITEM *next = q->next;
+            if (!q->droppable || (q->sent > 0))
+                {
+                    prev = q;
+                    q = next;
+                    continue;
+                }
 
-struct BUFFER b = { 0, 0, NULL };
+            if (prev == NULL)
+                c->out_head = next;
+            else
+                prev->next = next;
+            if (c->out_tail == q) c->out_tail = prev;
+            Queue_Drops += 1;
+            Forget_Out_Item(c, q, FALSE);
+            q = next;
+        }
+}
 
-struct BUFFER *ClearBuffer(void)
+/* Put an item on a connection's queue, within the limits.  Returns
+   FALSE if the connection had to be closed instead. */
+Boolean Queue_Out_Item(struct CONNECTION *c, struct OUT_ITEM *q)
 {
-    /* clear the buffer for new use */
-    if (b.length <= 0)
+    if (q->kind == OUT_RESPONSE)
+        q->size = sizeof(struct RESPONSE_CURSOR) + RESPONSE_BUFFER_SIZE;
+    else
+        q->size = q->n;
+
+    if (over_queue_limits(c, q->size, 1) && (queuePolicy == QP_DROP))
+        drop_status_updates(c, q->size, 1);
+    if (over_queue_limits(c, q->size, 1))
         {
-            b.length = 1024;
-            b.b = CAST(STRING, malloc(b.length));
+            if ((queuePolicy == QP_DROP) && q->droppable)
+                {
+                    Queue_Drops += 1;
+                    Free_Out_Item(q, FALSE);
+                    return(TRUE);
+                }
+            important("client on FD %d is too far behind: %d messages, %d bytes queued\n",
+                      c->fd, c->queued_messages, c->queued_bytes);
+            Queue_Disconnects += 1;
+            Free_Out_Item(q, FALSE);
+            close_Client_Connection(c);
+            return(FALSE);
         }
-    b.n = 0;
-    b.b[b.n] = '\0';
-    return(&b);
+
+    c->queued_messages += 1;
+    c->queued_bytes += q->size;
+    Queued_Memory += q->size;
+    if (Queued_Memory > Queued_Memory_Peak) Queued_Memory_Peak = Queued_Memory;
+
+    q->next = NULL;
+    if (c->out_tail == NULL)
+        c->out_head = q;
+    else
+        c->out_tail->next = q;
+    c->out_tail = q;
+    return(TRUE);
 }
 
-void AppendBuffer(struct BUFFER *b, STRING s)
+
+/* queue a reference to a shared message, and send what we can */
+Boolean Queue_Shared_Message(struct CONNECTION *c, struct SHARED_MESSAGE *m)
 {
-    if ((s == NULL) || (*s == '\0')) return;
-    
-    int n = strlen(s);
-    /* check that we have room for the string */
-    if ((b->n + n + 1) > b->length)
+    struct OUT_ITEM *q = new_Out_Item(OUT_SHARED);
+    m->refs += 1;
+    q->shared = m;
+    q->droppable = m->droppable;
+    q->data = m->data;
+    q->n = m->n;
+    Bytes_Queued += q->n;
+
+    if (!Queue_Out_Item(c, q)) return(FALSE);
+    return(Flush_Connection(c));
+}
+
+
+/* queue a response (the connection now owns the cursor) and send
+   what we can */
+Boolean Queue_XML_Response(struct CONNECTION *c, struct RESPONSE_CURSOR *rc)
+{
+    /* first find out how long the response is, and log it */
+    char window[RESPONSE_CHUNK_SIZE];
+    struct BUFFER logging = { 0, sizeof(window), window, BM_LOG, 0 };
+    Rewind_XML_Response(rc);
+    while (Next_XML_Response_Piece(rc, &logging)) continue;
+    int n = logging.total;
+
+    important("outgoing message:\n(%d)(%d)", n, 0);
+    FlushBuffer(&logging);
+    Log_Raw("\n", 1);
+
+    /* then the response, to be generated again as we send it, with
+       its header */
+    struct OUT_ITEM *q = new_Out_Item(OUT_RESPONSE);
+    q->response = rc;
+    q->length = n;
+    q->chunk.n = 0;
+    q->chunk.length = 0;
+    q->chunk.b = NULL;
+    q->chunk.mode = BM_GROW;
+    q->chunk.total = 0;
+    q->n = 0;
+    q->sent = 0;
+    Rewind_XML_Response(rc);
+    Bytes_Queued += n + 8;
+
+    if (!Queue_Out_Item(c, q)) return(FALSE);
+    return(Flush_Connection(c));
+}
+
+
+/* A client that has not taken anything we sent for this long is
+   given up on.  We check once a second. */
+#define SEND_TIMEOUT  10  /* seconds */
+
+void Check_Send_Timeouts(void)
+{
+    time_t now = time(NULL);
+    int i;
+    for (i = 0; i < MAX_CLIENTS; i++)
         {
-            b->length = 2*b->length;
-            b->b = CAST(STRING, realloc(b->b, b->length));
+            struct CONNECTION *c = Connections[i];
+            if ((c == NULL) || (c->stalled_since == 0)) continue;
+            if (now - c->stalled_since < SEND_TIMEOUT) continue;
+
+            Send_Timeouts += 1;
+            important("send timed out on FD %d\n", c->fd);
+            close_Client_Connection(c);
         }
-    /* copy the string to the end */
+}
+
+/* Responses read the detectors and their event files as they go, so
+   when the config file is read again, any that are part way thru
+   have to be abandoned, and with them their connections (which are
+   part way thru a message).  The others start again from what is in
+   the event files. */
+void Abandon_Responses(void)
+{
     int i;
-    for (i = 0; i < n; i++)
+    for (i = 0; i < MAX_CLIENTS; i++)
         {
-            b->b[b->n] = s[i];
-            b->n += 1;
+            struct CONNECTION *c = Connections[i];
+            if (c == NULL) continue;
+
+            struct OUT_ITEM *q;
+            for (q = c->out_head; q != NULL; q = q->next)
+                if (q->kind == OUT_RESPONSE) break;
+            if (q == NULL)
+                {
+                    Reset_Event_Reader(&c->events);
+                    continue;
+                }
+
+            important("config changed while sending a response\n");
+            close_Client_Connection(c);
         }
-    /* terminate the new string */
-    b->b[b->n] = '\0';
 }
 
-void QAppendBuffer(struct BUFFER *b, STRING s)
+
+/* an update for a new event, or (event FALSE) for a change of status */
+void WriteXMLMessageToServer(DEVICE d, struct Timestamp *timedate, Boolean dataexists, Boolean event)
 {
-    AppendBuffer(b,"\"");
-    AppendBuffer(b,s);    
-    AppendBuffer(b,"\"");    
+    /* create an XML overheight data message, once, and send it */
+    struct BUFFER *buffer = Build_One_Event_Message(d, timedate, dataexists);
+    important("outgoing message:\n(%d)(%d)%s\n", buffer->n, 0, buffer->b);
+    struct SHARED_MESSAGE *m = New_Shared_Message(buffer->b, buffer->n);
+    m->droppable = !event;
+
+    /* every client gets it (one of them should be CVM) */
+    int i;
+    for (i = 0; i < MAX_CLIENTS; i++)
+        {
+            struct CONNECTION *c = Connections[i];
+            if (c == NULL) continue;
+            if (!Queue_Shared_Message(c, m))
+                important("XML event message fails\n");
+        }
+    Release_Shared_Message(m);
 }
 
 
-STRING FinishBuffer(struct BUFFER *b)
+/* returns FALSE if the connection has been closed */
+Boolean Reply_to_CVM(struct CONNECTION *c)
 {
-    if (b->b == NULL) return(NULL);
-    STRING s = remember_string(b->b);
-    return(s);
-}
+    struct RESPONSE_CURSOR *response = TYPED_MALLOC(struct RESPONSE_CURSOR);
+    response->reader = &c->events;
+
+    Boolean reply = Parse_CVM_Message(&c->reader, response);
+            
+    if (!reply)
+        {
+            important("XML message does not require response\n");                    
+            free(response);
+            return(TRUE);
+        }
 
+    if (!Queue_XML_Response(c, response))
+        {
+            important("XML response message fails\n");
+            return(FALSE);
+        }
+    return(TRUE);
+}
 
-/* ***************************************************************** */
-/*                                                                   */
-/*                                                                   */
-/* ***************************************************************** */
 
-/* we want to create, in memory, in a buffer, the complete message
-   (so we know how long it is). */
+void Read_and_Reply_to_CVM(struct CONNECTION *c)
+{
+    /* answer each message as soon as we have all of it */
+    while (TRUE)
+        {
+            if (Read_XML_Message(c) <= 0) return;
+            COUNTER start = Microseconds();
+            Boolean open = Reply_to_CVM(c);
+            Count_Time(&Reply_Times, start);
+            if (!open) return;
+            Reset_Reader(&c->reader);
+        }
+}
 
-/* There are two XML messages we create: the response and the update messages. 
-   Most of those are the same, so we use a couple of routines to do the
-   formatting. */
 
-void AppendHeader(struct BUFFER *buffer, STRING MyRefId, STRING icdVersion)
+/* a client has sent us something, has room for more of what we
+   are sending, or has gone away */
+void Client_Ready(struct SOURCE *s, UINT32 events)
 {
-    AppendBuffer(buffer, "<refId>");
-    AppendBuffer(buffer, MyRefId);
-    AppendBuffer(buffer, "</refId>");
-    AppendBuffer(buffer, "<icdVersion>");
-    AppendBuffer(buffer, icdVersion);
-    AppendBuffer(buffer, "</icdVersion>");
+    struct CONNECTION *c = CAST(struct CONNECTION *, s);
+    if (c->fd == INVALID_SOCKET) return;
+#ifdef USE_TLS
+    if ((c->tls != NULL) && c->handshaking)
+        {
+            if (!TLS_Handshake(c) || c->handshaking) return;
+            /* secure now; see what there is, either way */
+            events |= EPOLLIN | EPOLLOUT;
+        }
+#endif
+    if ((events & EPOLLOUT) && !Flush_Connection(c)) return;
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+        Read_and_Reply_to_CVM(c);
 }
 
-void AppendId(struct BUFFER *buffer, DEVICE d)
+
+/* as set in the config file */
+void Set_Client_Socket_Options(FileDesc fd)
 {
-    AppendBuffer(buffer, "<id");
-    AppendBuffer(buffer, " providerName=");
-    QAppendBuffer(buffer, d->providerName);
-    AppendBuffer(buffer, " resourceType=");
-    QAppendBuffer(buffer, d->resourceType);
-    AppendBuffer(buffer, " centerId=");
-    QAppendBuffer(buffer, d->centerId);
-    AppendBuffer(buffer, ">");
-    AppendBuffer(buffer, d->id);    
-    AppendBuffer(buffer, "</id>");
+    int on = tcpNoDelay ? 1 : 0;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0)
+        important("cannot set TCP_NODELAY on FD %d: %d\n", fd, errno);
+    if ((sendBufferSize > 0)
+        && (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sendBufferSize, sizeof(sendBufferSize)) < 0))
+        important("cannot set SO_SNDBUF on FD %d: %d\n", fd, errno);
 }
 
-void AppendOverheight(struct BUFFER *buffer, DEVICE d, struct Timestamp *timedate, Boolean dataexists)
+
+#ifdef USE_IO_URING
+
+/* With io_uring, a plain client is not watched; instead, a read is
+   kept waiting for it on the ring, into its slot of Ring_Input, and
+   what is queued for it goes in one sendmsg request at a time.  The
+   requests go to the kernel along with the wait, so a round in which
+   many clients are read and answered is one system call, not one
+   for each recv() and each sendmsg().  Ring_Input is registered with
+   the kernel once, so a read does not have to pin its buffer.  What
+   a read gets is taken from the slot as the reader wants it, just
+   as recv() would have given it.  A TLS client is watched as usual:
+   OpenSSL does its own reading and writing. */
+
+UINT8 Ring_Input[MAX_CLIENTS][READ_BUFFER_SIZE];
+Boolean Ring_Input_Registered = FALSE;
+
+void Setup_Client_Ring(void)
 {
-    STRING opStatus = Format_Device_Status(d->status);
-    
-    AppendBuffer(buffer, "<overheight>");
-    if (dataexists)
+    struct iovec v;
+    v.iov_base = Ring_Input;
+    v.iov_len = sizeof(Ring_Input);
+    if (syscall(__NR_io_uring_register, Ring.fd, IORING_REGISTER_BUFFERS, &v, 1) < 0)
         {
-            char readingTime[16];
-            char readingDate[16];
-            snprintf(readingTime, sizeof(readingTime), "%02lu:%02lu:%02lu",
-                     timedate->hour, timedate->min, timedate->sec);
-            snprintf(readingDate, sizeof(readingDate), "%04lu-%02lu-%02lu",
-                     timedate->year, timedate->mon, timedate->day);
-
-            AppendBuffer(buffer, "<overheightReadingData>");
-            AppendBuffer(buffer, "<readingTime>");
-            AppendBuffer(buffer, readingTime);
-            AppendBuffer(buffer, "</readingTime>");
-            AppendBuffer(buffer, "<readingDate>");
-            AppendBuffer(buffer, readingDate);
-            AppendBuffer(buffer, "</readingDate>");
-            AppendBuffer(buffer, "<triggerHeight units=");
-            QAppendBuffer(buffer, "in");
-            AppendBuffer(buffer, ">");                        
-            AppendBuffer(buffer, d->triggerHeight);
-            AppendBuffer(buffer, "</triggerHeight>");
-            AppendBuffer(buffer, "</overheightReadingData>");
+            important("cannot register client buffers: %d; clients are watched\n", errno);
+            return;
         }
-    AppendBuffer(buffer, "<overheightStatus>");
-    AppendBuffer(buffer, "<opStatus>");
-    AppendBuffer(buffer, opStatus);
-    AppendBuffer(buffer, "</opStatus>");
-    AppendBuffer(buffer, "</overheightStatus>");
-    AppendBuffer(buffer, "</overheight>");
+    Ring_Input_Registered = TRUE;
 }
 
+int take_ring_slot(void)
+{
+    if (!Ring_Input_Registered) return(-1);
+    int i;
+    for (i = 0; i < MAX_CLIENTS; i++)
+        if (!Ring_Slot_Used[i])
+            {
+                Ring_Slot_Used[i] = TRUE;
+                return(i);
+            }
+    return(-1);
+}
 
-/* we have an event and want to send a message saying so.
-   The XML message looks like:
-
-<overheightUpdateMsg>
-	<refId> aaa </refId>
-	<icdVersion> bbb </icdVersion>
-	<id>
-		<providerName> fff1 </providerName>
-		<resourceType> fff2 </resourceType>
-		<centerId> fff3 </centerId>
-	</id>
-	<overheight>
-		<overheightStatus>
-			<opStatus> ggg </opStatus>
-		</overheightStatus>
-		<overheightReadingData>
-		    <readingTime> iii </readingTime>
-			<readingDate> jjj </readingDate>
-			<triggerHeight> kkk </triggerHeight>
-	    </overheightReadingData>
-	</overheight>
-</overheightUpdateMsg>
-*/
-
-STRING Format_One_Event_Message(DEVICE d, struct Timestamp *timedate, Boolean dataexists)
+unsigned long long ring_client_data(struct CONNECTION *c, unsigned long long which)
 {
-    /* first get STRING forms of the important things */
-    char MyRefId[16];
+    return(RING_CLIENT | CAST(unsigned long long, CAST(unsigned long, c)) | which);
+}
 
-    myRefId += 1;
-    snprintf(MyRefId, sizeof(MyRefId), "%d", myRefId);
-    
-    struct BUFFER *buffer = ClearBuffer();
-    AppendBuffer(buffer, "<overheightUpdateMsg>");
-    AppendHeader(buffer, MyRefId, icdVersion);
-    AppendId(buffer, d);
-    AppendOverheight(buffer, d, timedate, dataexists);
-    AppendBuffer(buffer, "</overheightUpdateMsg>");
-    STRING b = FinishBuffer(buffer);
-    return(b);
+void ring_read(struct CONNECTION *c)
+{
+    struct io_uring_sqe *e = ring_sqe(&Ring);
+    e->opcode = IORING_OP_READ_FIXED;
+    e->fd = c->fd;
+    e->addr = CAST(unsigned long, Ring_Input[c->slot]);
+    e->len = READ_BUFFER_SIZE;
+    e->buf_index = 0;
+    e->user_data = ring_client_data(c, RING_READ);
+    c->reading = TRUE;
+    Socket_Reads += 1;
 }
 
+/* as recv() would be, from what the last read got */
+int Ring_Read(struct CONNECTION *c, STRING where, int want)
+{
+    int k = c->ring_end - c->ring_next;
+    if (k > 0)
+        {
+            if (k > want) k = want;
+            memcpy(where, Ring_Input[c->slot] + c->ring_next, k);
+            c->ring_next += k;
+            return(k);
+        }
 
-/* ***************************************************************** */
-/*                                                                   */
-/*                                                                   */
-/* ***************************************************************** */
+    int last = c->ring_last;
+    c->ring_last = 1;
+    if (last == 0) return(0);
+    if (last < 0)
+        {
+            errno = -last;
+            return(-1);
+        }
 
-/* we expect a request message that looks like:
-   
-   <retrieveDataReq>
-   <refId> aaa </refId>
-   <icdVersion> bbb </icdVersion>
-   <overheightData> TRUE </overheightData>
-   </retrieveDataReq>
-   
-   We need to keep the refId, and icdVersion,
-   and knowledge that overheightData is true.
+    if (!c->reading) ring_read(c);
+    errno = EAGAIN;
+    return(-1);
+}
 
-   I guess the way to do it is to define a
-   set of key/value pairs.  When we get an
-   actual value, we define the tag as the
-   key and store the value as a STRING.
+/* send what is ready, unless a send is still going */
+Boolean Ring_Send(struct CONNECTION *c)
+{
+    if (c->sending > 0) return(TRUE);
+
+    Boolean more;
+    int k = gather_out_items(c, c->iov, &more);
+    if (k == 0) return(TRUE);
+    memset(&c->msg, 0, sizeof(c->msg));
+    c->msg.msg_iov = c->iov;
+    c->msg.msg_iovlen = k;
+
+    struct io_uring_sqe *e = ring_sqe(&Ring);
+    e->opcode = IORING_OP_SENDMSG;
+    e->fd = c->fd;
+    e->addr = CAST(unsigned long, &c->msg);
+    e->len = 1;
+    e->msg_flags = MSG_NOSIGNAL;
+    if (more && tcpCork) e->msg_flags |= MSG_MORE;
+    e->user_data = ring_client_data(c, RING_SEND);
+    c->sending = k;
+    Socket_Writes += 1;
+
+    /* the kernel waits for room; if it waits too long, we give up */
+    if (c->stalled_since == 0) c->stalled_since = time(NULL);
+    return(TRUE);
+}
 
-   In general, we build a tree of
-   key/value pair lists.  A leaf of the
-   tree is a key/value pair.
-   Interior nodes of the tree just
-   have a key and a pointer to another
-   node.
+void ring_send_done(struct CONNECTION *c, int res)
+{
+    int total = 0;
+    int i;
+    for (i = 0; i < c->sending; i++) total += c->iov[i].iov_len;
+    c->sending = 0;
+    c->stalled_since = 0;
+    if (c->fd == INVALID_SOCKET) return;
 
-*/
-/* for parsing an incoming XML message, we will need a tree.
-   The tree is either a key/value pair, or a key
-   and a pointer to another node. We don't use both
-   value and xml_list at the same time (they could be
-   a union to save space, but that really seems like
-   over-kill.
-*/
+    if (res < 0)
+        {
+            important("send of %d bytes fails: %d\n", total, -res);
+            close_Client_Connection(c);
+            return;
+        }
+    if (res < total) Partial_Writes += 1;
+    c->last_sent = time(NULL);
+    mark_sent(c, res);
+    (void)Flush_Connection(c);
+}
 
-struct xml_element
+void Ring_Client_Done(unsigned long long data, int res)
 {
-    struct xml_element *next /* peer nodes */;
-    STRING key;
+    struct CONNECTION *c = CAST(struct CONNECTION *,
+                                CAST(unsigned long, data & ~(RING_CLIENT | RING_READ | RING_SEND)));
+    Boolean closed = (c->fd == INVALID_SOCKET);
+    if (data & RING_READ)
+        {
+            c->reading = FALSE;
+            if (res > 0)
+                {
+                    c->ring_next = 0;
+                    c->ring_end = res;
+                }
+            else
+                c->ring_last = res;
+            if (c->fd != INVALID_SOCKET) Read_and_Reply_to_CVM(c);
+        }
+    else
+        ring_send_done(c, res);
 
-    /* the "value" is either a string, or another XML element */
-    struct xml_element *xml_list /* child node */;
-    STRING value;
-};
+    /* closed before, and now the kernel is done with it too (one
+       closed just now was let go of then, if it could be) */
+    if (closed && !c->reading && (c->sending == 0))
+        release_Client_Connection(c);
+}
 
+#endif /* USE_IO_URING */
 
-STRING search_xml_value(struct xml_element *list, STRING key)
+/* start reading (and sending to) a new client */
+void Start_Client_IO(struct CONNECTION *c)
 {
-    struct xml_element *p;
-    p = list;
-    while (p != NULL)
+    c->source.ready = Client_Ready;
+#ifdef USE_IO_URING
+    Boolean plain = TRUE;
+#ifdef USE_TLS
+    plain = (c->tls == NULL);
+#endif
+    if (plain) c->slot = take_ring_slot();
+    if (c->slot >= 0)
         {
-            if (mystrcasecmp(key, p->key))
-                return(p->value);
-            p = p->next;
+            ring_read(c);
+            return;
         }
-    return(NULL);
+#endif
+    /* we read (and send) until there is nothing left, so we only
+       need to hear when more comes in (or room opens up) */
+    Watch(&c->source, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
 }
 
-void dump_xml_element(struct xml_element *root, int level)
+
+/* take all the clients that are waiting to connect */
+void Accept_Clients(struct SOURCE *s, UINT32 events)
 {
-    int i;
-    struct xml_element *element;
-    
-    for (element = root; element != NULL; element = element->next)
+    while (TRUE)
         {
-            if (element->value == NULL)
+            struct sockaddr_in  from;
+            socklen_t   len = sizeof (from);
+    
+            FileDesc fd = accept4(ServerConnection, (struct sockaddr *)&from, &len,
+                                  SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0)
                 {
-                    for (i = 0; i < level; i++) fprintf(stderr, "    ");
-                    fprintf(stderr, "%s:\n", element->key);
-                    dump_xml_element(element->xml_list, level+1);
+                    if (errno == EINTR) continue;
+                    if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+                        important("NewConnection: error %d\n", errno);
+                    return;
                 }
-            else
+
+            struct CONNECTION *c = NULL;
+            if (Client_Count < maxClients) c = new_Client_Connection(fd);
+            if (c != NULL) Set_Client_Socket_Options(fd);
+#ifdef USE_TLS
+            if ((c != NULL) && useTLS && !Start_TLS(c, NULL))
                 {
-                    for (i = 0; i < level; i++) fprintf(stderr, "    ");                    
-                    fprintf(stderr, "%s: %s\n", element->key, element->value);
+                    close_Client_Connection(c);
+                    continue;
+                }
+#endif
+            if (c == NULL)
+                {
+                    important("too many clients (%d); refuse FD %d from %s\n",
+                              Client_Count, fd, inet_ntoa(from.sin_addr));
+                    close(fd);
+                    continue;
                 }
+
+            Start_Client_IO(c);
+
+            important("Connect To Client: FD %d from %s (%d clients)\n",
+                      fd, inet_ntoa(from.sin_addr), Client_Count);
         }
 }
 
-void free_xml_element(struct xml_element *root)
+
+/* ***************************************************************** */
+/*                                                                   */
+/*                                                                   */
+/* ***************************************************************** */
+
+void Setup_for_Network_Requests(void)
 {
-    struct xml_element *element;
+    /* We want to create a socket to the server and wait for
+       a request from them.  Process that request and
+       send back a reply.
+    */
 
-    element = root;
-    while (element != NULL)
-        {
-            free(element->key);
-            if (element->value != NULL) free(element->value);
-            if (element->xml_list != NULL)
-                free_xml_element(element->xml_list);
+    Initialize_Network_Config_Values();
 
-            struct xml_element *next = element->next;
-            free(element);
-            element = next;
+    ServerConnection = Initialize_for_Network_Requests(PortName);
+    if (ServerConnection == INVALID_SOCKET)
+        {
+            important("cannot establish server socket\n");
+            exit(-1);
         }
+
+    if (captureFileName != NULL) (void)Start_Capture(captureFileName);
+
+    /* we take new clients until accept() has no more for us */
+    fcntl(ServerConnection, F_SETFL, fcntl(ServerConnection, F_GETFL) | O_NONBLOCK);
+    Server_Source.fd = ServerConnection;
+    Server_Source.ready = Accept_Clients;
+    Watch(&Server_Source, EPOLLIN | EPOLLET);
+}
+
+
+void Finish_for_Network_Requests(void)
+{
+    int i;
+    for (i = 0; i < MAX_CLIENTS; i++)
+        if (Connections[i] != NULL)
+            close_Client_Connection(Connections[i]);
+    if (ServerConnection != INVALID_SOCKET)    
+        close(ServerConnection);
 }
 
 /* ***************************************************************** */
@@ -1652,676 +6468,781 @@ void free_xml_element(struct xml_element *root)
 /*                                                                   */
 /* ***************************************************************** */
 
-Boolean is_XML_comment(STRING buffer)
+/* Push mode.  Normally we wait for CVM to connect to us, and an
+   update reaches CVM only if it happens to be connected at the time.
+   If CVMAddress (host:port) is set in the config file, we also keep
+   a connection of our own open to CVM.  Once it is open, it is like
+   any other client connection: CVM can send requests on it, and it
+   gets the updates.  When it goes away we dial again, after a short
+   wait, and while that keeps failing, the wait doubles each time,
+   from RECONNECT_MIN_DELAY up to RECONNECT_MAX_DELAY.  The actual
+   wait is picked at random from the upper half of that, so the
+   cabinets do not all call at once when CVM comes back.
+
+   The host in CVMAddress may be a name.  getaddrinfo() can take
+   many seconds when DNS is slow or down, and every client would wait
+   for it, so it is run on a thread of its own, which tells us thru
+   an eventfd when it has the answer.  The address is kept, and used
+   for each dial after that, until a dial fails or CVMAddress is
+   changed; then it is looked up again, the same way.
+
+   A connection with nothing to say can be dropped by a firewall
+   without either end knowing, so when we have sent nothing for
+   heartbeatInterval seconds, we send a heartbeat: a message with an
+   empty body, just the 8-byte header.  An empty message from the
+   other end is taken as a heartbeat too, and ignored. */
+
+#include <netdb.h>        /* getaddrinfo */
+#include <sys/timerfd.h>  /* timerfd_create, timerfd_settime */
+
+#define RECONNECT_MIN_DELAY  250     /* milliseconds */
+#define RECONNECT_MAX_DELAY  60000
+#define CONNECT_TIMEOUT      10000
+
+enum Outbound_State { OB_OFF, OB_WAITING, OB_RESOLVING, OB_CONNECTING, OB_CONNECTED };
+
+/* a lookup, shared with the thread doing it */
+struct RESOLVE
 {
-    /* XML comment looks like <!--...--> */    
-    if ((buffer[0] == '<')
-        && (buffer[1] == '!')
-        && (buffer[2] == '-')
-        && (buffer[3] == '-')) return(TRUE);
-    return(FALSE);
-}
+    char address[256];               /* CVMAddress, when we asked */
+    char host[256];
+    char port[32];
+    int done;
+    int rc;                          /* from getaddrinfo */
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+};
 
-Boolean is_XML_comment_end(STRING buffer)
+struct OUTBOUND
 {
-    if ((buffer[0] == '-')
-        && (buffer[1] == '-')
-        && (buffer[2] == '>')) return(TRUE);
-    return(FALSE);
-}
+    enum Outbound_State state;
+    struct SOURCE connecting;        /* the socket, until it connects */
+    struct SOURCE timer;             /* when to dial, give up, or send a heartbeat */
+    struct SOURCE resolved;          /* eventfd: the lookup is done */
+    int failures;                    /* in a row */
+    struct CONNECTION *c;            /* once it connects */
+    char host[256];                  /* from CVMAddress */
+
+    struct RESOLVE *pending;         /* the lookup going on */
+    struct RESOLVE *lookup;          /* the last one that worked */
+    Boolean have_address;
+};
 
-STRING find_end_of_comment(STRING buffer)
-{
-    /* buffer points at a comment; skip it */
-    /* XML comment looks like <!--...--> */
+struct OUTBOUND Outbound = { OB_OFF, { INVALID_SOCKET, NULL }, { INVALID_SOCKET, NULL },
+                             { INVALID_SOCKET, NULL }, 0, NULL, "", NULL, NULL, FALSE };
 
-    /* skip opening part; we know it matches exactly */
-    buffer = buffer+4;
-    while (!is_XML_comment_end(buffer))
-        {
-            if (*buffer == '\0') return(NULL);
-            buffer++;
-        }
-    buffer += 3;
-    return(buffer);
-}
+struct SHARED_MESSAGE *Heartbeat = NULL;
 
-Boolean is_XML_declaration(STRING buffer)
+
+void set_outbound_timer(long ms)
 {
-    /* XML declaration looks like  <?xml...?> */
-    if ((buffer[0] == '<')
-        && (buffer[1] == '?')
-        && (buffer[2] == 'x')
-        && (buffer[3] == 'm')
-        && (buffer[4] == 'l')) return(TRUE);
-    return(FALSE);
+    struct itimerspec it;
+    memset(&it, 0, sizeof(it));
+    if (ms < 1) ms = 1;
+    it.it_value.tv_sec = ms / 1000;
+    it.it_value.tv_nsec = (ms % 1000) * 1000000;
+    timerfd_settime(Outbound.timer.fd, 0, &it, NULL);
 }
 
-Boolean is_XML_declaration_end(STRING buffer)
+/* wait, and then dial again */
+void outbound_retry(void)
 {
-    if ((buffer[0] == '?')
-        && (buffer[1] == '>')) return(TRUE);
-    return(FALSE);
+    long delay = RECONNECT_MIN_DELAY;
+    int i;
+    for (i = 1; (i < Outbound.failures) && (delay < RECONNECT_MAX_DELAY); i++)
+        delay = 2 * delay;
+    if (delay > RECONNECT_MAX_DELAY) delay = RECONNECT_MAX_DELAY;
+    delay = delay/2 + random() % (delay/2 + 1);
+
+    important("CVM at %s: dial again in %ld ms\n", CVMAddress, delay);
+    Outbound.state = OB_WAITING;
+    set_outbound_timer(delay);
 }
 
-STRING find_end_of_declaration(STRING buffer)
+void outbound_failed(STRING why)
 {
-    /* buffer points at a declaration; skip it */
-    /* XML declaration looks like  <?xml...?> */
-    buffer = buffer+5;
-    while (!is_XML_declaration_end(buffer))
+    important("CVM at %s: %s\n", CVMAddress, why);
+    Outbound_Failures += 1;
+    Outbound.failures += 1;
+    /* it may have moved; look it up again next time */
+    Outbound.have_address = FALSE;
+    if (Outbound.connecting.fd != INVALID_SOCKET)
         {
-            if (*buffer == '\0') return(NULL);
-            buffer++;
+            Unwatch(&Outbound.connecting);
+            close(Outbound.connecting.fd);
+            Outbound.connecting.fd = INVALID_SOCKET;
         }
-    buffer += 2;
-    return(buffer);
+    outbound_retry();
 }
 
 
+/* the lookup thread:  it only fills in its RESOLVE, and says when
+   it is done */
+void *outbound_resolve(void *arg)
+{
+    struct RESOLVE *r = CAST(struct RESOLVE *, arg);
+    struct addrinfo hints;
+    struct addrinfo *ai;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    r->rc = getaddrinfo(r->host, r->port, &hints, &ai);
+    if (r->rc == 0)
+        {
+            memcpy(&r->addr, ai->ai_addr, ai->ai_addrlen);
+            r->addrlen = ai->ai_addrlen;
+            freeaddrinfo(ai);
+        }
+    __atomic_store_n(&r->done, TRUE, __ATOMIC_RELEASE);
 
-/* ***************************************************************** */
-/*                                                                   */
-/*                                                                   */
-/* ***************************************************************** */
+    eventfd_t one = 1;
+    if (write(Outbound.resolved.fd, &one, sizeof(one)) < 0) { /* nothing to do */ }
+    return(NULL);
+}
 
-STRING find_end_of_tag(STRING buffer)
+/* start looking up the host in CVMAddress; FALSE if we cannot */
+Boolean outbound_start_lookup(void)
 {
-    /* find end of tag */
-    while (istagchar(*buffer)) buffer++;
-    /* if we found the end of the input */
-    if (*buffer == '\0') return(NULL);
-    
-    /* terminate the tag as a string */
-    if (*buffer == '>')
+    STRING colon = strrchr(CVMAddress, ':');
+    if (colon == NULL)
         {
-            *buffer = '\0';
+            important("CVMAddress %s has no port\n", CVMAddress);
+            return(FALSE);
         }
-    else
+
+    struct RESOLVE *r = TYPED_MALLOC(struct RESOLVE);
+    memset(r, 0, sizeof(*r));
+    snprintf(r->address, sizeof(r->address), "%s", CVMAddress);
+    int n = colon - CVMAddress;
+    if (n >= sizeof(r->host)) n = sizeof(r->host) - 1;
+    memcpy(r->host, CVMAddress, n);
+    r->host[n] = '\0';
+    snprintf(r->port, sizeof(r->port), "%s", colon + 1);
+
+    /* signals are for the main thread (see Start_Log_Writer) */
+    pthread_t t;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    int rc = pthread_create(&t, &attr, outbound_resolve, r);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    pthread_attr_destroy(&attr);
+    if (rc != 0)
         {
-            *buffer = '\0';
-            buffer++;            
-            /* it appears we have attributes.  In this application of
-               XML, so far, we have no need for attributes -- skip them */
-            while ((*buffer != '>') && (*buffer != '\0')) buffer++;
-            if (*buffer == '\0') return(NULL);
+            free(r);
+            outbound_failed("cannot start a lookup");
+            return(TRUE);
         }
-    
-    /* advance past the '>' to the next significant character */
-    buffer++;                        
-    while ((*buffer != '\0') && isspace(*buffer)) buffer++;
-    return(buffer);
-}
 
+    /* it replaces Outbound.lookup when it is done, if it works */
+    Outbound.pending = r;
+    Outbound.state = OB_RESOLVING;
+    return(TRUE);
+}
 
-STRING get_value(STRING buffer, STRING *value)
+/* start to connect; we hear how it went when the socket is writable.
+   The host must have been looked up first; if we do not have its
+   address, we start the lookup, and dial when it is done. */
+void outbound_dial(void)
 {
-    /* We have found something other than a tag,
-       capture that value (until the next '<') 
-       and advance the buffer pointer */
-    /* skip any leading blanks */
-    while ((*buffer != '\0') && isspace(*buffer))
-        buffer++;
-
-    STRING begin = buffer;
+    if (CVMAddress == NULL)
+        {
+            Outbound.state = OB_OFF;
+            return;
+        }
 
-    /* find next tag  (or end of string) */
-    while ((*buffer != '<') && (*buffer != '\0'))
-        buffer++;
+    struct RESOLVE *r = Outbound.lookup;
+    if (!Outbound.have_address || (r == NULL) || !STRING_EQUAL(r->address, CVMAddress))
+        {
+            if (!outbound_start_lookup()) Outbound.state = OB_OFF;
+            return;
+        }
+    snprintf(Outbound.host, sizeof(Outbound.host), "%s", r->host);
 
-    if (*buffer == '\0')
+    FileDesc fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
         {
-            *value = remember_string(begin);
+            outbound_failed("cannot create socket");
+            return;
         }
-    else
+    Outbound.connecting.fd = fd;
+    int rc = connect(fd, CAST(struct sockaddr *, &r->addr), r->addrlen);
+    if ((rc < 0) && (errno != EINPROGRESS))
         {
-            /* if we found the start of a tag */
-            /* temporarily change the < to \0, so
-               that we terminate the value part,
-               save the string, then put the < back */
-            *buffer = '\0';
-            *value = remember_string(begin);
-            *buffer = '<';            
-
-            /* trim leading and trailng spaces */
-            STRING v = *value;
-            int n = strlen(v);
-            while ((n > 0) && isspace(v[n-1]))
-                {
-                    n -= 1;
-                    v[n] = '\0';
-                }
+            outbound_failed(strerror(errno));
+            return;
         }
 
-    return(buffer);
+    Outbound.state = OB_CONNECTING;
+    Watch(&Outbound.connecting, EPOLLOUT);
+    set_outbound_timer(CONNECT_TIMEOUT);
 }
 
 
-STRING parse_xml_element(STRING buffer, struct xml_element *tag_tree)
+/* our connection to CVM is gone */
+void Outbound_Closed(struct CONNECTION *c)
 {
-    /* skip any leading blanks */
-    while ((*buffer != '\0') && isspace(*buffer)) buffer++;
-    if (*buffer == '\0') return(NULL);
-
-    if (*buffer != '<')	       /* string value */
-        {
-            buffer = get_value(buffer, &(tag_tree->value));
-            return(buffer);
-        }
-    
-    /* XML comments are skipped; start over as if not here */
-    if (is_XML_comment(buffer))
+    Outbound.c = NULL;
+    if (Outbound.state != OB_CONNECTED) return;
+
+    /* one that is gone before it is secure counts as a failure */
+    Boolean failed = FALSE;
+#ifdef USE_TLS
+    failed = c->handshaking;
+#endif
+    if (failed)
         {
-            buffer = find_end_of_comment(buffer);
-            return(parse_xml_element(buffer, tag_tree));
+            Outbound_Failures += 1;
+            Outbound.failures += 1;
         }
+    else
+        Outbound.failures = 0;
+    outbound_retry();
+}
 
-    /* XML declarations are treated as comments for this application. */
-    if (is_XML_declaration(buffer))
+
+/* the connect has finished, one way or the other */
+void Outbound_Connect_Ready(struct SOURCE *s, UINT32 events)
+{
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if (getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0) error = errno;
+    if (error != 0)
         {
-            buffer = find_end_of_declaration(buffer);
-            return(parse_xml_element(buffer, tag_tree));
+            outbound_failed(strerror(error));
+            return;
         }
 
-    /* another tag.  parse <tag> ... </tag> */
-    /* Advance past the < */
-    buffer++;
-
-    /* Now we have something that we need to pay attention to */
-    /* not a comment or a declaration, but a real tag. */
-    
-    STRING tag = buffer;
-    buffer = find_end_of_tag(buffer);
-    if (*buffer == '\0') return(NULL);
-    tag_tree->key = remember_string(tag);
+    FileDesc fd = s->fd;
+    Unwatch(s);
+    s->fd = INVALID_SOCKET;
 
-    /* new tag */
-    if (*buffer != '<')
+    struct CONNECTION *c = new_Client_Connection(fd);
+    if (c == NULL)
         {
-            /* value of this item is a string */
-            buffer = get_value(buffer, &(tag_tree->value));
+            close(fd);
+            outbound_failed("no room for another client");
+            return;
         }
-    else
+    Set_Client_Socket_Options(fd);
+    c->closed = Outbound_Closed;
+    Outbound.c = c;
+    Outbound.state = OB_CONNECTED;
+#ifdef USE_TLS
+    if (useTLS && !Start_TLS(c, Outbound.host))
         {
-            /* value of this item is a list of new elements */
-            /* accumulate a sequence of tags, until we finally get /tag */
-            while ((*buffer == '<') && (buffer[1] != '/'))
-                {
-                    struct xml_element *tree = TYPED_MALLOC(struct xml_element);
-                    tree->xml_list = NULL;            
-                    tree->value = NULL;
-
-                    tree->next = tag_tree->xml_list;
-                    tag_tree->xml_list = tree;
-                    /* recursively parse the rest of the message */
-                    buffer = parse_xml_element(buffer, tree);
-                    if ((buffer == NULL) || (*buffer == '\0')) return(NULL);                    
-                }
-       }
-
-    /* now we have (should have) an end tag.  See if it matches. */
-    if (*buffer == '<') buffer++; /* skip < */
-    if (*buffer == '/') buffer++; /* skip / */    
-    if (*buffer == '\0') return(NULL);
-
-    STRING end_tag = buffer;
-    buffer = find_end_of_tag(buffer);
-    if (!mystrcasecmp(end_tag, tag))
-        fprintf(stderr, "tags do not match: <%s> ... </%s>\n", tag, end_tag);
+            close_Client_Connection(c);
+            return;
+        }
+#endif
+    Start_Client_IO(c);
+    Outbound_Connects += 1;
+    important("Connect To CVM at %s: FD %d\n", CVMAddress, fd);
 
-    return(buffer);
+    if (heartbeatInterval > 0) set_outbound_timer(heartbeatInterval * 1000);
 }
 
 
-/* ***************************************************************** */
-/*                                                                   */
-/*                                                                   */
-/* ***************************************************************** */
-
-
-STRING Format_XML_Response(STRING refID, STRING CVM_icdVersion)
+/* send a heartbeat if we have been quiet too long */
+void outbound_heartbeat(void)
 {
-    /* we are asked to send back the data for the last
-       events. Read them from the files, if there are any. */
+    struct CONNECTION *c = Outbound.c;
+    if ((c == NULL) || (heartbeatInterval <= 0)) return;
 
-    /* if we get an icdVersion, which differs from what we
-       have, keep their version. */
-    if (!mystrcasecmp(icdVersion, CVM_icdVersion))
-        UPDATE_STRING(icdVersion, CVM_icdVersion);
-
-    struct BUFFER *buffer = ClearBuffer();
-    AppendBuffer(buffer, "<retrieveDataResp xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\">");    
-    AppendHeader(buffer, refID, icdVersion);
-    AppendBuffer(buffer, "<data xsi:type=\"retrieveData\">");
-    
-    int i;
-    for (i = 0; i < MAX_DETECTORS; i++)
+    time_t quiet = time(NULL) - c->last_sent;
+    if ((quiet >= heartbeatInterval) && (c->out_head == NULL))
         {
-            DEVICE d = DDD[i];
-            if (d == NULL) continue;
-            
-            struct Timestamp timedate;
-            Boolean dataexists = ReadEventFromFile(d, &timedate);
-
-            AppendBuffer(buffer, "<overheightData>");    
-            AppendId(buffer, d);
-            AppendOverheight(buffer, d, &timedate, dataexists);
-            AppendBuffer(buffer, "</overheightData>");
+            Heartbeats_Sent += 1;
+            if (!Queue_Shared_Message(c, Heartbeat)) return;
+            quiet = 0;
         }
-    AppendBuffer(buffer, "</data>");        
-    AppendBuffer(buffer, "</retrieveDataResp>");
-    STRING b = FinishBuffer(buffer);
-    return(b);
+    set_outbound_timer((heartbeatInterval - quiet) * 1000);
 }
 
 
-/* ***************************************************************** */
-/*                                                                   */
-/*                                                                   */
-/* ***************************************************************** */
-
-/* first parse it into a tree, then if
-   it is the right type of message, generate a
-   reply message. */
-
-STRING Parse_XML_Message(STRING buffer)
+/* the lookup thread is done */
+void Outbound_Resolved(struct SOURCE *s, UINT32 events)
 {
-    STRING message = NULL;
-    
-    struct xml_element *root = TYPED_MALLOC(struct xml_element);
-    root->next = NULL;
-    root->key = NULL;
-    root->xml_list = NULL;
-    root->value = NULL;
-    
-    /* parse */
-    buffer = parse_xml_element(buffer, root);
+    eventfd_t n;
+    if (read(s->fd, &n, sizeof(n)) != sizeof(n)) return;
+    if (Outbound.state != OB_RESOLVING) return;
 
-    if (debug) dump_xml_element(root, 0);
+    /* there is only one lookup at a time */
+    struct RESOLVE *r = Outbound.pending;
+    if ((r == NULL) || !__atomic_load_n(&r->done, __ATOMIC_ACQUIRE)) return;
+    Outbound.pending = NULL;
 
-    /* act */
-    if ((root->key != NULL) && mystrcasecmp(root->key, "retrieveDataReq"))
+    if (r->rc != 0)
         {
-            STRING v = search_xml_value(root->xml_list, "overheightData");
-            if ((v != NULL) && mystrcasecmp(v, "true"))
-                {
-                    STRING refID = search_xml_value(root->xml_list, "refId");
-                    STRING icdVersion = search_xml_value(root->xml_list, "icdVersion");
-
-                    /* create an XML overheight data message and send it */
-                    message = Format_XML_Response(refID, icdVersion);
-                }
+            important("CVM at %s: cannot find its address: %s\n", r->address, gai_strerror(r->rc));
+            free(r);
+            outbound_failed("no address");
+            return;
         }
 
-    free_xml_element(root);
-    
-    return(message);
+    if (Outbound.lookup != NULL) free(Outbound.lookup);
+    Outbound.lookup = r;
+    Outbound.have_address = TRUE;
+    outbound_dial();
 }
 
 
-/* ***************************************************************** */
-/*                                                                   */
-/*                                                                   */
-/* ***************************************************************** */
-
-#include <sys/types.h>    /* send, recv, ... */
-#include <sys/socket.h>   /* socket, bind, accept, ... */
-#include <arpa/inet.h>    /* htons, ... */
+void Outbound_Timer_Ready(struct SOURCE *s, UINT32 events)
+{
+    unsigned long long ticks;
+    if (read(s->fd, &ticks, sizeof(ticks)) != sizeof(ticks)) return;
 
-#define INVALID_SOCKET  (-1)
+    switch (Outbound.state)
+        {
+        case OB_WAITING: outbound_dial(); return;
+        case OB_CONNECTING: outbound_failed("connect timed out"); return;
+        case OB_CONNECTED: outbound_heartbeat(); return;
+        case OB_RESOLVING: return;
+        case OB_OFF: return;
+        }
+}
 
-/* all our configuration variables are strings.  If we want
-   integers, we need to convert them. */
 
-void Initialize_Network_Config_Values(void)
+void Setup_Outbound(void)
 {
-    if (StringMyRefId != NULL)
+    if (CVMAddress == NULL) return;
+
+    Outbound.timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (Outbound.timer.fd < 0)
         {
-            myRefId = atoi(StringMyRefId);
+            important("cannot create outbound timer: %d\n", errno);
+            perror("timerfd_create");
+            exit(-1);
+        }
+    Outbound.timer.ready = Outbound_Timer_Ready;
+    Watch(&Outbound.timer, EPOLLIN);
+    Outbound.resolved.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (Outbound.resolved.fd < 0)
+        {
+            important("cannot create outbound eventfd: %d\n", errno);
+            perror("eventfd");
+            exit(-1);
         }
+    Outbound.resolved.ready = Outbound_Resolved;
+    Watch(&Outbound.resolved, EPOLLIN);
+    Outbound.connecting.ready = Outbound_Connect_Ready;
+    Heartbeat = New_Shared_Message("", 0);
+    Heartbeat->droppable = TRUE;
+    srandom(time(NULL) ^ getpid());
+
+    outbound_dial();
+}
 
-    
-    if (PortName == NULL)
-        PortName = "3080";
+void Finish_Outbound(void)
+{
+    Outbound.state = OB_OFF;
+    if (Outbound.c != NULL) close_Client_Connection(Outbound.c);
+    if (Outbound.connecting.fd != INVALID_SOCKET) close(Outbound.connecting.fd);
+    if (Outbound.timer.fd != INVALID_SOCKET) close(Outbound.timer.fd);
+    if (Outbound.resolved.fd != INVALID_SOCKET) close(Outbound.resolved.fd);
 }
 
+
 /* ***************************************************************** */
 /*                                                                   */
 /*                                                                   */
 /* ***************************************************************** */
 
+/* History export.  When an engineer needs the whole history of a
+   site -- the event files and the log directory -- they can connect
+   to the export port (ExportPortName in the config file; there is
+   no export port unless it is set) and send one line saying what
+   they want:
 
-int Send_Request_Message(FileDesc SocketFD, STRING buffer)
-{
-    int rc;
-
-    int n = strlen(buffer);
-
-    important("outgoing message:\n(%d)(%d)%s\n", n, 0, buffer);
-
-    /* Send our request */
-    /* Sending, like receiving, requires first the 
-       big-endian number of bytes, then a second 
-       reserved word, then the message. */
+        events [gzip|raw]
+        logs [gzip|raw]
+        all [gzip|raw]
 
-    /* first word is length */
-    int i;
-    int shift = 32;
-    UINT8 buf[4];
-    for (i = 0; i < 4; i++)
-        {
-            shift = shift - 8;
-            buf[i] = (n >> shift) & 0xFF;
-        }
-    rc = send(SocketFD, buf, 4, 0);    
-    if ((rc < 0) || (rc != 4))
-        {
-            important("send of first 4 bytes (0X%02X,0X%02X,0X%02X,0X%02X) fails\n",
-                    buf[0],buf[1],buf[2],buf[3]);
-            perror("send");
-            return(-7);
-        }
+   An empty line is "all gzip".  We send back a tar file of what was
+   asked for and then close the connection.  For example:
 
-    /* second word of zeros */
-    for (i = 0; i < 4; i++) buf[i] = 0;
-    rc = send(SocketFD, buf, 4, 0);    
-    if ((rc < 0) || (rc != 4))
-        {
-            important("send of second 4 bytes (0X%02X,0X%02X,0X%02X,0X%02X) fails\n",
-                    buf[0],buf[1],buf[2],buf[3]);
-            perror("send");
-            return(-6);
-        }
+        echo "all gzip" | nc moxa 3081 > history.tar.gz
 
-    /* then send the right number of message bytes */
-    rc = send(SocketFD, buffer, n, 0);
-    if (rc < 0)
-        {
-            important("send of %d bytes fails\n", n);
-            perror("send");
-            return(-5);
-        }
+   Many of our cabinets are on a cellular link, so by default the tar
+   file is compressed as it is sent, with a small fixed window so the
+   memory use stays small.  A raw tar file is sent with sendfile(),
+   straight from the file system to the socket.
 
-    if (rc < n)
-        {
-            important("send() sent only %d out of %d bytes\n", rc, n);
-            perror("send");
-            return(-10);
-        }
+   Sending all this could take a while on a slow link, and we must
+   not stop polling the input lines, so we fork a child process to
+   do each export.  Each child reads the whole history and has a
+   compressor going, and the Moxa has little memory or CPU to spare,
+   so at most MAX_EXPORTS run at once; a connection beyond that is
+   closed at once, and counted.  We hear that a child is done thru
+   SIGCHLD, on the signalfd (see Signal_Ready()), and reap it then. */
 
-    return(0);
-}
+#include <sys/sendfile.h> /* sendfile */
+#include <sys/wait.h>     /* waitpid */
+#ifdef USE_ZLIB
+#include <zlib.h>         /* deflateInit2, deflate, ... */
+#endif
 
+FileDesc ExportConnection = INVALID_SOCKET;
+struct SOURCE Export_Source;
 
+#define MAX_EXPORTS  2
+int Export_Children = 0;
 
+/* size of the compression window (2^n bytes) and the deflate
+   internal state (1..9); these use about 12K of memory */
+#define EXPORT_WINDOW_BITS  12
+#define EXPORT_MEM_LEVEL    4
 
-/* ***************************************************************** */
-/*                                                                   */
-/*                                                                   */
-/* ***************************************************************** */
+/* how long we wait on the engineer's end before giving up */
+#define EXPORT_TIMEOUT  60
 
-/* We set up a socket for others to connect to. */
+#define EXPORT_BUFFER_SIZE  4096
+#define TAR_BLOCK  512
 
-#define BACKLOG 5
+struct EXPORT
+{
+    FileDesc fd;
+    Boolean compress;
+    Boolean error;
+    int sent;                         /* bytes sent on the socket */
+    int files;
+#ifdef USE_ZLIB
+    z_stream z;
+    char out[EXPORT_BUFFER_SIZE];
+#endif
+};
 
 
-FileDesc Initialize_for_Network_Requests(void)
+void export_bytes(struct EXPORT *x, const void *data, int n, Boolean finish)
 {
-    FileDesc ConnectionSocket;
-    struct sockaddr_in  sin;
+    if (x->error) return;
 
-    /* create the connection socket and set its parameters of use */
-    ConnectionSocket = socket(AF_INET, SOCK_STREAM, 0);
-    if (ConnectionSocket < 0)
+#ifdef USE_ZLIB
+    if (x->compress)
         {
-            perror("socket");
-            return(INVALID_SOCKET);
+            x->z.next_in = CAST(Bytef *, data);
+            x->z.avail_in = n;
+            int rc;
+            do
+                {
+                    x->z.next_out = CAST(Bytef *, x->out);
+                    x->z.avail_out = sizeof(x->out);
+                    rc = deflate(&x->z, finish ? Z_FINISH : Z_NO_FLUSH);
+                    int m = sizeof(x->out) - x->z.avail_out;
+                    if ((m > 0) && (Send_Bytes(x->fd, x->out, m) < 0))
+                        {
+                            x->error = TRUE;
+                            return;
+                        }
+                    x->sent += m;
+                }
+            while ((x->z.avail_out == 0) || (finish && (rc == Z_OK)));
+            return;
         }
+#endif
 
-    (void)setsockopt(ConnectionSocket, SOL_SOCKET, SO_REUSEADDR,   (char *)NULL, 0);
+    if ((n > 0) && (Send_Bytes(x->fd, CAST(STRING, data), n) < 0))
+        x->error = TRUE;
+    x->sent += n;
+}
 
-    /* define the name and port to be used with the connection socket */
-    bzero((char *)&sin, sizeof(sin));
+void export_tar_header(struct EXPORT *x, STRING name, struct stat *statbuf)
+{
+    /* a POSIX ustar header; numbers are octal strings */
+    char h[TAR_BLOCK];
+    memset(h, 0, sizeof(h));
+    snprintf(&h[0], 100, "%s", name);
+    snprintf(&h[100], 8, "%07o", CAST(unsigned int, statbuf->st_mode & 0777));
+    snprintf(&h[108], 8, "%07o", 0);
+    snprintf(&h[116], 8, "%07o", 0);
+    snprintf(&h[124], 12, "%011lo", CAST(unsigned long, statbuf->st_size));
+    snprintf(&h[136], 12, "%011lo", CAST(unsigned long, statbuf->st_mtime));
+    h[156] = '0';
+    memcpy(&h[257], "ustar", 6);
+    memcpy(&h[263], "00", 2);
+
+    /* the checksum is figured with the checksum field as blanks */
+    memset(&h[148], ' ', 8);
+    unsigned int sum = 0;
+    int i;
+    for (i = 0; i < TAR_BLOCK; i++) sum += CAST(unsigned char, h[i]);
+    snprintf(&h[148], 8, "%06o", sum);
+    h[155] = ' ';
 
-    sin.sin_family = AF_INET;
-    sin.sin_addr.s_addr = INADDR_ANY;
+    export_bytes(x, h, TAR_BLOCK, FALSE);
+}
 
-    int port = CAST(unsigned short, atoi(PortName)); /* get the port number */
-    sin.sin_port = htons(port);
+void export_file(struct EXPORT *x, STRING tarname, STRING filename)
+{
+    if (x->error) return;
 
-    /* bind the name and port number to the connection socket */
-    if (bind(ConnectionSocket, (struct sockaddr *)&sin, sizeof(sin)) < 0)
+    FileDesc fd = open(filename, O_RDONLY);
+    if (fd < 0) return;
+
+    struct stat statbuf;
+    if ((fstat(fd, &statbuf) < 0) || !S_ISREG(statbuf.st_mode))
         {
-            perror("bind");
-            return(INVALID_SOCKET);
+            close(fd);
+            return;
         }
 
-    important("Socket is FD %d for port %d\n", ConnectionSocket, port);
+    /* the file may grow while we send it (the log file will), but
+       we said how long it was in the header, so send just that. */
+    export_tar_header(x, tarname, &statbuf);
+    off_t size = statbuf.st_size;
+    off_t offset = 0;
+    char buf[EXPORT_BUFFER_SIZE];
 
-    /* now activate the named connection socket to get messages */
-    if (listen(ConnectionSocket, BACKLOG) < 0)
+    while (!x->error && (offset < size))
         {
-            perror("listen");
-            return(INVALID_SOCKET);
-        };
+            int n;
+            if (!x->compress)
+                {
+                    /* already in the right form -- let the kernel send it */
+                    n = sendfile(x->fd, fd, &offset, size - offset);
+                    if (n > 0) x->sent += n;
+                    if ((n < 0) && (errno == EINTR)) continue;
+                    if (n < 0) x->error = TRUE;
+                }
+            else
+                {
+                    int m = sizeof(buf);
+                    if (m > size - offset) m = size - offset;
+                    n = pread(fd, buf, m, offset);
+                    if (n > 0)
+                        {
+                            export_bytes(x, buf, n, FALSE);
+                            offset += n;
+                        }
+                    if ((n < 0) && (errno == EINTR)) continue;
+                    if (n < 0) x->error = TRUE;
+                }
+            if (n == 0)
+                {
+                    /* the file got shorter; fill it out with zeros */
+                    memset(buf, 0, sizeof(buf));
+                    while (!x->error && (offset < size))
+                        {
+                            int m = sizeof(buf);
+                            if (m > size - offset) m = size - offset;
+                            export_bytes(x, buf, m, FALSE);
+                            offset += m;
+                        }
+                }
+        }
+    close(fd);
 
-    important("Listening on FD %d\n", ConnectionSocket);
-    return(ConnectionSocket);
+    /* pad the file to a whole number of blocks */
+    int pad = (TAR_BLOCK - (size % TAR_BLOCK)) % TAR_BLOCK;
+    if (pad > 0)
+        {
+            memset(buf, 0, pad);
+            export_bytes(x, buf, pad, FALSE);
+        }
+    x->files += 1;
 }
 
-FileDesc Accept_Client(FileDesc ConnectionSocket)
+void export_events(struct EXPORT *x)
 {
-    /* wait for a connection from a Client */
-    
-    FileDesc ClientFD;
-    struct sockaddr_in  from;
-    socklen_t   len = sizeof (from);
-    
-    ClientFD = accept(ConnectionSocket, (struct sockaddr *)&from, &len);
-    if (ClientFD < 0)
+    int i;
+    for (i = 0; i < MAX_DETECTORS; i++)
         {
-            important("NewConnection: error %d\n", errno);
-            return(INVALID_SOCKET);
-        }
+            DEVICE d = DDD[i];
+            if ((d == NULL) || (d->eventFileName == NULL)) continue;
 
-    important("Connect To Client: FD %d \n", ClientFD);
-    return(ClientFD);
+            char tarname[MAX_FILENAME_LENGTH];
+            snprintf(tarname, sizeof(tarname), "events/%s", d->eventFileName);
+            export_file(x, tarname, d->eventFileName);
+        }
 }
 
+void export_logs(struct EXPORT *x)
+{
+    DIR *dirp = opendir(Log_Directory);
+    if (dirp == NULL) return;
 
-/* ***************************************************************** */
-/*                                                                   */
-/*                                                                   */
-/* ***************************************************************** */
-
-/* We have two file descriptors to worry about:
-   
-   ServerConnection -- the socket that we create to allow clients
-                       to create a connection.  We create the
-                       socket(), bind(), and then listen().  This is
-                       done once, and we keep that connection open
-                       for CVM to attach to when it wants.
-
-   ClientConnection -- the actual connection between us and CVM.
-                       CVM will connect to our ServerConnection,
-                       and we will do an accept() to create the
-                       connection.  This connection may go away,
-                       and be recreated as necessary.
-   
- */
-
-FileDesc ServerConnection = INVALID_SOCKET;
-FileDesc ClientConnection = INVALID_SOCKET;
-
+    struct dirent *dp;
+    while ((dp = readdir(dirp)) != 0)
+        {
+            if (dp->d_name[0] == '.')
+                continue;
 
-void close_Client_Connection(void)
-{
-    important("close client: FD %d\n", ClientConnection);
-    close(ClientConnection);
-    ClientConnection = INVALID_SOCKET;
+            char full_name[MAX_FILENAME_LENGTH];
+            char tarname[MAX_FILENAME_LENGTH];
+            snprintf(full_name, sizeof(full_name), "%s/%s", Log_Directory, dp->d_name);
+            snprintf(tarname, sizeof(tarname), "log/%s", dp->d_name);
+            export_file(x, tarname, full_name);
+        }
+    closedir(dirp);
 }
 
-/* ***************************************************************** */
-/*                                                                   */
-/*                                                                   */
-/* ***************************************************************** */
 
-STRING Read_XML_Message(void)
+/* read the one line request; returns FALSE if it is not one we know */
+Boolean read_export_request(FileDesc fd, Boolean *events, Boolean *logs, Boolean *compress)
 {
-    int i;
-    int rc;    
-    /* The request/message format is defined by the CVM-VCS-Protocol
-       as 
-       4 bytes -- bigendian number of bytes in messages (n)
-       4 bytes -- reserved for future use (0)
-       n bytes -- XML message
-    */
-    
-    /* read the length */
+    char line[64];
     int n = 0;
-    for (i = 0; i < 4; i++)
+    while (n < sizeof(line) - 1)
         {
-            int c;
-            rc = recv(ClientConnection, &c, 1, MSG_WAITALL);
-            if (rc <= 0)
-                {
-                    important("message truncated first 4 bytes\n");
-                    close_Client_Connection();
-                    return(NULL);
-                }
-            n = (n << 8) | (c & 0xFF);
-        }
-    if (debug) fprintf(stderr, "message of %d bytes\n", n);
-    if (n <= 0)
-        {
-            important("body of message missing\n");            
-            close_Client_Connection();
-            return(NULL);
+            int rc = recv(fd, &line[n], 1, 0);
+            if (rc <= 0) break;
+            if (line[n] == '\n') break;
+            n += 1;
         }
+    line[n] = '\0';
 
-    /* read the 2nd byte */
-    int m = 0;
-    for (i = 0; i < 4; i++)
+    char what[16] = "all";
+    char how[16] = "gzip";
+    sscanf(line, "%15s %15s", what, how);
+
+    *events = mystrcasecmp(what, "events") || mystrcasecmp(what, "all");
+    *logs = mystrcasecmp(what, "logs") || mystrcasecmp(what, "all");
+    *compress = mystrcasecmp(how, "gzip");
+    if (!*compress && !mystrcasecmp(how, "raw")) return(FALSE);
+    return(*events || *logs);
+}
+
+void Export_History(FileDesc fd)
+{
+    /* this is run in the child process */
+    struct timeval timeout = { EXPORT_TIMEOUT, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    Boolean events, logs, compress;
+    if (!read_export_request(fd, &events, &logs, &compress))
         {
-            int c;
-            rc = recv(ClientConnection, &c, 1, MSG_WAITALL);
-            if (rc <= 0)
-                {
-                    important("message truncated second 4 bytes\n");
-                    close_Client_Connection();                    
-                    return(NULL);
-                }
-            m = (m << 8) | (c & 0xFF);
+            important("export: bad request\n");
+            return;
         }
-    if ((m != 0) && debug) fprintf(stderr, "message 2nd byte is 0x%08X\n", m);
 
-    if (n > MAX_MESSAGE_LENGTH) return(NULL);
+    struct EXPORT *x = TYPED_MALLOC(struct EXPORT);
+    x->fd = fd;
+    x->compress = compress;
+    x->error = FALSE;
+    x->sent = 0;
+    x->files = 0;
 
-    /* allocate a memory buffer for the message */
-    STRING buffer = CAST(STRING, malloc(n+1));
-    rc = recv(ClientConnection, buffer, n, MSG_WAITALL);
-    if (rc != n)
+#ifdef USE_ZLIB
+    if (x->compress)
         {
-            important("recv() failed for XML; should have been %d bytes, but only %d\n", n, rc);
-            perror("recv");
-            close_Client_Connection();                            
-            free(buffer);
-            return(NULL);
+            /* +16 for a gzip header and trailer */
+            memset(&x->z, 0, sizeof(x->z));
+            if (deflateInit2(&x->z, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                             EXPORT_WINDOW_BITS + 16, EXPORT_MEM_LEVEL,
+                             Z_DEFAULT_STRATEGY) != Z_OK)
+                x->compress = FALSE;
         }
+#else
+    /* no compression library; send it raw */
+    x->compress = FALSE;
+#endif
+
+    if (events) export_events(x);
+    if (logs) export_logs(x);
+
+    /* a tar file ends with two empty blocks */
+    char end[2*TAR_BLOCK];
+    memset(end, 0, sizeof(end));
+    export_bytes(x, end, sizeof(end), TRUE);
+
+#ifdef USE_ZLIB
+    if (x->compress) deflateEnd(&x->z);
+#endif
+
+    important("export: %d files, %d bytes sent%s%s\n", x->files, x->sent,
+              x->compress ? " (gzip)" : "", x->error ? "; failed" : "");
+    free(x);
+}
 
-    /* be sure the buffer is zero-terminated */
-    buffer[n] = '\0';
 
-    important("incoming message:\n(%d)(%d)%s\n", n, m, buffer);
-    
-    return(buffer);
-}
+void Close_Control_Sockets(void);
 
+void Accept_Export(struct SOURCE *s, UINT32 events)
+{
+    FileDesc fd = Accept_Client(ExportConnection);
+    if (fd == INVALID_SOCKET) return;
 
-/* ***************************************************************** */
-/*                                                                   */
-/*                                                                   */
-/* ***************************************************************** */
+    if (Export_Children >= MAX_EXPORTS)
+        {
+            important("export: %d already going; refuse FD %d\n", Export_Children, fd);
+            Exports_Refused += 1;
+            close(fd);
+            return;
+        }
 
-void WriteXMLMessageToServer(DEVICE d, struct Timestamp *timedate, Boolean dataexists)
-{
-    /* create an XML overheight data message and send it */
-    STRING message = Format_One_Event_Message(d, timedate, dataexists);
-    if (message != NULL)
+    pid_t pid = fork();
+    if (pid < 0)
         {
-            /* to send a message, we need an open connection to CVM */
-            if (ClientConnection != INVALID_SOCKET)
-                {
-                    int rc = Send_Request_Message(ClientConnection, message);
-                    if (rc < 0)
-                        {
-                            important("XML event message fails\n");
-                            close_Client_Connection();                            
-                        }
-                }
-            free(message);
+            important("export: cannot fork: %d\n", errno);
+        }
+    else if (pid == 0)
+        {
+            Log_In_Child();
+
+            /* the child does not need our other sockets */
+            close(ServerConnection);
+            close(ExportConnection);
+            int i;
+            for (i = 0; i < MAX_CLIENTS; i++)
+                if (Connections[i] != NULL) close(Connections[i]->fd);
+            if (Outbound.connecting.fd != INVALID_SOCKET) close(Outbound.connecting.fd);
+            if (Outbound.timer.fd != INVALID_SOCKET) close(Outbound.timer.fd);
+            if (Outbound.resolved.fd != INVALID_SOCKET) close(Outbound.resolved.fd);
+            Close_Control_Sockets();
+            if (Capture_FD != INVALID_SOCKET) close(Capture_FD);
+            close(Reactor);
+
+            Export_History(fd);
+            close(fd);
+            _exit(0);
+        }
+    else
+        {
+            Export_Children += 1;
+            important("export: child %d for FD %d\n", pid, fd);
         }
-}
 
+    close(fd);
+}
 
-void Read_and_Reply_to_CVM(void)
+/* SIGCHLD: let the children that are done go */
+void Reap_Export_Children(void)
 {
-    STRING buffer = Read_XML_Message();
-    
-    /* see if the message requires a response */
-    if (buffer != NULL)
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
         {
-            STRING message = Parse_XML_Message(buffer);
-            free(buffer);
-            
-            if (message == NULL)
-                {
-                    important("XML message does not require response\n");                    
-                }
-            else
-                {
-                    int rc = Send_Request_Message(ClientConnection,  message);
-                    if (rc < 0)
-                        {
-                            important("XML response message fails\n");
-                            close_Client_Connection();
-                        }
-                    free(message);
-                }
+            if (Export_Children > 0) Export_Children -= 1;
+            important("export: child %d done (status %d)\n", pid, status);
         }
 }
 
 
-/* ***************************************************************** */
-/*                                                                   */
-/*                                                                   */
-/* ***************************************************************** */
-
-void Setup_for_Network_Requests(void)
+void Setup_for_Export_Requests(void)
 {
-    /* We want to create a socket to the server and wait for
-       a request from them.  Process that request and
-       send back a reply.
-    */
-
-    Initialize_Network_Config_Values();
+    if (ExportPortName == NULL) return;
 
-    ServerConnection = Initialize_for_Network_Requests();
-    if (ServerConnection == INVALID_SOCKET)
+    ExportConnection = Initialize_for_Network_Requests(ExportPortName);
+    if (ExportConnection == INVALID_SOCKET)
+        important("cannot establish export socket\n");
+    else
         {
-            important("cannot establish server socket\n");
-            exit(-1);
+            Export_Source.fd = ExportConnection;
+            Export_Source.ready = Accept_Export;
+            Watch(&Export_Source, EPOLLIN);
         }
 }
 
-
-void Finish_for_Network_Requests(void)
+void Finish_for_Export_Requests(void)
 {
-    if (ClientConnection != INVALID_SOCKET)    
-        close(ClientConnection);
-    if (ServerConnection != INVALID_SOCKET)    
-        close(ServerConnection);
+    if (ExportConnection != INVALID_SOCKET)
+        close(ExportConnection);
 }
+
             
 /* ***************************************************************** */
 /*                                                                   */
@@ -2365,26 +7286,18 @@ void Initialize_DI_Config_Values()
 void Process_Actual_DI_Event(DEVICE d)
 {
     /* get the current date and time */
-    time_t t = time(NULL);
-    struct tm *tm = localtime(&t);
-    
     struct Timestamp timedate;
-    timedate.year = tm->tm_year + 1900;
-    timedate.mon = tm->tm_mon + 1;
-    timedate.day = tm->tm_mday;    
-    timedate.hour = tm->tm_hour;
-    timedate.min = tm->tm_min;
-    timedate.sec = tm->tm_sec;
+    Current_Timestamp(&timedate);
 
     WriteEventToFile(d, &timedate);
-    WriteXMLMessageToServer(d, &timedate, TRUE);                    
+    WriteXMLMessageToServer(d, &timedate, TRUE, TRUE);
 }
 
 void Process_Change_In_Status_Event(DEVICE d)
 {
     struct Timestamp timedate;
     Boolean dataexists = ReadEventFromFile(d, &timedate);
-    WriteXMLMessageToServer(d, &timedate, dataexists);                    
+    WriteXMLMessageToServer(d, &timedate, dataexists, FALSE);
 }
 
 
@@ -2527,6 +7440,7 @@ void Poll_for_DI_Event()
    SIGUSR2 --
    SIGPWR -- put out of service
    SIGCONT -- put back in service.
+   SIGCHLD -- an export child is done.
 */
 
 void sig_Overhead_Event_0(int signo)
@@ -2547,9 +7461,13 @@ void sig_Overhead_Event_1(int signo)
 }
 
 
+void Set_Poll_Timer(void);
+
 void sig_refresh(int signo)
 {
+    Abandon_Responses();
     (void)Read_Config_File();
+    Set_Poll_Timer();
     if (verbose)
         Dump_Program_State();
 }
@@ -2566,13 +7484,68 @@ void sig_fail(int signo)
         }
 }
 
+/* SIGTERM (or ^C) stops the program; exit() writes out what is
+   still waiting to be logged */
+void sig_terminate(int signo)
+{
+    important("stopped by signal %d\n", signo);
+    exit(0);
+}
+
+
+/* The signals come to us thru a signalfd, in main_loop() like
+   everything else, so they are never handled in the middle of
+   reading an event file or sending a response. */
+
+#include <sys/signalfd.h> /* signalfd */
+
+struct SOURCE Signal_Source;
+
+void Signal_Ready(struct SOURCE *s, UINT32 events)
+{
+    struct signalfd_siginfo si;
+    while (read(s->fd, &si, sizeof(si)) == sizeof(si))
+        {
+            switch (si.ssi_signo)
+                {
+                case SIGUSR1: sig_Overhead_Event_0(si.ssi_signo); break;
+                case SIGUSR2: sig_Overhead_Event_1(si.ssi_signo); break;
+                case SIGPWR:  sig_refresh(si.ssi_signo); break;
+                case SIGFPE:  sig_fail(si.ssi_signo); break;
+                case SIGCHLD: Reap_Export_Children(); break;
+                case SIGTERM:
+                case SIGINT:  sig_terminate(si.ssi_signo); break;
+                }
+        }
+}
 
 void Setup_Signal_Handlers(void)
 {
-    signal(SIGUSR1, sig_Overhead_Event_0);
-    signal(SIGUSR2, sig_Overhead_Event_1);
-    signal(SIGPWR, sig_refresh);
-    signal(SIGFPE, sig_fail);
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGUSR2);
+    sigaddset(&signals, SIGPWR);
+    sigaddset(&signals, SIGFPE);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &signals, NULL);
+
+    Signal_Source.fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (Signal_Source.fd < 0)
+        {
+            important("cannot create signalfd: %d\n", errno);
+            perror("signalfd");
+            return;
+        }
+    Signal_Source.ready = Signal_Ready;
+    Watch(&Signal_Source, EPOLLIN);
+}
+
+void Finish_Signal_Handlers(void)
+{
+    if (Signal_Source.fd >= 0) close(Signal_Source.fd);
 }
 
 
@@ -2581,76 +7554,481 @@ void Setup_Signal_Handlers(void)
 /*                                                                   */
 /* ***************************************************************** */
 
-/* The main loop of the program.  We wait for either
-   network activity or a polling time-out, and then do
-   the appropriate thing in response.  This goes on forever. */
+/* The polling tick is a timerfd, another source for the reactor.
+   It is set again whenever the config file is read, in case
+   pollingDelay has changed. */
 
-void main_loop(void)
+#include <sys/timerfd.h>  /* timerfd_create, timerfd_settime */
+
+struct SOURCE Poll_Source = { INVALID_SOCKET, NULL };
+
+void Poll_Ready(struct SOURCE *s, UINT32 events)
 {
-    fd_set rfds, wfds, xfds;
-    /* time out at least once a day (tv_sec: seconds, tv_usec: microseconds) */
-    static struct timeval TimeOut;
-    struct timeval *Timer = &TimeOut;
+    /* if we are late, we may have missed a tick or two; we poll once */
+    unsigned long long ticks;
+    if (read(s->fd, &ticks, sizeof(ticks)) != sizeof(ticks)) return;
+    COUNTER start = Microseconds();
+    Poll_for_DI_Event();
+    Count_Time(&Poll_Times, start);
+}
 
-    while (TRUE)
+void Set_Poll_Timer(void)
+{
+    if (Poll_Source.fd < 0) return;
+
+    /* a zero interval would stop the timer; poll as fast as we can */
+    long delay = (pollingDelay > 0) ? pollingDelay : 1;
+    struct itimerspec it;
+    it.it_interval.tv_sec = delay / 1000000;
+    it.it_interval.tv_nsec = (delay % 1000000) * 1000;
+    it.it_value = it.it_interval;
+    timerfd_settime(Poll_Source.fd, 0, &it, NULL);
+}
+
+void Setup_Poll_Timer(void)
+{
+    Poll_Source.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (Poll_Source.fd < 0)
+        {
+            important("cannot create polling timer: %d\n", errno);
+            perror("timerfd_create");
+            exit(-1);
+        }
+    Poll_Source.ready = Poll_Ready;
+    Set_Poll_Timer();
+    Watch(&Poll_Source, EPOLLIN);
+}
+
+void Finish_Poll_Timer(void)
+{
+    if (Poll_Source.fd >= 0) close(Poll_Source.fd);
+}
+
+
+/* Once a second we look for clients that have stopped taking what
+   we send them. */
+
+struct SOURCE Housekeeping_Source = { INVALID_SOCKET, NULL };
+
+void Housekeeping_Ready(struct SOURCE *s, UINT32 events)
+{
+    unsigned long long ticks;
+    if (read(s->fd, &ticks, sizeof(ticks)) != sizeof(ticks)) return;
+    Check_Send_Timeouts();
+}
+
+void Setup_Housekeeping_Timer(void)
+{
+    Housekeeping_Source.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (Housekeeping_Source.fd < 0)
+        {
+            important("cannot create housekeeping timer: %d\n", errno);
+            perror("timerfd_create");
+            exit(-1);
+        }
+    struct itimerspec it;
+    it.it_interval.tv_sec = 1;
+    it.it_interval.tv_nsec = 0;
+    it.it_value = it.it_interval;
+    timerfd_settime(Housekeeping_Source.fd, 0, &it, NULL);
+    Housekeeping_Source.ready = Housekeeping_Ready;
+    Watch(&Housekeeping_Source, EPOLLIN);
+}
+
+void Finish_Housekeeping_Timer(void)
+{
+    if (Housekeeping_Source.fd >= 0) close(Housekeeping_Source.fd);
+}
+
+
+/* ***************************************************************** */
+/*                                                                   */
+/*                                                                   */
+/* ***************************************************************** */
+
+/* The control socket.  A local program (such as overheadctl, or a
+   monitoring script) can connect to the UNIX-domain socket named by
+   ControlSocketName, in the home directory, and send one request
+   per line:
+
+        state                    uptime, clients, CVM link, devices
+        counters                 every counter, "name value"
+        histograms               every histogram, "name bound:count ..."
+        capture NAME|off         start (or stop) a capture file
+        event DEVICE             act as if DEVICE saw an overheight
+        status DEVICE STATUS     set DEVICE to Active, Error, Failed,
+                                 or OutofService
+        reload                   read the config file again
+        help                     this list
+
+   DEVICE is the name of the device in the config file, or its id.
+   Each reply starts with a line "OK" or "ERROR why", then any
+   lines of data, and ends with an empty line; the connection stays
+   open for the next request.  A request takes a few microseconds,
+   in main_loop() like everything else, so a script can ask every
+   second without getting in the way of polling; the histogram
+   controlMicroseconds shows how long they take. */
+
+#include <sys/un.h>       /* struct sockaddr_un */
+#include <stdarg.h>       /* va_list */
+
+#define MAX_CONTROL_CLIENTS  8
+#define CONTROL_LINE_SIZE    256
+
+struct CONTROL
+{
+    struct SOURCE source;
+    char line[CONTROL_LINE_SIZE];
+    int n;
+};
+
+struct SOURCE Control_Source = { INVALID_SOCKET, NULL };
+struct CONTROL Controls[MAX_CONTROL_CLIENTS];
+struct BUFFER Control_Reply = { 0, 0, NULL, BM_GROW, 0 };
+struct sockaddr_un Control_Address;
+time_t Start_Time = 0;
+
+
+void control_printf(const char *format, ...)
+{
+    char line[CONTROL_LINE_SIZE];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    AppendBuffer(&Control_Reply, line);
+}
+
+void close_Control(struct CONTROL *k)
+{
+    if (k->source.fd == INVALID_SOCKET) return;
+    Unwatch(&k->source);
+    close(k->source.fd);
+    k->source.fd = INVALID_SOCKET;
+}
+
+/* a device by its name in the config file, or its id */
+DEVICE find_device(STRING name)
+{
+    int i;
+    for (i = 0; i < MAX_DETECTORS; i++)
+        {
+            DEVICE d = DDD[i];
+            if (d == NULL) continue;
+            if (mystrcasecmp(name, d->name)) return(d);
+            if ((d->id != NULL) && mystrcasecmp(name, d->id)) return(d);
+        }
+    return(NULL);
+}
+
+STRING Format_Outbound_State(void)
+{
+    switch (Outbound.state)
+        {
+        case OB_OFF:        return("off");
+        case OB_WAITING:    return("waiting");
+        case OB_RESOLVING:  return("looking up");
+        case OB_CONNECTING: return("connecting");
+        case OB_CONNECTED:  return("connected");
+        }
+    return("unknown");
+}
+
+
+void control_state(void)
+{
+    control_printf("OK\n");
+    control_printf("uptime %ld\n", CAST(long, time(NULL) - Start_Time));
+    control_printf("clients %d\n", Client_Count);
+    control_printf("cvm %s\n", Format_Outbound_State());
+
+    int i;
+    for (i = 0; i < MAX_DETECTORS; i++)
         {
-            /* we will wait for input from the general connection
-               socket (ServerConnection), or if a connection to
-               CVM has been made, for input from them
-               (ClientConnection), or for a polling time-out. */
-            FD_ZERO(&rfds);
+            DEVICE d = DDD[i];
+            if (d == NULL) continue;
+
+            char last[32] = "none";
+            struct Timestamp timedate;
+            if (ReadEventFromFile(d, &timedate))
+                {
+                    int n = Format_Reading_Date(last, &timedate, '/');
+                    last[n++] = '_';
+                    Format_Reading_Time(last + n, &timedate);
+                }
+            control_printf("device %s %s %s %s\n", d->name, ((d->id != NULL) ? d->id : "-"),
+                           Format_Device_Status(d->status), last);
+        }
+}
 
-            FileDesc max_fd = ServerConnection;
-            FD_SET(ServerConnection, &rfds);
+void control_counters(void)
+{
+    control_printf("OK\n");
+    int i;
+    for (i = 0; Counters[i].name != NULL; i++)
+        control_printf("%s %llu\n", Counters[i].name, *Counters[i].value);
+}
+
+void control_histograms(void)
+{
+    control_printf("OK\n");
+    int i;
+    for (i = 0; Histograms[i] != NULL; i++)
+        {
+            struct histogram *h = Histograms[i];
+            AppendBuffer(&Control_Reply, h->name);
+            int j;
+            for (j = 0; j < HISTOGRAM_BUCKETS; j++)
+                if (h->bucket[j] != 0)
+                    control_printf(" %llu:%llu", 1ULL << j, h->bucket[j]);
+            AppendBuffer(&Control_Reply, "\n");
+        }
+}
 
-            if (ClientConnection != INVALID_SOCKET)
+void control_request(STRING line)
+{
+    char what[16] = "";
+    char name[64] = "";
+    char value[32] = "";
+    sscanf(line, "%15s %63s %31s", what, name, value);
+
+    if (mystrcasecmp(what, "state")) control_state();
+    else if (mystrcasecmp(what, "counters")) control_counters();
+    else if (mystrcasecmp(what, "histograms")) control_histograms();
+    else if (mystrcasecmp(what, "capture"))
+        {
+            if (mystrcasecmp(name, "off"))
+                Stop_Capture();
+            else if ((name[0] == '\0') || !Start_Capture(name))
+                {
+                    control_printf("ERROR cannot capture to %s\n", name);
+                    return;
+                }
+            control_printf("OK\n");
+        }
+    else if (mystrcasecmp(what, "reload"))
+        {
+            important("control: reload\n");
+            sig_refresh(0);
+            control_printf("OK\n");
+        }
+    else if (mystrcasecmp(what, "event") || mystrcasecmp(what, "status"))
+        {
+            DEVICE d = find_device(name);
+            if (d == NULL)
+                {
+                    control_printf("ERROR no device %s\n", name);
+                    return;
+                }
+            if (mystrcasecmp(what, "event"))
+                {
+                    important("control: event on %s\n", d->name);
+                    Process_Actual_DI_Event(d);
+                }
+            else
                 {
-                    if (ClientConnection > max_fd) max_fd = ClientConnection;
-                    FD_SET(ClientConnection, &rfds);
+                    enum DeviceStatus status = decode_status(value);
+                    if (!mystrcasecmp(value, Format_Device_Status(status)))
+                        {
+                            control_printf("ERROR no status %s\n", value);
+                            return;
+                        }
+                    important("control: status of %s to %s\n", d->name, value);
+                    setStatus(d, status);
                 }
+            control_printf("OK\n");
+        }
+    else if (mystrcasecmp(what, "help"))
+        {
+            control_printf("OK\n");
+            control_printf("state\ncounters\nhistograms\nevent DEVICE\n");
+            control_printf("status DEVICE Active|Error|Failed|OutofService\n");
+            control_printf("capture NAME|off\nreload\n");
+        }
+    else
+        control_printf("ERROR unknown request %s\n", what);
+}
 
-            FD_ZERO(&wfds);
-            xfds = rfds;
 
-            /* set the polling time-out, in seconds and microseconds */
-            Timer->tv_sec = 0;
-            Timer->tv_usec = pollingDelay;            
+/* answer each whole line we have; FALSE if we had to close */
+Boolean control_lines(struct CONTROL *k)
+{
+    STRING nl;
+    while ((nl = memchr(k->line, '\n', k->n)) != NULL)
+        {
+            COUNTER start = Microseconds();
+            *nl = '\0';
+            if ((nl > k->line) && (nl[-1] == '\r')) nl[-1] = '\0';
+
+            Control_Reply.n = 0;
+            control_request(k->line);
+            AppendBuffer(&Control_Reply, "\n");
+
+            int used = nl + 1 - k->line;
+            k->n -= used;
+            memmove(k->line, nl + 1, k->n);
+
+            /* a reply is small, so if there is no room for it, the
+               client is not reading them */
+            int rc = send(k->source.fd, Control_Reply.b, Control_Reply.n, MSG_DONTWAIT | MSG_NOSIGNAL);
+            Count_Time(&Control_Times, start);
+            if (rc != Control_Reply.n)
+                {
+                    important("control: cannot send reply on FD %d\n", k->source.fd);
+                    close_Control(k);
+                    return(FALSE);
+                }
+        }
+    return(TRUE);
+}
 
-            /* wait for input */
-            int rc = select(max_fd + 1, &rfds, &wfds, &xfds, Timer);
-            // if (debug) fprintf(stderr,"select(...) = 0x%X\n", rc);
-            
-            /* check for error */
+void Control_Ready(struct SOURCE *s, UINT32 events)
+{
+    struct CONTROL *k = CAST(struct CONTROL *, s);
+    while (k->source.fd != INVALID_SOCKET)
+        {
+            if (k->n == CONTROL_LINE_SIZE)
+                {
+                    important("control: request too long on FD %d\n", k->source.fd);
+                    close_Control(k);
+                    return;
+                }
+            int rc = recv(k->source.fd, k->line + k->n, CONTROL_LINE_SIZE - k->n, MSG_DONTWAIT);
             if (rc < 0)
                 {
-                    /* check for a signal; just continue if so */
                     if (errno == EINTR) continue;
-                    
-                    important("error on socket select\n");
-                    perror("select");
-                    return;
+                    if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return;
                 }
-
-            /* check for time-out */
-            if (rc == 0)
+            if (rc <= 0)
                 {
-                    Poll_for_DI_Event();
-                    continue;
+                    close_Control(k);
+                    return;
                 }
+            k->n += rc;
+            if (!control_lines(k)) return;
+        }
+}
 
-            /* see if we have CVM wanting to talk to us */
-            if (FD_ISSET(ServerConnection, &rfds))
+void Accept_Control(struct SOURCE *s, UINT32 events)
+{
+    while (TRUE)
+        {
+            FileDesc fd = accept4(s->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0)
                 {
-                    ClientConnection = Accept_Client(ServerConnection);
+                    if (errno == EINTR) continue;
+                    return;
                 }
 
-            /* only other possibility is we have a message ! */            
-            if ((ClientConnection != INVALID_SOCKET) && FD_ISSET(ClientConnection, &rfds))
+            int i;
+            for (i = 0; i < MAX_CONTROL_CLIENTS; i++)
+                if (Controls[i].source.fd == INVALID_SOCKET) break;
+            if (i == MAX_CONTROL_CLIENTS)
                 {
-                    Read_and_Reply_to_CVM();
+                    important("control: too many clients; refuse FD %d\n", fd);
+                    close(fd);
+                    continue;
                 }
+
+            struct CONTROL *k = &Controls[i];
+            k->source.fd = fd;
+            k->source.ready = Control_Ready;
+            k->n = 0;
+            Watch(&k->source, EPOLLIN | EPOLLRDHUP | EPOLLET);
+        }
+}
+
+
+void Setup_Control_Socket(void)
+{
+    Start_Time = time(NULL);
+    Control_Reply.length = 1024;
+    Control_Reply.b = CAST(STRING, malloc(Control_Reply.length));
+
+    int i;
+    for (i = 0; i < MAX_CONTROL_CLIENTS; i++)
+        {
+            Controls[i].source.fd = INVALID_SOCKET;
+#ifdef USE_IO_URING
+            Controls[i].source.watch = 0;
+#endif
+        }
+    if (ControlSocketName == NULL) return;
+
+    struct sockaddr_un *addr = &Control_Address;
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(ControlSocketName) >= sizeof(addr->sun_path))
+        {
+            important("control socket name %s is too long\n", ControlSocketName);
+            return;
+        }
+    strcpy(addr->sun_path, ControlSocketName);
+
+    FileDesc fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        {
+            important("cannot create control socket: %d\n", errno);
+            return;
+        }
+
+    /* we have the CVM port, so one left here is from a program that
+       is gone; only we (and root) may use it */
+    unlink(addr->sun_path);
+    mode_t mask = umask(077);
+    int rc = bind(fd, (struct sockaddr *)addr, sizeof(*addr));
+    umask(mask);
+    if ((rc < 0) || (listen(fd, MAX_CONTROL_CLIENTS) < 0))
+        {
+            important("cannot establish control socket %s: %d\n", ControlSocketName, errno);
+            close(fd);
+            return;
+        }
+
+    Control_Source.fd = fd;
+    Control_Source.ready = Accept_Control;
+    Watch(&Control_Source, EPOLLIN | EPOLLET);
+}
+
+/* for the export child, which needs none of them */
+void Close_Control_Sockets(void)
+{
+    int i;
+    for (i = 0; i < MAX_CONTROL_CLIENTS; i++)
+        if (Controls[i].source.fd != INVALID_SOCKET) close(Controls[i].source.fd);
+    if (Control_Source.fd != INVALID_SOCKET) close(Control_Source.fd);
+}
+
+void Finish_Control_Socket(void)
+{
+    int i;
+    for (i = 0; i < MAX_CONTROL_CLIENTS; i++)
+        close_Control(&Controls[i]);
+    if (Control_Source.fd != INVALID_SOCKET)
+        {
+            close(Control_Source.fd);
+            unlink(Control_Address.sun_path);
+        }
+}
+
+
+/* ***************************************************************** */
+/*                                                                   */
+/*                                                                   */
+/* ***************************************************************** */
+
+/* The main loop of the program.  We wait for any of our
+   sources -- network activity, the polling timer, a signal --
+   and then do the appropriate thing in response.  This goes
+   on forever. */
+
+void main_loop(void)
+{
+    while (TRUE)
+        {
+            if (!Reactor_Dispatch()) return;
+            Free_Closed_Connections();
         }
-    
 }
 
 
@@ -2682,16 +8060,40 @@ int main(int argc, char **const argv)
         return(-1);
 
     Setup_for_Logging();
+    Check_Tag_Hash();
+    Compile_Validator();
+    Setup_Reactor();
+#ifdef USE_IO_URING
+    Setup_File_Ring();
+    Setup_Client_Ring();
+#endif
+    Setup_TLS();
     Setup_for_Network_Requests();
+    Setup_Outbound();
+    Setup_for_Export_Requests();
     Setup_for_IO_Polling();
+    Setup_Poll_Timer();
+    Setup_Housekeeping_Timer();
+    Setup_Control_Socket();
     Setup_Signal_Handlers();    
     
 
     main_loop();
 
+    Finish_Signal_Handlers();
+    Finish_Control_Socket();
+    Finish_Housekeeping_Timer();
+    Finish_Poll_Timer();
     Finish_for_IO_Polling();
+    Finish_for_Export_Requests();
+    Finish_Outbound();
     Finish_for_Network_Requests();
-    
-    fclose(log_file);
+    Stop_Capture();
+    Finish_TLS();
+    Finish_Reactor();
+
+    Flush_Log();
+    close(log_fd);
+    return(0);
 }
 
@@ -0,0 +1,142 @@
+/*
+   overheadctl.c -- ask the overhead program how it is doing, or
+   tell it to do something, through its control socket.
+
+       overheadctl [-s socket] request [arguments]
+
+   sends one request (see "The control socket" in overhead.c, or
+   "overheadctl help") and prints the lines of the reply.  The exit
+   status is 0 if the reply was OK, 1 if it was an error, and 2 if
+   we could not ask at all.  The socket is overhead.ctl in the
+   program's home directory, unless -s names another.
+
+   For example, from a monitoring script, once a second:
+
+       overheadctl counters
+       overheadctl status north OutofService
+       overheadctl event det1
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>        /* printf, fprintf */
+#include <stdlib.h>       /* exit */
+#include <string.h>       /* strlen, strcmp */
+#include <unistd.h>       /* read, write, close */
+#include <errno.h>        /* errno */
+#include <sys/socket.h>   /* socket, connect */
+#include <sys/un.h>       /* struct sockaddr_un */
+
+#define DEFAULT_CONTROL_SOCKET "/home/overhead/overhead.ctl"
+#define LINE_SIZE  256
+
+typedef char *STRING;
+typedef int Boolean;
+#define TRUE 1
+#define FALSE 0
+
+
+void usage(void)
+{
+    fprintf(stderr, "usage: overheadctl [-s socket] request [arguments]\n");
+    exit(2);
+}
+
+int connect_to(STRING name)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(name) >= sizeof(addr.sun_path))
+        {
+            fprintf(stderr, "overheadctl: socket name %s is too long\n", name);
+            exit(2);
+        }
+    strcpy(addr.sun_path, name);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if ((fd < 0) || (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0))
+        {
+            perror(name);
+            exit(2);
+        }
+    return(fd);
+}
+
+
+int main(int argc, char **argv)
+{
+    STRING name = DEFAULT_CONTROL_SOCKET;
+    int i = 1;
+    if ((i + 1 < argc) && (strcmp(argv[i], "-s") == 0))
+        {
+            name = argv[i + 1];
+            i += 2;
+        }
+    if (i >= argc) usage();
+
+    /* the request is the rest of the arguments, as one line */
+    char request[LINE_SIZE];
+    int n = 0;
+    for (; i < argc; i++)
+        {
+            int k = snprintf(request + n, sizeof(request) - n, "%s%s",
+                             ((n > 0) ? " " : ""), argv[i]);
+            if (k >= sizeof(request) - n - 1) usage();
+            n += k;
+        }
+    request[n++] = '\n';
+
+    int fd = connect_to(name);
+    if (write(fd, request, n) != n)
+        {
+            perror("write");
+            exit(2);
+        }
+
+    /* print the reply, up to the empty line that ends it */
+    char reply[4096];
+    int have = 0;
+    Boolean first = TRUE;
+    Boolean ok = FALSE;
+    while (TRUE)
+        {
+            int rc = read(fd, reply + have, sizeof(reply) - have);
+            if (rc < 0 && errno == EINTR) continue;
+            if (rc <= 0)
+                {
+                    fprintf(stderr, "overheadctl: the reply was cut short\n");
+                    exit(2);
+                }
+            have += rc;
+
+            STRING line = reply;
+            STRING nl;
+            while ((nl = memchr(line, '\n', have - (line - reply))) != NULL)
+                {
+                    *nl = '\0';
+                    if (line == nl)
+                        {
+                            close(fd);
+                            return(ok ? 0 : 1);
+                        }
+                    if (first)
+                        {
+                            ok = (strcmp(line, "OK") == 0);
+                            if (!ok) fprintf(stderr, "overheadctl: %s\n", line);
+                            first = FALSE;
+                        }
+                    else
+                        printf("%s\n", line);
+                    line = nl + 1;
+                }
+
+            /* keep the start of a line we do not have all of */
+            have -= line - reply;
+            memmove(reply, line, have);
+            if (have == sizeof(reply))
+                {
+                    fprintf(stderr, "overheadctl: a line of the reply is too long\n");
+                    exit(2);
+                }
+        }
+}